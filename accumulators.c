@@ -0,0 +1,517 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <gromacs/futil.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+
+#include "accumulators.h"
+
+/* Number of values converted at once when reading or writing an array */
+#define ACCUMULATOR_CHUNK 1024
+
+static void write_block(FILE *out, const void *buffer, size_t size, size_t n,
+        const char *fn) {
+    if (n > 0 && fwrite(buffer, size, n, out) != n) {
+        gmx_fatal(FARGS, "Error while writing the accumulators to %s\n", fn);
+    }
+}
+
+static void read_block(FILE *in, void *buffer, size_t size, size_t n,
+        const char *fn) {
+    if (n > 0 && fread(buffer, size, n, in) != n) {
+        gmx_fatal(FARGS, "%s is truncated\n", fn);
+    }
+}
+
+static void write_ints(FILE *out, int *values, int n, const char *fn) {
+    int32_t buffer[ACCUMULATOR_CHUNK];
+    int start, count, i;
+    for (start = 0; start < n; start += ACCUMULATOR_CHUNK) {
+        count = min(ACCUMULATOR_CHUNK, n - start);
+        for (i = 0; i < count; ++i) {
+            buffer[i] = values[start + i];
+        }
+        write_block(out, buffer, sizeof(int32_t), count, fn);
+    }
+}
+
+/** Read an array of int32 and add it to "values"
+ */
+static void add_ints(FILE *in, int *values, int n, const char *fn) {
+    int32_t buffer[ACCUMULATOR_CHUNK];
+    int start, count, i;
+    for (start = 0; start < n; start += ACCUMULATOR_CHUNK) {
+        count = min(ACCUMULATOR_CHUNK, n - start);
+        read_block(in, buffer, sizeof(int32_t), count, fn);
+        for (i = 0; i < count; ++i) {
+            values[start + i] += buffer[i];
+        }
+    }
+}
+
+/** Read an array of reals and add it to "values"
+ */
+static void add_reals(FILE *in, real *values, int n, const char *fn) {
+    real buffer[ACCUMULATOR_CHUNK];
+    int start, count, i;
+    for (start = 0; start < n; start += ACCUMULATOR_CHUNK) {
+        count = min(ACCUMULATOR_CHUNK, n - start);
+        read_block(in, buffer, sizeof(real), count, fn);
+        for (i = 0; i < count; ++i) {
+            values[start + i] += buffer[i];
+        }
+    }
+}
+
+/** Read the thickness sampling and the window statistics of a section
+ */
+static int32_t *read_stats(FILE *in, double *values[3], int n,
+        const char *fn) {
+    int32_t *other;
+    int i;
+
+    snew(other, n);
+    read_block(in, other, sizeof(int32_t), n, fn);
+    for (i = 0; i < 3; ++i) {
+        snew(values[i], n);
+        read_block(in, values[i], sizeof(double), n, fn);
+    }
+    return other;
+}
+
+static void free_stats(int32_t *other, double *values[3]) {
+    int i;
+    for (i = 0; i < 3; ++i) {
+        sfree(values[i]);
+    }
+    sfree(other);
+}
+
+/** Read the thickness sampling and window statistics of a section and
+ * combine them with the ones of a mode object
+ */
+static void merge_stats(FILE *in, WindowStats *stats, int *sampling, int n,
+        const char *fn) {
+    int32_t *other;
+    double *values[3];
+    int i;
+
+    other = read_stats(in, values, n, fn);
+    for (i = 0; i < n; ++i) {
+        window_stats_merge(stats, i, sampling[i], values[0][i], values[1][i],
+                values[2][i], other[i]);
+        sampling[i] += other[i];
+    }
+    free_stats(other, values);
+}
+
+static void write_stats(FILE *out, WindowStats *stats, const char *fn) {
+    write_block(out, stats->mean, sizeof(double), stats->n, fn);
+    write_block(out, stats->m2, sizeof(double), stats->n, fn);
+    write_block(out, stats->w2, sizeof(double), stats->n, fn);
+}
+
+/* The cells of a grid are in row-major order in the files, but in the
+ * storage order of the grid in memory; they are converted tile by tile.
+ * The tiles that a tiled grid does not store are written from its empty
+ * tile, and only the tiles with a non zero value are added when reading. */
+
+static void write_grid_reals(FILE *out, GridHeight *grid, real *values,
+        const char *fn) {
+    int tile;
+    for (tile = 0; tile < grid->ntiles; ++tile) {
+        write_block(out, values + grid_tile_offset(grid, tile, FALSE),
+                sizeof(real), grid_tile_cells(grid, tile), fn);
+    }
+}
+
+static void write_grid_ints(FILE *out, GridHeight *grid, int *values,
+        const char *fn) {
+    int tile;
+    for (tile = 0; tile < grid->ntiles; ++tile) {
+        write_ints(out, values + grid_tile_offset(grid, tile, FALSE),
+                grid_tile_cells(grid, tile), fn);
+    }
+}
+
+static void write_grid_doubles(FILE *out, GridHeight *grid, double *values,
+        const char *fn) {
+    int tile;
+    for (tile = 0; tile < grid->ntiles; ++tile) {
+        write_block(out, values + grid_tile_offset(grid, tile, FALSE),
+                sizeof(double), grid_tile_cells(grid, tile), fn);
+    }
+}
+
+/** Read a grid of reals and add it to "*values", one of the buffers of
+ * "grid"; the buffer moves when a tile is added
+ */
+static void add_grid_reals(FILE *in, GridHeight *grid, real **values,
+        const char *fn) {
+    real buffer[GRID_TILE];
+    gmx_bool bEmpty;
+    int tile, offset, count, i;
+    for (tile = 0; tile < grid->ntiles; ++tile) {
+        count = grid_tile_cells(grid, tile);
+        read_block(in, buffer, sizeof(real), count, fn);
+        bEmpty = grid->bTiled;
+        for (i = 0; i < count && bEmpty; ++i) {
+            bEmpty = (buffer[i] == 0);
+        }
+        if (!bEmpty) {
+            offset = grid_tile_offset(grid, tile, TRUE);
+            for (i = 0; i < count; ++i) {
+                (*values)[offset + i] += buffer[i];
+            }
+        }
+    }
+}
+
+static void add_grid_ints(FILE *in, GridHeight *grid, int **values,
+        const char *fn) {
+    int32_t buffer[GRID_TILE];
+    gmx_bool bEmpty;
+    int tile, offset, count, i;
+    for (tile = 0; tile < grid->ntiles; ++tile) {
+        count = grid_tile_cells(grid, tile);
+        read_block(in, buffer, sizeof(int32_t), count, fn);
+        bEmpty = grid->bTiled;
+        for (i = 0; i < count && bEmpty; ++i) {
+            bEmpty = (buffer[i] == 0);
+        }
+        if (!bEmpty) {
+            offset = grid_tile_offset(grid, tile, TRUE);
+            for (i = 0; i < count; ++i) {
+                (*values)[offset + i] += buffer[i];
+            }
+        }
+    }
+}
+
+/** Same as merge_stats for a grid
+ */
+static void merge_grid_stats(FILE *in, GridHeight *grid, const char *fn) {
+    int32_t *other;
+    double *values[3];
+    gmx_bool bEmpty;
+    int tile, first, offset, count, cell, i;
+
+    other = read_stats(in, values, grid->ncells, fn);
+    for (tile = 0; tile < grid->ntiles; ++tile) {
+        first = tile * GRID_TILE;
+        count = grid_tile_cells(grid, tile);
+        bEmpty = grid->bTiled;
+        for (i = 0; i < count && bEmpty; ++i) {
+            bEmpty = (other[first + i] == 0);
+        }
+        if (bEmpty) {
+            continue;
+        }
+        offset = grid_tile_offset(grid, tile, TRUE);
+        for (i = 0; i < count; ++i) {
+            cell = offset + i;
+            window_stats_merge(&grid->stats, cell, grid->sampling[2][cell],
+                    values[0][first + i], values[1][first + i],
+                    values[2][first + i], other[first + i]);
+            grid->sampling[2][cell] += other[first + i];
+        }
+    }
+    free_stats(other, values);
+}
+
+/* Number of int32 settings and counters at the start of a section */
+#define SECTION_VALUES 6
+
+/* Number of float64 box sums and settings that follow them in a grid
+ * section */
+#define GRID_WIDTHS 6
+
+/** Write an accumulator file
+ *
+ * The file starts with a ACCUMULATOR_HEADER bytes long header in the native
+ * byte order:
+ *
+ *  - offset  0: magic string "GTHKACCU" (8 bytes)
+ *  - offset  8: int32, format version (5)
+ *  - offset 12: int32, byte order mark (0x01020304)
+ *  - offset 16: int32, size of a real in bytes (4 or 8)
+ *  - offset 20: int32, number of grid analyses
+ *  - offset 24: int32, number of distance analyses
+ *
+ * The header is followed by one section per grid analysis, then by one
+ * section per distance analysis, in the order the analyses were given.
+ *
+ * A grid section starts with the int32 -adt, the int32[2] shape of the
+ * grid, the int32 normal axis, the int32 frame count and the int32 frame
+ * count of the open -adt window. They are followed by the float64[2] sums of
+ * the box widths, the float64[2] sums of the box widths over the open
+ * window, the float64 width of the smoothing Gaussian (0 without
+ * smoothing), the float64 sum over the open window of the component along
+ * the first grid dimension of the box vector of the second one, the three
+ * height grids (the sums of the two leaflets over the open window, then the
+ * sum of the thickness weighted by the sampling), the three int32 sampling
+ * grids, and the float64 weighted mean, sum of the weighted squared
+ * deviations and sum of the squared weights of the window thickness of each
+ * cell.
+ *
+ * A distance section starts with the int32 -adt, the int32 number of bins,
+ * the int32 normal axis, an int32 set to 1 if the center of mass is used,
+ * the int32 frame count and an int32 set to 1 if the distance is the one to
+ * the nearest reference molecule. They are followed by the
+ * float64 sum of the box widths, the three height profiles, the three int32
+ * sampling profiles, and the three float64 window statistics profiles.
+ */
+void write_accumulators(t_modes modes, const char *fn) {
+    FILE *out;
+    char header[ACCUMULATOR_HEADER];
+    int32_t values[SECTION_VALUES];
+    double widths[GRID_WIDTHS];
+    GridHeight *grid;
+    DistMode *dist;
+    int a, i;
+
+    values[0] = 5;
+    values[1] = 0x01020304;
+    values[2] = sizeof(real);
+    values[3] = modes.ngrids;
+    values[4] = modes.ndists;
+    memset(header, 0, ACCUMULATOR_HEADER);
+    memcpy(header, "GTHKACCU", 8);
+    memcpy(header + 8, values, 5 * sizeof(int32_t));
+
+    out = ffopen(fn, "wb");
+    write_block(out, header, 1, ACCUMULATOR_HEADER, fn);
+    for (a = 0; a < modes.ngrids; ++a) {
+        grid = modes.grids[a];
+        values[0] = grid->adt;
+        values[1] = grid->shape[0];
+        values[2] = grid->shape[1];
+        values[3] = grid->axis[0];
+        values[4] = grid->nframes;
+        values[5] = grid->window_nframes;
+        for (i = 0; i < 2; ++i) {
+            widths[i] = grid->box_width[i];
+            widths[2 + i] = grid->window_box_width[i];
+        }
+        widths[4] = grid_sigma(grid);
+        widths[5] = grid->window_shear;
+        write_block(out, values, sizeof(int32_t), SECTION_VALUES, fn);
+        write_block(out, widths, sizeof(double), GRID_WIDTHS, fn);
+        for (i = 0; i < 3; ++i) {
+            write_grid_reals(out, grid, grid->grids[i], fn);
+        }
+        for (i = 0; i < 3; ++i) {
+            write_grid_ints(out, grid, grid->sampling[i], fn);
+        }
+        write_grid_doubles(out, grid, grid->stats.mean, fn);
+        write_grid_doubles(out, grid, grid->stats.m2, fn);
+        write_grid_doubles(out, grid, grid->stats.w2, fn);
+    }
+    for (a = 0; a < modes.ndists; ++a) {
+        dist = modes.dists[a];
+        values[0] = dist->adt;
+        values[1] = dist->length;
+        values[2] = dist->axis[0];
+        values[3] = dist->bCOM;
+        values[4] = dist->nframes;
+        values[5] = dist->bRefMols;
+        widths[0] = dist->box_width;
+        write_block(out, values, sizeof(int32_t), SECTION_VALUES, fn);
+        write_block(out, widths, sizeof(double), 1, fn);
+        for (i = 0; i < 3; ++i) {
+            write_block(out, dist->height[i], sizeof(real), dist->length, fn);
+        }
+        for (i = 0; i < 3; ++i) {
+            write_ints(out, dist->sampling[i], dist->length, fn);
+        }
+        write_stats(out, &dist->stats, fn);
+    }
+    ffclose(out);
+}
+
+/** Read the header of an accumulator file and leave the file after it
+ */
+static void read_header(FILE *in, const char *fn, int *ngrids, int *ndists) {
+    char header[ACCUMULATOR_HEADER];
+    int32_t values[5];
+
+    read_block(in, header, 1, ACCUMULATOR_HEADER, fn);
+    memcpy(values, header + 8, sizeof(values));
+    if (strncmp(header, "GTHKACCU", 8) != 0) {
+        gmx_fatal(FARGS, "%s is not an accumulator file\n", fn);
+    }
+    if (values[1] != 0x01020304) {
+        gmx_fatal(FARGS, "%s was written on a machine with a different byte "
+                "order\n", fn);
+    }
+    if (values[0] != 5) {
+        gmx_fatal(FARGS, "%s was written by another version of g_thickness\n",
+                fn);
+    }
+    if (values[2] != sizeof(real)) {
+        gmx_fatal(FARGS, "%s was written by a %s precision build\n", fn,
+                (values[2] == 8) ? "double" : "single");
+    }
+    *ngrids = values[3];
+    *ndists = values[4];
+}
+
+/** Size of the data following the box widths and the smoothing width of a
+ * grid section */
+static gmx_off_t grid_section_size(int32_t *values) {
+    return (gmx_off_t)values[1] * values[2] * 3
+        * (sizeof(real) + sizeof(int32_t) + sizeof(double));
+}
+
+/** Size of the data following the settings of a distance section */
+static gmx_off_t dist_section_size(int32_t *values) {
+    return sizeof(double) + (gmx_off_t)values[1] * 3
+        * (sizeof(real) + sizeof(int32_t) + sizeof(double));
+}
+
+/** Check that the analyses of a kind match the ones of a file
+ */
+static void check_count(int requested, int nfile, const char *kind,
+        const char *fn) {
+    if (requested > 0 && requested != nfile) {
+        gmx_fatal(FARGS, "%s holds %d %s analyses, but %d are requested\n",
+                fn, nfile, kind, requested);
+    }
+}
+
+void read_accumulator_settings(const char *fn, AnalysisSpec *specs,
+        int nspecs) {
+    FILE *in;
+    int32_t (*grid_values)[SECTION_VALUES] = NULL;
+    int32_t (*dist_values)[SECTION_VALUES] = NULL;
+    double (*grid_widths)[GRID_WIDTHS] = NULL;
+    int32_t *values;
+    int ngrids, ndists, nrequested[2];
+    int grid = 0, dist = 0;
+    int i;
+
+    nrequested[0] = 0;
+    nrequested[1] = 0;
+    for (i = 0; i < nspecs; ++i) {
+        nrequested[specs[i].bGrid ? 0 : 1] += 1;
+    }
+    in = ffopen(fn, "rb");
+    read_header(in, fn, &ngrids, &ndists);
+    check_count(nrequested[0], ngrids, "grid", fn);
+    check_count(nrequested[1], ndists, "distance", fn);
+    snew(grid_values, ngrids);
+    snew(grid_widths, ngrids);
+    snew(dist_values, ndists);
+    for (i = 0; i < ngrids; ++i) {
+        read_block(in, grid_values[i], sizeof(int32_t), SECTION_VALUES, fn);
+        read_block(in, grid_widths[i], sizeof(double), GRID_WIDTHS, fn);
+        gmx_fseek(in, grid_section_size(grid_values[i]), SEEK_CUR);
+    }
+    for (i = 0; i < ndists; ++i) {
+        read_block(in, dist_values[i], sizeof(int32_t), SECTION_VALUES, fn);
+        gmx_fseek(in, dist_section_size(dist_values[i]), SEEK_CUR);
+    }
+    ffclose(in);
+
+    for (i = 0; i < nspecs; ++i) {
+        if (specs[i].bGrid) {
+            specs[i].sigma = grid_widths[grid][4];
+            values = grid_values[grid++];
+            specs[i].adt = values[0];
+            specs[i].sl = values[1];
+            specs[i].sl2 = values[2];
+            specs[i].axis = values[3];
+        }
+        else {
+            values = dist_values[dist++];
+            specs[i].adt = values[0];
+            specs[i].sl = values[1];
+            specs[i].axis = values[2];
+            specs[i].bCOM = values[3];
+            specs[i].bRefMols = values[5];
+        }
+    }
+    sfree(grid_values);
+    sfree(grid_widths);
+    sfree(dist_values);
+}
+
+static void merge_file(t_modes modes, const char *fn) {
+    FILE *in;
+    int32_t values[SECTION_VALUES];
+    double widths[GRID_WIDTHS];
+    GridHeight *grid;
+    DistMode *dist;
+    int ngrids, ndists;
+    int a, i;
+
+    in = ffopen(fn, "rb");
+    read_header(in, fn, &ngrids, &ndists);
+    check_count(modes.ngrids, ngrids, "grid", fn);
+    check_count(modes.ndists, ndists, "distance", fn);
+
+    for (a = 0; a < ngrids; ++a) {
+        read_block(in, values, sizeof(int32_t), SECTION_VALUES, fn);
+        read_block(in, widths, sizeof(double), GRID_WIDTHS, fn);
+        if (modes.ngrids == 0) {
+            /* Skip the section */
+            gmx_fseek(in, grid_section_size(values), SEEK_CUR);
+            continue;
+        }
+        grid = modes.grids[a];
+        if (values[0] != grid->adt || values[1] != grid->shape[0]
+                || values[2] != grid->shape[1] || values[3] != grid->axis[0]
+                || (real)widths[4] != grid_sigma(grid)) {
+            gmx_fatal(FARGS, "Grid analysis %d of %s was not written with the "
+                    "same settings as in the other accumulator files\n",
+                    a + 1, fn);
+        }
+        grid->nframes += values[4];
+        grid->window_nframes += values[5];
+        for (i = 0; i < 2; ++i) {
+            grid->box_width[i] += widths[i];
+            grid->window_box_width[i] += widths[2 + i];
+        }
+        grid->window_shear += widths[5];
+        for (i = 0; i < 3; ++i) {
+            add_grid_reals(in, grid, &grid->grids[i], fn);
+        }
+        for (i = 0; i < 2; ++i) {
+            add_grid_ints(in, grid, &grid->sampling[i], fn);
+        }
+        grid_find_touched(grid);
+        merge_grid_stats(in, grid, fn);
+    }
+    for (a = 0; a < ndists && modes.ndists > 0; ++a) {
+        read_block(in, values, sizeof(int32_t), SECTION_VALUES, fn);
+        dist = modes.dists[a];
+        if (values[0] != dist->adt || values[1] != dist->length
+                || values[2] != dist->axis[0] || values[3] != dist->bCOM
+                || values[5] != dist->bRefMols) {
+            gmx_fatal(FARGS, "Distance analysis %d of %s was not written with "
+                    "the same settings as in the other accumulator files\n",
+                    a + 1, fn);
+        }
+        read_block(in, widths, sizeof(double), 1, fn);
+        dist->nframes += values[4];
+        dist->box_width += widths[0];
+        for (i = 0; i < 3; ++i) {
+            add_reals(in, dist->height[i], dist->length, fn);
+        }
+        for (i = 0; i < 2; ++i) {
+            add_ints(in, dist->sampling[i], dist->length, fn);
+        }
+        dist_find_touched(dist);
+        merge_stats(in, &dist->stats, dist->sampling[2], dist->length, fn);
+    }
+    ffclose(in);
+}
+
+void merge_accumulators(t_modes modes, char **fns, int nfiles) {
+    int i;
+    for (i = 0; i < nfiles; ++i) {
+        merge_file(modes, fns[i]);
+    }
+    fprintf(stderr, "Merged %d accumulator file(s)\n", nfiles);
+}
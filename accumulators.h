@@ -0,0 +1,36 @@
+#ifndef _accumulators_h
+#define _accumulators_h
+
+#include <gromacs/typedefs.h>
+
+#include "analyses.h"
+#include "modes.h"
+
+/* Size in bytes of the header of an accumulator file */
+#define ACCUMULATOR_HEADER 64
+
+/** Write the raw sums and counts of the mode objects, before averaging
+ *
+ * The file can be merged with the ones of other runs by merge_accumulators;
+ * it must be written before grid_end and dist_end.
+ */
+void write_accumulators(t_modes modes, const char *fn);
+
+/** Take the settings of the analyses from an accumulator file
+ *
+ * The grid and distance analyses of "specs" get, in order, the resolution,
+ * normal axis, -adt, -sigma, -com and -refmol of the ones of the file. There
+ * has to be as many analyses of a kind as in the file, or none.
+ */
+void read_accumulator_settings(const char *fn, AnalysisSpec *specs,
+        int nspecs);
+
+/** Add the sums and counts of accumulator files to the mode objects
+ *
+ * The files have to come from runs with the same analyses as the mode
+ * objects; the analyses of a kind that are not in the mode objects are
+ * skipped.
+ */
+void merge_accumulators(t_modes modes, char **fns, int nfiles);
+
+#endif /* _accumulators_h */
@@ -0,0 +1,353 @@
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#include <gromacs/futil.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/index.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/string2.h>
+
+#include "analyses.h"
+
+static char *copy_string(const char *txt) {
+    return txt ? gmx_strdup(txt) : NULL;
+}
+
+int add_analysis(AnalysisSpec **specs, int nspecs, AnalysisSpec *spec) {
+    AnalysisSpec *copy;
+    srenew(*specs, nspecs + 1);
+    copy = &(*specs)[nspecs];
+    *copy = *spec;
+    copy->out_fn = copy_string(spec->out_fn);
+    copy->sampling_fn = copy_string(spec->sampling_fn);
+    copy->error_fn = copy_string(spec->error_fn);
+    copy->windows_fn = copy_string(spec->windows_fn);
+    copy->group = copy_string(spec->group);
+    return nspecs + 1;
+}
+
+void clean_analysis_specs(AnalysisSpec *specs, int nspecs) {
+    int i;
+    for (i = 0; i < nspecs; ++i) {
+        sfree(specs[i].out_fn);
+        sfree(specs[i].sampling_fn);
+        sfree(specs[i].error_fn);
+        sfree(specs[i].windows_fn);
+        sfree(specs[i].group);
+    }
+    sfree(specs);
+}
+
+/** Build the name of the sampling output from the one of the thickness
+ * output: "grid.dat" gives "grid_sampling.dat"
+ */
+static char *sampling_name(const char *out_fn) {
+    const char *ext;
+    char *name;
+    size_t base;
+    ext = strrchr(out_fn, '.');
+    if (!ext || strchr(ext, '/')) {
+        ext = out_fn + strlen(out_fn);
+    }
+    base = ext - out_fn;
+    snew(name, strlen(out_fn) + strlen("_sampling") + 1);
+    memcpy(name, out_fn, base);
+    strcpy(name + base, "_sampling");
+    strcat(name, ext);
+    return name;
+}
+
+static int parse_int(const char *value, const char *fn, int line) {
+    char *end;
+    long result = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || result < INT_MIN
+            || result > INT_MAX) {
+        gmx_fatal(FARGS, "%s, line %d: \"%s\" is not an integer\n", fn, line,
+                value);
+    }
+    return (int)result;
+}
+
+static real parse_real(const char *value, const char *fn, int line) {
+    char *end;
+    double result = strtod(value, &end);
+    if (*value == '\0' || *end != '\0') {
+        gmx_fatal(FARGS, "%s, line %d: \"%s\" is not a number\n", fn, line,
+                value);
+    }
+    return (real)result;
+}
+
+static gmx_bool parse_bool(const char *value, const char *fn, int line) {
+    if (gmx_strcasecmp(value, "yes") == 0
+            || gmx_strcasecmp(value, "true") == 0
+            || strcmp(value, "1") == 0) {
+        return TRUE;
+    }
+    if (gmx_strcasecmp(value, "no") == 0
+            || gmx_strcasecmp(value, "false") == 0
+            || strcmp(value, "0") == 0) {
+        return FALSE;
+    }
+    gmx_fatal(FARGS, "%s, line %d: \"%s\" is not yes or no\n", fn, line,
+            value);
+    return FALSE;
+}
+
+static int parse_axis(const char *value, const char *fn, int line) {
+    if (strlen(value) != 1 || toupper(value[0]) < 'X'
+            || toupper(value[0]) > 'Z') {
+        gmx_fatal(FARGS, "%s, line %d: \"%s\" is not x, y or z\n", fn, line,
+                value);
+    }
+    return toupper(value[0]) - 'X';
+}
+
+static int parse_storage(const char *value, const char *fn, int line) {
+    if (gmx_strcasecmp(value, "auto") == 0) {
+        return GRID_STORAGE_AUTO;
+    }
+    if (gmx_strcasecmp(value, "dense") == 0) {
+        return GRID_STORAGE_DENSE;
+    }
+    if (gmx_strcasecmp(value, "tiled") == 0) {
+        return GRID_STORAGE_TILED;
+    }
+    gmx_fatal(FARGS, "%s, line %d: \"%s\" is not auto, dense or tiled\n", fn,
+            line, value);
+    return GRID_STORAGE_AUTO;
+}
+
+/** Apply one key=value setting to an analysis
+ */
+static void set_key(AnalysisSpec *spec, const char *key, const char *value,
+        const char *fn, int line) {
+    /* Keys of both kinds of analyses */
+    if (strcmp(key, "sl") == 0) {
+        spec->sl = parse_int(value, fn, line);
+        return;
+    }
+    if (strcmp(key, "adt") == 0) {
+        spec->adt = parse_int(value, fn, line);
+        if (spec->adt == 0) {
+            gmx_fatal(FARGS, "%s, line %d: adt can not be 0\n", fn, line);
+        }
+        return;
+    }
+    if (strcmp(key, "d") == 0) {
+        spec->axis = parse_axis(value, fn, line);
+        return;
+    }
+    if (spec->bGrid) {
+        if (strcmp(key, "sl2") == 0) {
+            spec->sl2 = parse_int(value, fn, line);
+            return;
+        }
+        if (strcmp(key, "binary") == 0) {
+            spec->bBinary = parse_bool(value, fn, line);
+            return;
+        }
+        if (strcmp(key, "storage") == 0) {
+            spec->storage = parse_storage(value, fn, line);
+            return;
+        }
+        if (strcmp(key, "sigma") == 0) {
+            spec->sigma = parse_real(value, fn, line);
+            return;
+        }
+        if (strcmp(key, "og") == 0) {
+            sfree(spec->out_fn);
+            spec->out_fn = gmx_strdup(value);
+            return;
+        }
+        if (strcmp(key, "ogs") == 0) {
+            sfree(spec->sampling_fn);
+            spec->sampling_fn = gmx_strdup(value);
+            return;
+        }
+        if (strcmp(key, "oge") == 0) {
+            sfree(spec->error_fn);
+            spec->error_fn = gmx_strdup(value);
+            return;
+        }
+        if (strcmp(key, "ow") == 0) {
+            sfree(spec->windows_fn);
+            spec->windows_fn = gmx_strdup(value);
+            return;
+        }
+    }
+    else {
+        if (strcmp(key, "com") == 0) {
+            spec->bCOM = parse_bool(value, fn, line);
+            return;
+        }
+        if (strcmp(key, "refmol") == 0) {
+            spec->bRefMols = parse_bool(value, fn, line);
+            return;
+        }
+        if (strcmp(key, "od") == 0) {
+            sfree(spec->out_fn);
+            spec->out_fn = gmx_strdup(value);
+            return;
+        }
+        if (strcmp(key, "ods") == 0) {
+            sfree(spec->sampling_fn);
+            spec->sampling_fn = gmx_strdup(value);
+            return;
+        }
+        if (strcmp(key, "ode") == 0) {
+            sfree(spec->error_fn);
+            spec->error_fn = gmx_strdup(value);
+            return;
+        }
+        if (strcmp(key, "group") == 0) {
+            sfree(spec->group);
+            spec->group = gmx_strdup(value);
+            return;
+        }
+    }
+    gmx_fatal(FARGS, "%s, line %d: unknown setting \"%s\" for a %s "
+            "analysis\n", fn, line, key, spec->bGrid ? "grid" : "dist");
+}
+
+int read_analysis_file(const char *fn, AnalysisSpec *defaults,
+        AnalysisSpec **specs, int nspecs) {
+    FILE *in;
+    char text[ANALYSIS_LINE_LENGTH];
+    char *kind, *token, *value, *comment;
+    AnalysisSpec spec;
+    int line = 0;
+
+    in = ffopen(fn, "r");
+    while (fgets(text, sizeof(text), in)) {
+        line += 1;
+        if (!strchr(text, '\n') && !feof(in)) {
+            gmx_fatal(FARGS, "%s, line %d: the line is too long\n", fn, line);
+        }
+        comment = strchr(text, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        kind = strtok(text, " \t\r\n");
+        if (!kind) {
+            continue;
+        }
+        spec = *defaults;
+        spec.sl2 = -1;
+        spec.out_fn = NULL;
+        spec.sampling_fn = NULL;
+        spec.error_fn = NULL;
+        spec.windows_fn = NULL;
+        spec.group = NULL;
+        if (strcmp(kind, "grid") == 0) {
+            spec.bGrid = TRUE;
+        }
+        else if (strcmp(kind, "dist") == 0) {
+            spec.bGrid = FALSE;
+        }
+        else {
+            gmx_fatal(FARGS, "%s, line %d: unknown analysis \"%s\"; use grid "
+                    "or dist\n", fn, line, kind);
+        }
+        while ((token = strtok(NULL, " \t\r\n"))) {
+            value = strchr(token, '=');
+            if (!value) {
+                gmx_fatal(FARGS, "%s, line %d: \"%s\" is not a key=value "
+                        "setting\n", fn, line, token);
+            }
+            *value = '\0';
+            set_key(&spec, token, value + 1, fn, line);
+        }
+        if (!spec.out_fn) {
+            gmx_fatal(FARGS, "%s, line %d: the output file is missing (%s)\n",
+                    fn, line, spec.bGrid ? "og" : "od");
+        }
+        if (!spec.sampling_fn) {
+            spec.sampling_fn = sampling_name(spec.out_fn);
+        }
+        if (spec.sl2 <= 0) {
+            spec.sl2 = spec.sl;
+        }
+        nspecs = add_analysis(specs, nspecs, &spec);
+        sfree(spec.out_fn);
+        sfree(spec.sampling_fn);
+        sfree(spec.error_fn);
+        sfree(spec.windows_fn);
+        sfree(spec.group);
+    }
+    ffclose(in);
+    return nspecs;
+}
+
+/** Get a copy of the atoms of a group of an index file, found by name
+ */
+static atom_id *named_group(const char *index_fn, const char *name,
+        int *size) {
+    t_blocka *groups;
+    char **names;
+    atom_id *index = NULL;
+    int found = -1;
+    int g, i;
+
+    groups = init_index(index_fn, &names);
+    for (g = 0; g < groups->nr; ++g) {
+        if (found < 0 && gmx_strcasecmp(names[g], name) == 0) {
+            found = g;
+        }
+    }
+    if (found < 0) {
+        gmx_fatal(FARGS, "There is no group named %s in %s\n", name,
+                index_fn);
+    }
+    *size = groups->index[found + 1] - groups->index[found];
+    snew(index, *size);
+    for (i = 0; i < *size; ++i) {
+        index[i] = groups->a[groups->index[found] + i];
+    }
+    for (g = 0; g < groups->nr; ++g) {
+        sfree(names[g]);
+    }
+    sfree(names);
+    done_blocka(groups);
+    sfree(groups);
+    return index;
+}
+
+/** Get a copy of the atoms of a group chosen by the user
+ */
+static atom_id *asked_group(t_topology *top, const char *index_fn,
+        int *size) {
+    atom_id *index;
+    char *name;
+
+    printf("Select reference group for distance calcultation:\n");
+    get_index(&(top->atoms), index_fn, 1, size, &index, &name);
+    sfree(name);
+    return index;
+}
+
+void build_analyses(Thickness *th, AnalysisSpec *specs, int nspecs,
+        const char *index_fn) {
+    AnalysisSpec *spec;
+    atom_id *ref_index;
+    int ref_size;
+    int i;
+
+    for (i = 0; i < nspecs; ++i) {
+        spec = &specs[i];
+        ref_index = NULL;
+        ref_size = 0;
+        if (!spec->bGrid && th->top) {
+            if (spec->group) {
+                ref_index = named_group(index_fn, spec->group, &ref_size);
+            }
+            else {
+                printf("Distance profile written in %s\n", spec->out_fn);
+                ref_index = asked_group(th->top, index_fn, &ref_size);
+            }
+        }
+        thickness_add_analysis(th, spec, ref_index, ref_size);
+        sfree(ref_index);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _analyses_h
+#define _analyses_h
+
+#include <gromacs/statutil.h>
+#include <gromacs/typedefs.h>
+
+#include "thickness.h"
+
+/* Longest line of an analysis file */
+#define ANALYSIS_LINE_LENGTH 4096
+
+/** Add an analysis to a list
+ *
+ * The strings of "spec" are copied. Return the new number of analyses.
+ */
+int add_analysis(AnalysisSpec **specs, int nspecs, AnalysisSpec *spec);
+
+/** Read the analyses described in a file and add them to a list
+ *
+ * The file holds one analysis per line: "grid" or "dist" followed by
+ * key=value settings. The settings that are not given are taken from
+ * "defaults". Return the new number of analyses.
+ */
+int read_analysis_file(const char *fn, AnalysisSpec *defaults,
+        AnalysisSpec **specs, int nspecs);
+
+void clean_analysis_specs(AnalysisSpec *specs, int nspecs);
+
+/** Add a list of analyses to a run
+ *
+ * The reference groups of the distance analyses are read from "index_fn",
+ * by name or interactively. When the run has no topology, no reference
+ * group is read; this is the case when accumulator files are merged.
+ */
+void build_analyses(Thickness *th, AnalysisSpec *specs, int nspecs,
+        const char *index_fn);
+
+#endif /* _analyses_h */
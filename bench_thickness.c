@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <gromacs/copyrite.h>
+#include <gromacs/futil.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/statutil.h>
+#include <gromacs/vec.h>
+#include <gromacs/xtcio.h>
+
+#include "grid_mode.h"
+#include "dist_mode.h"
+
+/** Synthetic bilayer used as benchmark input
+ *
+ * The frames are generated once, already wrapped in the box, so the timings
+ * only include the analysis.
+ */
+typedef struct Membrane {
+    int nlipids;        /* Number of lipids per leaflet */
+    int nprot;          /* Number of atoms in the reference protein */
+    int natoms;
+    int nframes;
+    rvec **frames;
+    matrix box;
+    atom_id *index[2];
+    int isize[2];
+    atom_id *ref_index;
+    t_topology top;
+} Membrane;
+
+static double wall_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static real uniform(void) {
+    return (real)rand() / ((real)RAND_MAX + 1);
+}
+
+/** Wrap a coordinate in [0, box)
+ */
+static real wrap(real coord, real box) {
+    coord -= box * floor(coord / box);
+    return (coord < box) ? coord : 0;
+}
+
+/** Generate a bilayer with an undulation and a cylindrical protein
+ *
+ * The lipids of each leaflet are on a jittered square lattice; the
+ * undulation travels with the frames. The protein spans the bilayer at the
+ * center of the box.
+ */
+static void build_membrane(Membrane *mem, int nlipids, int nprot,
+        int nframes, real box_xy, real undulation) {
+    int frame, leaflet, i, atom, side;
+    real box_z = 10.0, thickness = 4.0;
+    real x, y, phase, spacing, radius;
+
+    mem->nlipids = nlipids;
+    mem->nprot = nprot;
+    mem->natoms = 2 * nlipids + nprot;
+    mem->nframes = nframes;
+    clear_mat(mem->box);
+    mem->box[XX][XX] = box_xy;
+    mem->box[YY][YY] = box_xy;
+    mem->box[ZZ][ZZ] = box_z;
+
+    for (leaflet = 0; leaflet < 2; ++leaflet) {
+        mem->isize[leaflet] = nlipids;
+        snew(mem->index[leaflet], nlipids);
+        for (i = 0; i < nlipids; ++i) {
+            mem->index[leaflet][i] = leaflet * nlipids + i;
+        }
+    }
+    snew(mem->ref_index, max(nprot, 1));
+    for (i = 0; i < nprot; ++i) {
+        mem->ref_index[i] = 2 * nlipids + i;
+    }
+
+    /* Masses are all that the analysis needs from the topology */
+    mem->top.atoms.nr = mem->natoms;
+    snew(mem->top.atoms.atom, mem->natoms);
+    for (atom = 0; atom < mem->natoms; ++atom) {
+        mem->top.atoms.atom[atom].m = 12.0;
+    }
+
+    side = (int)ceil(sqrt(nlipids));
+    spacing = box_xy / side;
+    radius = sqrt(max(nprot, 1) * 0.01);
+    snew(mem->frames, nframes);
+    for (frame = 0; frame < nframes; ++frame) {
+        snew(mem->frames[frame], mem->natoms);
+        phase = 2 * M_PI * frame / nframes;
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            for (i = 0; i < nlipids; ++i) {
+                atom = mem->index[leaflet][i];
+                x = ((i % side) + uniform()) * spacing;
+                y = ((i / side) + uniform()) * spacing;
+                mem->frames[frame][atom][XX] = wrap(x, box_xy);
+                mem->frames[frame][atom][YY] = wrap(y, box_xy);
+                mem->frames[frame][atom][ZZ] = box_z / 2
+                    + (leaflet == 0 ? -0.5 : 0.5) * thickness
+                    + undulation * sin(2 * M_PI * x / box_xy + phase)
+                                 * cos(2 * M_PI * y / box_xy);
+            }
+        }
+        for (i = 0; i < nprot; ++i) {
+            atom = mem->ref_index[i];
+            x = radius * sqrt(uniform());
+            y = 2 * M_PI * uniform();
+            mem->frames[frame][atom][XX] = box_xy / 2 + x * cos(y);
+            mem->frames[frame][atom][YY] = box_xy / 2 + x * sin(y);
+            mem->frames[frame][atom][ZZ] = box_z / 2
+                + (uniform() - 0.5) * thickness;
+        }
+    }
+}
+
+static void clean_membrane(Membrane *mem) {
+    int frame;
+    for (frame = 0; frame < mem->nframes; ++frame) {
+        sfree(mem->frames[frame]);
+    }
+    sfree(mem->frames);
+    sfree(mem->index[0]);
+    sfree(mem->index[1]);
+    sfree(mem->ref_index);
+    sfree(mem->top.atoms.atom);
+}
+
+/** Write the frames of a membrane to an XTC trajectory, one picosecond
+ * apart
+ */
+static void write_membrane_traj(Membrane *mem, const char *fn) {
+    t_fileio *out;
+    int frame;
+
+    out = open_xtc(fn, "w");
+    for (frame = 0; frame < mem->nframes; ++frame) {
+        if (!write_xtc(out, mem->natoms, frame, frame, mem->box,
+                    mem->frames[frame], 1000)) {
+            gmx_fatal(FARGS, "Error while writing %s\n", fn);
+        }
+    }
+    close_xtc(out);
+}
+
+/** Write the first frame of a membrane as a GRO file
+ *
+ * Every atom is a residue named C with an atom named C, so a topology of a
+ * single atom type is enough to get a run input file.
+ */
+static void write_membrane_conf(Membrane *mem, const char *fn) {
+    FILE *out;
+    rvec *x = mem->frames[0];
+    int atom;
+
+    out = ffopen(fn, "w");
+    fprintf(out, "Synthetic bilayer\n%d\n", mem->natoms);
+    for (atom = 0; atom < mem->natoms; ++atom) {
+        fprintf(out, "%5d%-5s%5s%5d%8.3f%8.3f%8.3f\n", (atom + 1) % 100000,
+                "C", "C", (atom + 1) % 100000, x[atom][XX], x[atom][YY],
+                x[atom][ZZ]);
+    }
+    fprintf(out, "%10.5f%10.5f%10.5f\n", mem->box[XX][XX], mem->box[YY][YY],
+            mem->box[ZZ][ZZ]);
+    ffclose(out);
+}
+
+/** Write an index file with the lower leaflet, the upper leaflet and the
+ * protein, in this order
+ */
+static void write_membrane_index(Membrane *mem, const char *fn) {
+    const char *names[] = { "lower", "upper", "protein" };
+    atom_id *groups[] = { mem->index[0], mem->index[1], mem->ref_index };
+    int sizes[] = { mem->isize[0], mem->isize[1], mem->nprot };
+    FILE *out;
+    int group, i;
+
+    out = ffopen(fn, "w");
+    for (group = 0; group < 3; ++group) {
+        fprintf(out, "[ %s ]\n", names[group]);
+        for (i = 0; i < sizes[group]; ++i) {
+            fprintf(out, "%5d%s", groups[group][i] + 1,
+                    (i % 15 == 14 || i == sizes[group] - 1) ? "\n" : " ");
+        }
+    }
+    ffclose(out);
+}
+
+/** Run one benchmark configuration and print its throughput
+ *
+ * Parameters:
+ *  - mode: 0 for the grid mode, 1 for the distance to the center of mass,
+ *    2 for the minimum distance
+ */
+static void run_config(Membrane *mem, int mode, int sl, int adt, int nsteps,
+        gmx_bool bTiled, const char *out_fn, output_env_t oenv) {
+    static const char *names[] = { "grid", "dist-com", "dist-min" };
+    GridHeight *grid = NULL;
+    DistMode *dist = NULL;
+    atom_id *ref_index = NULL;
+    t_pbc pbc;
+    rvec *x;
+    double start, elapsed;
+    int step, leaflet, atom, natoms = 0;
+
+    if (mode == 0) {
+        grid = build_grids((int [2]){sl, sl}, ZZ, adt, out_fn, out_fn,
+                NULL, FALSE, bTiled);
+    }
+    else {
+        snew(ref_index, mem->nprot);
+        memcpy(ref_index, mem->ref_index, mem->nprot * sizeof(atom_id));
+        dist = build_dist_group(sl, ZZ, adt, out_fn, out_fn, NULL, oenv,
+                ref_index, mem->nprot, &mem->top, mode == 1, FALSE);
+    }
+
+    start = wall_time();
+    for (step = 0; step < nsteps; ++step) {
+        x = mem->frames[step % mem->nframes];
+        set_pbc(&pbc, epbcXYZ, mem->box);
+        grid_start_frame(grid, mem->box);
+        dist_start_frame(dist, mem->box, &mem->top, x, &pbc);
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            grid_store_batch(grid, leaflet, x, mem->index[leaflet],
+                    mem->isize[leaflet]);
+            for (atom = 0; atom < mem->isize[leaflet]; ++atom) {
+                dist_store(dist, leaflet, mem->index[leaflet][atom], x, &pbc);
+            }
+            natoms += mem->isize[leaflet];
+        }
+        grid_end_frame(grid);
+        dist_end_frame(dist);
+    }
+    grid_end(grid);
+    dist_end(dist);
+    elapsed = wall_time() - start;
+
+    printf("%-9s %6d %6d %8d %10.4f %12.1f %12.4g\n", names[mode], sl, adt,
+            nsteps, elapsed, nsteps / elapsed, natoms / elapsed);
+    fflush(stdout);
+    clean_grids(grid);
+    clean_dist(dist);
+}
+
+/** Parse a white space separated list of integers
+ */
+static int parse_list(const char *txt, int **values) {
+    int n = 0;
+    char *end;
+    long value;
+    *values = NULL;
+    while (TRUE) {
+        value = strtol(txt, &end, 10);
+        if (end == txt) {
+            break;
+        }
+        srenew(*values, n + 1);
+        (*values)[n] = (int)value;
+        n += 1;
+        txt = end;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    output_env_t oenv;
+    Membrane mem;
+    int nlipids = 10000;
+    int nprot = 3000;
+    int nframes = 10;
+    int nsteps = 100;
+    real box_xy = 40.0;
+    real undulation = 0.5;
+    const char *sl_txt = "50 100 200 1000";
+    const char *adt_txt = "1 10 -1";
+    const char *out_fn = "/dev/null";
+    const char *traj_fn = NULL, *conf_fn = NULL, *index_fn = NULL;
+    gmx_bool bGrid = TRUE, bCOM = TRUE, bMin = TRUE, bTiled = FALSE;
+    int *sls, *adts;
+    int nsl, nadt, i, j;
+
+    const char *desc[] = {
+        "Measure the throughput of the g_thickness analysis on synthetic",
+        "bilayers. The store, end of frame and end functions of the grid and",
+        "distance modes are driven directly for every combination of the",
+        "[TT]-sl[tt] and [TT]-adt[tt] values; the input frames are generated",
+        "once before the measures.",
+        "[PAR]",
+        "[TT]-otraj[tt], [TT]-oconf[tt] and [TT]-oindex[tt] write the",
+        "frames, the first frame and the groups of the leaflets and of the",
+        "protein instead, so g_thickness can be run on the same bilayer.",
+        "Nothing is measured then."
+    };
+    t_pargs pa[] = {
+        { "-nlip", FALSE, etINT, {&nlipids}, "Number of lipids per leaflet."},
+        { "-nprot", FALSE, etINT, {&nprot},
+            "Number of atoms in the reference protein."},
+        { "-box", FALSE, etREAL, {&box_xy}, "Box side in the membrane plane."},
+        { "-und", FALSE, etREAL, {&undulation},
+            "Amplitude of the membrane undulation."},
+        { "-nfr", FALSE, etINT, {&nframes}, "Number of distinct frames."},
+        { "-steps", FALSE, etINT, {&nsteps},
+            "Number of frames analysed for each configuration."},
+        { "-sl", FALSE, etSTR, {&sl_txt}, "List of -sl values."},
+        { "-adt", FALSE, etSTR, {&adt_txt}, "List of -adt values."},
+        { "-grid", FALSE, etBOOL, {&bGrid}, "Benchmark the grid mode."},
+        { "-tiled", FALSE, etBOOL, {&bTiled},
+            "Store the grids by tiles of hit cells."},
+        { "-com", FALSE, etBOOL, {&bCOM},
+            "Benchmark the distance to the center of mass."},
+        { "-min", FALSE, etBOOL, {&bMin},
+            "Benchmark the minimum distance."},
+        { "-out", FALSE, etSTR, {&out_fn}, "Output file for the results."},
+        { "-otraj", FALSE, etSTR, {&traj_fn},
+            "Write the frames to this XTC trajectory."},
+        { "-oconf", FALSE, etSTR, {&conf_fn},
+            "Write the first frame to this GRO file."},
+        { "-oindex", FALSE, etSTR, {&index_fn},
+            "Write the groups of the leaflets and of the protein to this "
+                "index file."},
+    };
+
+    CopyRight(stderr, argv[0]);
+    parse_common_args(&argc, argv, PCA_BE_NICE, 0, NULL, asize(pa), pa,
+            asize(desc), desc, 0, NULL, &oenv);
+
+    nsl = parse_list(sl_txt, &sls);
+    nadt = parse_list(adt_txt, &adts);
+    if (nsl == 0 || nadt == 0 || nlipids <= 0 || nprot <= 0
+            || nframes <= 0 || nsteps <= 0) {
+        gmx_fatal(FARGS, "Nothing to benchmark\n");
+    }
+
+    srand(1);
+    build_membrane(&mem, nlipids, nprot, nframes, box_xy, undulation);
+    if (traj_fn || conf_fn || index_fn) {
+        if (traj_fn) {
+            write_membrane_traj(&mem, traj_fn);
+        }
+        if (conf_fn) {
+            write_membrane_conf(&mem, conf_fn);
+        }
+        if (index_fn) {
+            write_membrane_index(&mem, index_fn);
+        }
+        clean_membrane(&mem);
+        sfree(sls);
+        sfree(adts);
+        return 0;
+    }
+    printf("# %d lipids per leaflet, %d protein atoms, box %.1f nm\n",
+            nlipids, nprot, box_xy);
+    printf("# %-7s %6s %6s %8s %10s %12s %12s\n", "mode", "sl", "adt",
+            "frames", "time (s)", "frames/s", "atoms/s");
+    for (i = 0; i < nsl; ++i) {
+        for (j = 0; j < nadt; ++j) {
+            if (bGrid) {
+                run_config(&mem, 0, sls[i], adts[j], nsteps, bTiled, out_fn,
+                        oenv);
+            }
+            if (bCOM) {
+                run_config(&mem, 1, sls[i], adts[j], nsteps, bTiled, out_fn,
+                        oenv);
+            }
+            if (bMin) {
+                run_config(&mem, 2, sls[i], adts[j], nsteps, bTiled, out_fn,
+                        oenv);
+            }
+        }
+    }
+    clean_membrane(&mem);
+    sfree(sls);
+    sfree(adts);
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <gromacs/vec.h>
+
+#include "binning.h"
+
+/* The vector kernels need single precision and an x86 compiler that
+ * understands target attributes */
+#if !defined(GMX_DOUBLE) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define BINNING_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Kernels of the selected instruction set for triclinic and rectangular
+ * boxes */
+static binning_kernel_t selected_kernels[2] = {NULL, NULL};
+static const char *selected_name = NULL;
+
+void binning_set_box(BinningFrame *frame, matrix box) {
+    matrix inv_box;
+    int j, d;
+    m_inv_ur0(box, inv_box);
+    for (j = 0; j < 3; ++j) {
+        for (d = 0; d < DIM; ++d) {
+            frame->to_reduced[j][d] = inv_box[d][frame->axis[j]];
+        }
+    }
+    for (j = 0; j < 3; ++j) {
+        frame->box_size[j] = box[frame->axis[j]][frame->axis[j]];
+    }
+    for (j = 0; j < 2; ++j) {
+        frame->cell_width[j] = frame->box_size[j + 1] / frame->shape[j];
+    }
+    frame->bRectangular = !TRICLINIC(box);
+}
+
+/** Get the reduced coordinate of an atom along one of the axes of the
+ * frame
+ */
+static real project(const BinningFrame *frame, const rvec atom, int j) {
+    const real *row = frame->to_reduced[j];
+    return atom[XX] * row[XX] + atom[YY] * row[YY] + atom[ZZ] * row[ZZ];
+}
+
+/** Get the coordinate of an atom along one of the axes of the frame, moved
+ * by whole box sizes so its reduced coordinate is in [0, 1)
+ *
+ * An atom in the box keeps its coordinate exactly.
+ */
+static real wrapped(const BinningFrame *frame, const rvec atom, int j) {
+    real shift = floor(project(frame, atom, j));
+    return atom[frame->axis[j]] - shift * frame->box_size[j];
+}
+
+/** Get the cell index of an atom along one of the grid dimensions of a
+ * rectangular box
+ */
+static int slice_rect(const BinningFrame *frame, const rvec atom, int j) {
+    int slice = (int)(wrapped(frame, atom, j) / frame->cell_width[j - 1]);
+    /* Rounding can put an atom on the upper edge of the box */
+    return (slice < frame->shape[j - 1]) ? slice : frame->shape[j - 1] - 1;
+}
+
+/** Get the cell index of an atom along one of the grid dimensions of a
+ * triclinic box
+ */
+static int slice_tric(const BinningFrame *frame, const rvec atom, int j) {
+    real s = project(frame, atom, j);
+    int slice;
+    s -= floor(s);
+    slice = (int)(s * frame->shape[j - 1]);
+    return (slice < frame->shape[j - 1]) ? slice : frame->shape[j - 1] - 1;
+}
+
+void binning_locate(const BinningFrame *frame, const rvec atom, int *cell,
+        real *height) {
+    if (frame->bRectangular) {
+        *cell = slice_rect(frame, atom, 1) * frame->shape[1]
+            + slice_rect(frame, atom, 2);
+    }
+    else {
+        *cell = slice_tric(frame, atom, 1) * frame->shape[1]
+            + slice_tric(frame, atom, 2);
+    }
+    *height = wrapped(frame, atom, 0);
+}
+
+static void bin_scalar_rect(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights) {
+    const real *atom;
+    int i;
+    for (i = 0; i < n; ++i) {
+        atom = x[index[i]];
+        cells[i] = slice_rect(frame, atom, 1) * frame->shape[1]
+            + slice_rect(frame, atom, 2);
+        heights[i] = wrapped(frame, atom, 0);
+    }
+}
+
+static void bin_scalar_tric(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights) {
+    const real *atom;
+    int i;
+    for (i = 0; i < n; ++i) {
+        atom = x[index[i]];
+        cells[i] = slice_tric(frame, atom, 1) * frame->shape[1]
+            + slice_tric(frame, atom, 2);
+        heights[i] = wrapped(frame, atom, 0);
+    }
+}
+
+#ifdef BINNING_X86_SIMD
+/** Gather the coordinates of 8 atoms
+ */
+__attribute__((target("avx2")))
+static void gather_avx2(rvec *x, const atom_id *index, __m256 *v) {
+    const float *base = (const float *)x;
+    __m256i idx = _mm256_mullo_epi32(
+            _mm256_loadu_si256((const __m256i *)index),
+            _mm256_set1_epi32(3));
+    v[XX] = _mm256_i32gather_ps(base, idx, 4);
+    v[YY] = _mm256_i32gather_ps(base,
+            _mm256_add_epi32(idx, _mm256_set1_epi32(1)), 4);
+    v[ZZ] = _mm256_i32gather_ps(base,
+            _mm256_add_epi32(idx, _mm256_set1_epi32(2)), 4);
+}
+
+/** Reduced coordinate along one axis of 8 atoms
+ */
+__attribute__((target("avx2")))
+static __m256 project_avx2(const BinningFrame *frame, int j, const __m256 *v) {
+    const real *row = frame->to_reduced[j];
+    return _mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(v[XX], _mm256_set1_ps(row[XX])),
+                _mm256_mul_ps(v[YY], _mm256_set1_ps(row[YY]))),
+            _mm256_mul_ps(v[ZZ], _mm256_set1_ps(row[ZZ])));
+}
+
+/** Coordinate along one axis of 8 atoms, moved like wrapped does
+ */
+__attribute__((target("avx2")))
+static __m256 wrapped_avx2(const BinningFrame *frame, int j, const __m256 *v) {
+    __m256 shift = _mm256_floor_ps(project_avx2(frame, j, v));
+    return _mm256_sub_ps(v[frame->axis[j]],
+            _mm256_mul_ps(shift, _mm256_set1_ps(frame->box_size[j])));
+}
+
+/** Cell index along one grid dimension of 8 atoms, as slice_rect
+ * computes it
+ */
+__attribute__((target("avx2")))
+static __m256i slice_rect_avx2(const BinningFrame *frame, int j,
+        const __m256 *v) {
+    __m256i slice = _mm256_cvttps_epi32(_mm256_div_ps(
+                wrapped_avx2(frame, j, v),
+                _mm256_set1_ps(frame->cell_width[j - 1])));
+    return _mm256_min_epi32(slice,
+            _mm256_set1_epi32(frame->shape[j - 1] - 1));
+}
+
+/** Cell index along one grid dimension of 8 atoms, as slice_tric
+ * computes it
+ */
+__attribute__((target("avx2")))
+static __m256i slice_tric_avx2(const BinningFrame *frame, int j,
+        const __m256 *v) {
+    __m256 s = project_avx2(frame, j, v);
+    __m256i slice;
+    s = _mm256_sub_ps(s, _mm256_floor_ps(s));
+    slice = _mm256_cvttps_epi32(_mm256_mul_ps(s,
+                _mm256_set1_ps((float)frame->shape[j - 1])));
+    return _mm256_min_epi32(slice,
+            _mm256_set1_epi32(frame->shape[j - 1] - 1));
+}
+
+__attribute__((target("avx2")))
+static void bin_avx2_rect(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights) {
+    __m256i ncols = _mm256_set1_epi32(frame->shape[1]);
+    __m256 v[DIM];
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        gather_avx2(x, index + i, v);
+        _mm256_storeu_si256((__m256i *)(cells + i), _mm256_add_epi32(
+                    _mm256_mullo_epi32(slice_rect_avx2(frame, 1, v), ncols),
+                    slice_rect_avx2(frame, 2, v)));
+        /* Height along the normal */
+        _mm256_storeu_ps(heights + i, wrapped_avx2(frame, 0, v));
+    }
+    bin_scalar_rect(frame, x, index + i, n - i, cells + i, heights + i);
+}
+
+__attribute__((target("avx2")))
+static void bin_avx2_tric(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights) {
+    __m256i ncols = _mm256_set1_epi32(frame->shape[1]);
+    __m256 v[DIM];
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        gather_avx2(x, index + i, v);
+        _mm256_storeu_si256((__m256i *)(cells + i), _mm256_add_epi32(
+                    _mm256_mullo_epi32(slice_tric_avx2(frame, 1, v), ncols),
+                    slice_tric_avx2(frame, 2, v)));
+        _mm256_storeu_ps(heights + i, wrapped_avx2(frame, 0, v));
+    }
+    bin_scalar_tric(frame, x, index + i, n - i, cells + i, heights + i);
+}
+
+/** Gather the coordinates of 16 atoms
+ */
+__attribute__((target("avx512f")))
+static void gather_avx512(rvec *x, const atom_id *index, __m512 *v) {
+    const float *base = (const float *)x;
+    __m512i idx = _mm512_mullo_epi32(_mm512_loadu_si512(index),
+            _mm512_set1_epi32(3));
+    v[XX] = _mm512_i32gather_ps(idx, base, 4);
+    v[YY] = _mm512_i32gather_ps(_mm512_add_epi32(idx, _mm512_set1_epi32(1)),
+            base, 4);
+    v[ZZ] = _mm512_i32gather_ps(_mm512_add_epi32(idx, _mm512_set1_epi32(2)),
+            base, 4);
+}
+
+/** Reduced coordinate along one axis of 16 atoms
+ */
+__attribute__((target("avx512f")))
+static __m512 project_avx512(const BinningFrame *frame, int j,
+        const __m512 *v) {
+    const real *row = frame->to_reduced[j];
+    return _mm512_add_ps(_mm512_add_ps(
+                _mm512_mul_ps(v[XX], _mm512_set1_ps(row[XX])),
+                _mm512_mul_ps(v[YY], _mm512_set1_ps(row[YY]))),
+            _mm512_mul_ps(v[ZZ], _mm512_set1_ps(row[ZZ])));
+}
+
+/** Coordinate along one axis of 16 atoms, moved like wrapped does
+ */
+__attribute__((target("avx512f")))
+static __m512 wrapped_avx512(const BinningFrame *frame, int j,
+        const __m512 *v) {
+    __m512 shift = _mm512_floor_ps(project_avx512(frame, j, v));
+    return _mm512_sub_ps(v[frame->axis[j]],
+            _mm512_mul_ps(shift, _mm512_set1_ps(frame->box_size[j])));
+}
+
+/** Cell index along one grid dimension of 16 atoms, as slice_rect
+ * computes it
+ */
+__attribute__((target("avx512f")))
+static __m512i slice_rect_avx512(const BinningFrame *frame, int j,
+        const __m512 *v) {
+    __m512i slice = _mm512_cvttps_epi32(_mm512_div_ps(
+                wrapped_avx512(frame, j, v),
+                _mm512_set1_ps(frame->cell_width[j - 1])));
+    return _mm512_min_epi32(slice,
+            _mm512_set1_epi32(frame->shape[j - 1] - 1));
+}
+
+/** Cell index along one grid dimension of 16 atoms, as slice_tric
+ * computes it
+ */
+__attribute__((target("avx512f")))
+static __m512i slice_tric_avx512(const BinningFrame *frame, int j,
+        const __m512 *v) {
+    __m512 s = project_avx512(frame, j, v);
+    __m512i slice;
+    s = _mm512_sub_ps(s, _mm512_floor_ps(s));
+    slice = _mm512_cvttps_epi32(_mm512_mul_ps(s,
+                _mm512_set1_ps((float)frame->shape[j - 1])));
+    return _mm512_min_epi32(slice,
+            _mm512_set1_epi32(frame->shape[j - 1] - 1));
+}
+
+__attribute__((target("avx512f")))
+static void bin_avx512_rect(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights) {
+    __m512i ncols = _mm512_set1_epi32(frame->shape[1]);
+    __m512 v[DIM];
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        gather_avx512(x, index + i, v);
+        _mm512_storeu_si512(cells + i, _mm512_add_epi32(
+                    _mm512_mullo_epi32(slice_rect_avx512(frame, 1, v), ncols),
+                    slice_rect_avx512(frame, 2, v)));
+        _mm512_storeu_ps(heights + i, wrapped_avx512(frame, 0, v));
+    }
+    bin_scalar_rect(frame, x, index + i, n - i, cells + i, heights + i);
+}
+
+__attribute__((target("avx512f")))
+static void bin_avx512_tric(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights) {
+    __m512i ncols = _mm512_set1_epi32(frame->shape[1]);
+    __m512 v[DIM];
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        gather_avx512(x, index + i, v);
+        _mm512_storeu_si512(cells + i, _mm512_add_epi32(
+                    _mm512_mullo_epi32(slice_tric_avx512(frame, 1, v), ncols),
+                    slice_tric_avx512(frame, 2, v)));
+        _mm512_storeu_ps(heights + i, wrapped_avx512(frame, 0, v));
+    }
+    bin_scalar_tric(frame, x, index + i, n - i, cells + i, heights + i);
+}
+#endif
+
+void binning_init(void) {
+    if (selected_kernels[0]) {
+        return;
+    }
+    selected_kernels[0] = bin_scalar_tric;
+    selected_kernels[1] = bin_scalar_rect;
+    selected_name = "scalar";
+#ifdef BINNING_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        selected_kernels[0] = bin_avx512_tric;
+        selected_kernels[1] = bin_avx512_rect;
+        selected_name = "AVX-512";
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        selected_kernels[0] = bin_avx2_tric;
+        selected_kernels[1] = bin_avx2_rect;
+        selected_name = "AVX2";
+    }
+#endif
+    fprintf(stderr, "Using the %s grid binning kernel\n", selected_name);
+}
+
+binning_kernel_t binning_kernel(const BinningFrame *frame) {
+    return selected_kernels[frame->bRectangular ? 1 : 0];
+}
+
+const char *binning_kernel_name(void) {
+    return selected_name;
+}
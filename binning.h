@@ -0,0 +1,67 @@
+#ifndef _binning_h
+#define _binning_h
+
+#include <gromacs/typedefs.h>
+
+/* Number of atoms binned at once by grid_store_batch */
+#define BINNING_BATCH 256
+
+/** Per frame parameters of the binning kernels
+ *
+ * axis[0] is the normal axis, axis[1] and axis[2] the axes of the grid.
+ * The atoms are binned in reduced coordinates: the reduced coordinate along
+ * axis[j] is the dot product of to_reduced[j] with the position, and is
+ * wrapped in [0, 1) with a floor; the grid follows the box vectors. In a
+ * rectangular box, the cell is found from the coordinate moved in the box
+ * by whole box sizes, divided by the cell width, so the cells are exactly
+ * the ones of a cartesian grid.
+ */
+typedef struct BinningFrame {
+    int axis[3];
+    int shape[2];
+    gmx_bool bRectangular;
+    rvec box_size;      /* Box size along the axes above */
+    real cell_width[2]; /* Cell widths of a rectangular box */
+    rvec to_reduced[3]; /* Columns of the inverse box for the axes above */
+} BinningFrame;
+
+/** Set the reduced coordinates of a frame from its box
+ *
+ * The box is a GROMACS box, lower triangular with the box vectors as rows.
+ */
+void binning_set_box(BinningFrame *frame, matrix box);
+
+/** Compute the cell and the height of one atom, as the kernels do
+ */
+void binning_locate(const BinningFrame *frame, const rvec atom, int *cell,
+        real *height);
+
+/** Compute the cell and the height of a batch of atoms
+ *
+ * Each atom x[index[i]] is wrapped in the box; its row-major cell index is
+ * stored in cells[i] and its height along the normal in heights[i]. The
+ * height is the coordinate along the normal, moved by a whole number of
+ * box sizes along the normal so the reduced coordinate along the normal is
+ * in [0, 1); an atom in the box keeps its coordinate exactly. At most
+ * BINNING_BATCH atoms can be binned at once. The vector kernels gather the
+ * coordinates with 32 bits offsets, so 3 * index[i] has to fit in an int.
+ */
+typedef void (*binning_kernel_t)(const BinningFrame *frame, rvec *x,
+        const atom_id *index, int n, int *cells, real *heights);
+
+/** Select the fastest kernels supported by the CPU
+ *
+ * Has to be called once before binning_kernel is used.
+ */
+void binning_init(void);
+
+/** Get the kernel for the box of a frame
+ *
+ * Rectangular and triclinic boxes have their own kernels, so the box shape
+ * is not tested for each atom.
+ */
+binning_kernel_t binning_kernel(const BinningFrame *frame);
+
+const char *binning_kernel_name(void);
+
+#endif /* _binning_h */
@@ -0,0 +1,325 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/vec.h>
+
+#include "cell_list.h"
+
+/* Largest number of cells along one dimension */
+#define MAX_CELLS_PER_DIM 256
+/* Number of cells per side of a block; blocks are used to prune the search
+ * for points far from the group */
+#define BLOCK_SIZE 4
+
+/** Create an empty cell list
+ *
+ * Parameters:
+ *  - normal_axis: the axis normal to the membrane plane
+ *  - max_points: the largest number of points the list will hold; used to
+ *    allocate the buffers once
+ */
+CellList2D *build_cell_list(int normal_axis, int max_points) {
+    CellList2D *cells;
+    int i, d = 0;
+
+    snew(cells, 1);
+    for (i=0; i<DIM; ++i) {
+        if (i != normal_axis) {
+            cells->dims[d] = i;
+            d += 1;
+        }
+    }
+    cells->points_alloc = max(max_points, 1);
+    snew(cells->coords, 2 * cells->points_alloc);
+    snew(cells->cell_of, cells->points_alloc);
+    /* About one point per cell gives at most max_points cells, unless one
+     * dimension is clamped to a single cell */
+    cells->cells_alloc = min(max(cells->points_alloc, MAX_CELLS_PER_DIM),
+            MAX_CELLS_PER_DIM * MAX_CELLS_PER_DIM);
+    snew(cells->cell_start, cells->cells_alloc + 1);
+    snew(cells->cell_fill, cells->cells_alloc);
+    snew(cells->occupied, cells->cells_alloc);
+    snew(cells->bounds, cells->cells_alloc);
+    snew(cells->block_start, cells->cells_alloc + 1);
+    snew(cells->block_cells, cells->cells_alloc);
+    snew(cells->block_occupied, cells->cells_alloc);
+    cells->npoints = 0;
+    cells->bValid = FALSE;
+    return cells;
+}
+
+void clean_cell_list(CellList2D *cells) {
+    if (cells) {
+        sfree(cells->coords);
+        sfree(cells->cell_of);
+        sfree(cells->cell_start);
+        sfree(cells->cell_fill);
+        sfree(cells->occupied);
+        sfree(cells->bounds);
+        sfree(cells->block_start);
+        sfree(cells->block_cells);
+        sfree(cells->block_occupied);
+        sfree(cells);
+    }
+}
+
+/** Wrap a coordinate in [0, box)
+ */
+static real wrap(real coord, real box) {
+    coord -= box * floor(coord / box);
+    /* Rounding can put the coordinate exactly on the upper bound */
+    if (coord >= box) {
+        coord = 0;
+    }
+    return coord;
+}
+
+/** Get the cell index of a wrapped in-plane position
+ */
+static int cell_index(CellList2D *cells, real c0, real c1) {
+    int i0, i1;
+    i0 = min((int)(c0 / cells->width[0]), cells->ncells[0] - 1);
+    i1 = min((int)(c1 / cells->width[1]), cells->ncells[1] - 1);
+    return i0 * cells->ncells[1] + i1;
+}
+
+/** Get the block of a cell
+ */
+static int block_of(CellList2D *cells, int cell) {
+    return (cell / cells->ncells[1]) / BLOCK_SIZE * cells->nblocks[1]
+        + (cell % cells->ncells[1]) / BLOCK_SIZE;
+}
+
+void cell_list_fill(CellList2D *cells, matrix box, atom_id *group,
+        int grp_size, rvec *x) {
+    int i, d, cell, ncells, block, nblocks;
+    real c0, c1, area;
+
+    cells->bValid = FALSE;
+    if (TRICLINIC(box) || grp_size <= 0) {
+        return;
+    }
+    if (grp_size > cells->points_alloc) {
+        gmx_fatal(FARGS, "Cell list is too small: %d points for %d slots\n",
+                grp_size, cells->points_alloc);
+    }
+    for (d=0; d<2; ++d) {
+        cells->box[d] = box[cells->dims[d]][cells->dims[d]];
+        if (cells->box[d] <= 0) {
+            return;
+        }
+    }
+
+    /* Aim at about one point per cell over the whole plane */
+    area = cells->box[0] * cells->box[1];
+    for (d=0; d<2; ++d) {
+        cells->ncells[d] = (int)(cells->box[d] / sqrt(area / grp_size));
+        cells->ncells[d] = max(1, min(cells->ncells[d], MAX_CELLS_PER_DIM));
+        cells->width[d] = cells->box[d] / cells->ncells[d];
+        cells->nblocks[d] = (cells->ncells[d] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    ncells = cells->ncells[0] * cells->ncells[1];
+    if (ncells > cells->cells_alloc) {
+        gmx_fatal(FARGS, "Cell list is too small: %d cells for %d slots\n",
+                ncells, cells->cells_alloc);
+    }
+
+    /* Count the points in each cell */
+    for (cell=0; cell <= ncells; ++cell) {
+        cells->cell_start[cell] = 0;
+    }
+    for (i=0; i<grp_size; ++i) {
+        c0 = wrap(x[group[i]][cells->dims[0]], cells->box[0]);
+        c1 = wrap(x[group[i]][cells->dims[1]], cells->box[1]);
+        cells->cell_of[i] = cell_index(cells, c0, c1);
+        cells->cell_start[cells->cell_of[i] + 1] += 1;
+    }
+    cells->noccupied = 0;
+    for (cell=0; cell < ncells; ++cell) {
+        if (cells->cell_start[cell + 1] > 0) {
+            cells->occupied[cells->noccupied] = cell;
+            cells->noccupied += 1;
+        }
+        cells->cell_start[cell + 1] += cells->cell_start[cell];
+    }
+
+    /* Group the occupied cells by block */
+    nblocks = cells->nblocks[0] * cells->nblocks[1];
+    for (block=0; block <= nblocks; ++block) {
+        cells->block_start[block] = 0;
+    }
+    for (i=0; i < cells->noccupied; ++i) {
+        block = block_of(cells, cells->occupied[i]);
+        cells->block_start[block + 1] += 1;
+    }
+    cells->nblocks_occupied = 0;
+    for (block=0; block < nblocks; ++block) {
+        if (cells->block_start[block + 1] > 0) {
+            cells->block_occupied[cells->nblocks_occupied] = block;
+            cells->nblocks_occupied += 1;
+        }
+        cells->block_start[block + 1] += cells->block_start[block];
+        cells->cell_fill[block] = cells->block_start[block];
+    }
+    for (i=0; i < cells->noccupied; ++i) {
+        block = block_of(cells, cells->occupied[i]);
+        cells->block_cells[cells->cell_fill[block]] = cells->occupied[i];
+        cells->cell_fill[block] += 1;
+    }
+
+    /* Sort the coordinates by cell */
+    for (cell=0; cell < ncells; ++cell) {
+        cells->cell_fill[cell] = cells->cell_start[cell];
+    }
+    for (i=0; i<grp_size; ++i) {
+        cell = cells->cell_of[i];
+        d = cells->cell_fill[cell];
+        cells->cell_fill[cell] += 1;
+        cells->coords[2 * d] =
+            wrap(x[group[i]][cells->dims[0]], cells->box[0]);
+        cells->coords[2 * d + 1] =
+            wrap(x[group[i]][cells->dims[1]], cells->box[1]);
+    }
+    cells->npoints = grp_size;
+    cells->bValid = TRUE;
+}
+
+/** Minimum image of a difference between two wrapped coordinates
+ */
+static real min_image(real delta, real box) {
+    if (delta > 0.5 * box) {
+        delta -= box;
+    }
+    else if (delta < -0.5 * box) {
+        delta += box;
+    }
+    return delta;
+}
+
+/** Update the best squared distance with the points of one cell
+ */
+static real scan_cell(CellList2D *cells, int cell, real c0, real c1,
+        real best2) {
+    int p;
+    real dx, dy, d2;
+    for (p = cells->cell_start[cell]; p < cells->cell_start[cell + 1]; ++p) {
+        dx = min_image(c0 - cells->coords[2 * p], cells->box[0]);
+        dy = min_image(c1 - cells->coords[2 * p + 1], cells->box[1]);
+        d2 = dx * dx + dy * dy;
+        if (d2 < best2) {
+            best2 = d2;
+        }
+    }
+    return best2;
+}
+
+/** Lower bound of the squared distance between a point and any point in a
+ * rectangle of cells
+ *
+ * The rectangle starts at cell (i0, j0) and spans (n0, n1) cells.
+ */
+static real rect_bound2(CellList2D *cells, int i0, int j0, int n0, int n1,
+        real c0, real c1) {
+    real d0, d1;
+    d0 = fabs(min_image(c0 - (i0 + 0.5 * n0) * cells->width[0],
+                cells->box[0])) - 0.5 * n0 * cells->width[0];
+    d1 = fabs(min_image(c1 - (j0 + 0.5 * n1) * cells->width[1],
+                cells->box[1])) - 0.5 * n1 * cells->width[1];
+    d0 = max(d0, 0);
+    d1 = max(d1, 0);
+    return d0 * d0 + d1 * d1;
+}
+
+static real cell_bound2(CellList2D *cells, int cell, real c0, real c1) {
+    return rect_bound2(cells, cell / cells->ncells[1],
+            cell % cells->ncells[1], 1, 1, c0, c1);
+}
+
+static real block_bound2(CellList2D *cells, int block, real c0, real c1) {
+    int i0, j0;
+    i0 = (block / cells->nblocks[1]) * BLOCK_SIZE;
+    j0 = (block % cells->nblocks[1]) * BLOCK_SIZE;
+    return rect_bound2(cells, i0, j0,
+            min(BLOCK_SIZE, cells->ncells[0] - i0),
+            min(BLOCK_SIZE, cells->ncells[1] - j0), c0, c1);
+}
+
+/** Update the best squared distance with the occupied cells of a block
+ */
+static real scan_block(CellList2D *cells, int block, real c0, real c1,
+        real best2) {
+    int c, cell;
+    for (c = cells->block_start[block]; c < cells->block_start[block + 1];
+            ++c) {
+        cell = cells->block_cells[c];
+        if (cell_bound2(cells, cell, c0, c1) < best2) {
+            best2 = scan_cell(cells, cell, c0, c1, best2);
+        }
+    }
+    return best2;
+}
+
+real cell_list_min_dist(CellList2D *cells, rvec point) {
+    int r, di, dj, i0, j0, ci, cj, o, step, closest;
+    real c0, c1, best2 = GMX_REAL_MAX;
+    real wmin;
+    gmx_bool bCovered;
+
+    c0 = wrap(point[cells->dims[0]], cells->box[0]);
+    c1 = wrap(point[cells->dims[1]], cells->box[1]);
+    i0 = min((int)(c0 / cells->width[0]), cells->ncells[0] - 1);
+    j0 = min((int)(c1 / cells->width[1]), cells->ncells[1] - 1);
+    wmin = min(cells->width[0], cells->width[1]);
+
+    /* Look at rings of cells of growing radius around the point. Cells
+     * beyond ring r are at least r cell widths away. */
+    for (r = 0; ; ++r) {
+        if ((2 * r + 1) * (2 * r + 1) > cells->nblocks_occupied) {
+            /* The ring holds more cells than there are occupied blocks:
+             * look at the occupied blocks directly, starting with the
+             * closest one to get a tight bound early */
+            closest = 0;
+            for (o = 0; o < cells->nblocks_occupied; ++o) {
+                cells->bounds[o] = block_bound2(cells,
+                        cells->block_occupied[o], c0, c1);
+                if (cells->bounds[o] < cells->bounds[closest]) {
+                    closest = o;
+                }
+            }
+            best2 = scan_block(cells, cells->block_occupied[closest], c0, c1,
+                    best2);
+            for (o = 0; o < cells->nblocks_occupied; ++o) {
+                if (o != closest && cells->bounds[o] < best2) {
+                    best2 = scan_block(cells, cells->block_occupied[o],
+                            c0, c1, best2);
+                }
+            }
+            break;
+        }
+        for (di = -r; di <= r; ++di) {
+            ci = (i0 + di) % cells->ncells[0];
+            if (ci < 0) {
+                ci += cells->ncells[0];
+            }
+            /* Only the border of the ring is new */
+            step = (abs(di) == r) ? 1 : 2 * r;
+            for (dj = -r; dj <= r; dj += step) {
+                cj = (j0 + dj) % cells->ncells[1];
+                if (cj < 0) {
+                    cj += cells->ncells[1];
+                }
+                best2 = scan_cell(cells, ci * cells->ncells[1] + cj, c0, c1,
+                        best2);
+            }
+        }
+        bCovered = (2 * r + 1 >= cells->ncells[0]
+                    && 2 * r + 1 >= cells->ncells[1]);
+        if (bCovered || best2 <= (r * wmin) * (r * wmin)) {
+            break;
+        }
+    }
+    return sqrt(best2);
+}
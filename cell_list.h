@@ -0,0 +1,51 @@
+#ifndef _cell_list_h
+#define _cell_list_h
+
+#include <gromacs/typedefs.h>
+
+/** Cell list of a group of points projected on the membrane plane
+ *
+ * The points are wrapped in a rectangular periodic box and sorted by cell so
+ * the nearest point to a position can be found by looking at the neighbouring
+ * cells first. Only rectangular boxes are supported; bValid is FALSE when the
+ * list can not be used for the current frame and the caller has to fall back
+ * to a full search.
+ */
+typedef struct CellList2D {
+    int dims[2];        /* The two dimensions of the membrane plane */
+    real box[2];        /* Box size in the plane */
+    int ncells[2];
+    real width[2];      /* Cell width in each dimension */
+    int *cell_start;    /* First point of each cell; ncells + 1 values */
+    int *cell_fill;     /* Fill cursor used while sorting the points */
+    int cells_alloc;
+    int *occupied;      /* Non empty cells */
+    int noccupied;
+    real *bounds;       /* Scratch distance bounds to the occupied blocks */
+    int nblocks[2];     /* Blocks of BLOCK_SIZE x BLOCK_SIZE cells */
+    int *block_start;   /* First occupied cell of each block in block_cells */
+    int *block_cells;   /* Occupied cells sorted by block */
+    int *block_occupied;    /* Non empty blocks */
+    int nblocks_occupied;
+    real *coords;       /* In-plane coordinates of the points, cell order */
+    int *cell_of;       /* Cell of each point, in input order */
+    int npoints;
+    int points_alloc;
+    gmx_bool bValid;
+} CellList2D;
+
+CellList2D *build_cell_list(int normal_axis, int max_points);
+
+void clean_cell_list(CellList2D *cells);
+
+/** Fill the cell list with the atoms of a group for the current frame
+ */
+void cell_list_fill(CellList2D *cells, matrix box, atom_id *group,
+        int grp_size, rvec *x);
+
+/** Get the in-plane distance between a point and the closest point of the
+ * cell list, using the minimum image convention
+ */
+real cell_list_min_dist(CellList2D *cells, rvec point);
+
+#endif /* _cell_list_h */
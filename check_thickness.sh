@@ -0,0 +1,90 @@
+#!/bin/sh
+# Check that g_thickness writes the same files whatever the number of
+# threads, and when the trajectory is analysed by chunks then merged.
+#
+# Usage: sh check_thickness.sh [output directory]
+#
+# A small synthetic bilayer is written by bench_thickness and a run input
+# file is made for it with grompp. The landscape, the profile, their
+# sampling and their standard errors are written by a serial run, by a run
+# on 4 threads, and by merging the accumulators of 3 chunks; all of them
+# have to be identical, except for the comments of the XVG headers that
+# hold the command line. The programs can be given with the G_THICKNESS,
+# BENCH_THICKNESS and GROMPP variables.
+
+G_THICKNESS=${G_THICKNESS:-./g_thickness}
+BENCH_THICKNESS=${BENCH_THICKNESS:-./bench_thickness}
+GROMPP=${GROMPP:-grompp}
+dir=${1:-check_output}
+status=0
+
+set -e
+mkdir -p "$dir"
+
+# The bilayer, and a topology of uncharged atoms without interactions
+"$BENCH_THICKNESS" -nlip 400 -nprot 50 -box 8 -nfr 40 \
+    -otraj "$dir/traj.xtc" -oconf "$dir/conf.gro" \
+    -oindex "$dir/index.ndx" > "$dir/bench.log" 2>&1
+natoms=$(sed -n 2p "$dir/conf.gro")
+cat > "$dir/topol.top" << EOF
+[ defaults ]
+1 1 no
+
+[ atomtypes ]
+C 12.011 0.0 A 0.0 0.0
+
+[ moleculetype ]
+C 1
+
+[ atoms ]
+1 C 1 C C 1 0.0 12.011
+
+[ system ]
+Synthetic bilayer
+
+[ molecules ]
+C $natoms
+EOF
+: > "$dir/grompp.mdp"
+"$GROMPP" -f "$dir/grompp.mdp" -c "$dir/conf.gro" -p "$dir/topol.top" \
+    -o "$dir/topol.tpr" -po "$dir/mdout.mdp" > "$dir/grompp.log" 2>&1
+
+# Analyse the bilayer; the groups are the lower leaflet, the upper leaflet
+# and the protein as reference
+analyse() {
+    name=$1
+    shift
+    printf '0\n1\n2\n' | "$G_THICKNESS" -f "$dir/traj.xtc" \
+        -s "$dir/topol.tpr" -n "$dir/index.ndx" -sl 16 -adt 5 \
+        -og "$dir/$name.grid.dat" -ogs "$dir/$name.grid_sampling.dat" \
+        -oge "$dir/$name.grid_error.dat" -od "$dir/$name.dist.xvg" \
+        -ods "$dir/$name.dist_sampling.xvg" \
+        -ode "$dir/$name.dist_error.xvg" "$@" > "$dir/$name.log" 2>&1
+}
+
+analyse serial -nt 1
+analyse threads -nt 4
+for chunk in 0 1 2; do
+    analyse chunk$chunk -nchunks 3 -chunk $chunk -oacc "$dir/acc$chunk.dat"
+done
+"$G_THICKNESS" -merge "$dir/acc0.dat" "$dir/acc1.dat" "$dir/acc2.dat" \
+    -og "$dir/merged.grid.dat" -ogs "$dir/merged.grid_sampling.dat" \
+    -oge "$dir/merged.grid_error.dat" -od "$dir/merged.dist.xvg" \
+    -ods "$dir/merged.dist_sampling.xvg" \
+    -ode "$dir/merged.dist_error.xvg" > "$dir/merged.log" 2>&1
+set +e
+
+for run in threads merged; do
+    for output in grid.dat grid_sampling.dat grid_error.dat dist.xvg \
+            dist_sampling.xvg dist_error.xvg; do
+        grep -v '^#' "$dir/serial.$output" > "$dir/serial.$output.body"
+        grep -v '^#' "$dir/$run.$output" > "$dir/$run.$output.body"
+        if cmp -s "$dir/serial.$output.body" "$dir/$run.$output.body"; then
+            echo "same $output for the $run run"
+        else
+            echo "DIFFERENT $output for the $run run"
+            status=1
+        fi
+    done
+done
+exit $status
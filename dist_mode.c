@@ -1,38 +1,68 @@
 #include "dist_mode.h"
 
-void _average_field_dist(DistMode *dist_store) {
-    int leaflet, i;
-    for (leaflet = 0; leaflet < 2; ++leaflet) {
-        for (i=0; i < dist_store->length; ++i) {
-            dist_store->height[leaflet][i] /=
-                dist_store->sampling[leaflet][i];
+/** Compute the thickness of the window accumulated in "window" in "closed",
+ * then empty the leaflets
+ *
+ * Only the bins hit during the window are visited.
+ */
+void _close_window_dist_into(DistMode *window, DistWindow *closed) {
+    int bin, leaflet, i;
+    int minsamp = 0;
+    real height[2];
+    closed->nbins = 0;
+    for (i=0; i < window->ntouched; ++i) {
+        bin = window->touched[i];
+        minsamp = min(window->sampling[0][bin], window->sampling[1][bin]);
+        if (minsamp > 0) {
+            for (leaflet = 0; leaflet < 2; ++leaflet) {
+                height[leaflet] = window->height[leaflet][bin]
+                    / window->sampling[leaflet][bin];
+            }
+            closed->bins[closed->nbins] = bin;
+            closed->sampling[closed->nbins] = minsamp;
+            closed->thickness[closed->nbins] =
+                (real)fabs(height[0] - height[1]);
+            closed->nbins += 1;
+        }
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            window->height[leaflet][bin] = 0.0;
+            window->sampling[leaflet][bin] = 0;
         }
     }
+    window->ntouched = 0;
 }
 
-void _calculate_thickness_dist(DistMode *dist_store) {
-    int i;
+/** Add the thickness of a closed window to the thickness of "dist_store"
+ */
+void _apply_window_dist(DistMode *dist_store, DistWindow *closed) {
+    int bin, i;
     int minsamp = 0;
-    for (i=0; i < dist_store->length; ++i) {
-        minsamp = min(dist_store->sampling[0][i],
-                      dist_store->sampling[1][i]);
-        if (minsamp > 0) {
-            dist_store->height[2][i] +=
-                (real)fabs(dist_store->height[0][i] - 
-                        dist_store->height[1][i]) * minsamp;
-            dist_store->sampling[2][i] += minsamp;
-        }
+    for (i=0; i < closed->nbins; ++i) {
+        bin = closed->bins[i];
+        minsamp = closed->sampling[i];
+        window_stats_add(&dist_store->stats, bin, dist_store->sampling[2][bin],
+                closed->thickness[i], minsamp);
+        dist_store->height[2][bin] += closed->thickness[i] * minsamp;
+        dist_store->sampling[2][bin] += minsamp;
     }
 }
 
-DistMode *build_dist(int length, int normal_axis,
-        const char *dist_fn, const char *sampling_fn, output_env_t oenv,
-        const char *index_fn, t_topology *top, gmx_bool bCOM) {
+/** Contruct an instance of DistMode for a given reference group
+ *
+ * The instance takes the ownership of "ref_index". The standard error of the
+ * thickness is written in "error_fn" if it is not NULL. If "bUnwrapRef" is
+ * true, the reference group is made whole before its center of mass is
+ * computed; this is needed when the molecules are not made whole for the
+ * whole system. Without "dist_fn", no file is written and the results are
+ * only read with dist_snapshot. A negative "adt" makes one window of the
+ * whole trajectory; 0 is a fatal error.
+ */
+DistMode *build_dist_group(int length, int normal_axis, int adt,
+        const char *dist_fn, const char *sampling_fn, const char *error_fn,
+        output_env_t oenv, atom_id *ref_index, int ref_size, t_topology *top,
+        gmx_bool bCOM, gmx_bool bUnwrapRef) {
     DistMode *dist_store;
     int prof, i;
-    atom_id **index;
-    int *isize;
-    char **grpnames;
 
     /* Check dimensions */
     if (length <= 0) {
@@ -41,6 +71,10 @@ DistMode *build_dist(int length, int normal_axis,
                 length);
         exit(1);
     }
+    /* Windows of 0 frames would never be closed */
+    if (adt == 0) {
+        gmx_fatal(FARGS, "The -adt can not be 0\n");
+    }
 
     /* Allocate empty structure */
     snew(dist_store, 1);
@@ -55,6 +89,14 @@ DistMode *build_dist(int length, int normal_axis,
     /* Define the axis */
     dist_store->axis[0] = normal_axis;
     dist_store->axis[1] = 0;
+    dist_store->adt = adt;
+    dist_store->bRefMols = FALSE;
+    dist_store->bDefer = FALSE;
+    dist_store->pending = NULL;
+    dist_store->npending = 0;
+    dist_store->pending_alloc = 0;
+    snew(dist_store->touched, length);
+    dist_store->ntouched = 0;
 
     /* Allocate the profiles */
     for (prof = 0; prof < 3; ++prof) {
@@ -66,32 +108,235 @@ DistMode *build_dist(int length, int normal_axis,
         }
     }
 
-    /* Get the reference group index */
-    snew(index, 1);
-    snew(isize, 1);
-    snew(grpnames, 1);
-    printf("Select reference group for distance calcultation:\n");
-    get_index(&(top->atoms), index_fn, 1, isize,index,grpnames);
-    dist_store->ref_index = index[0];
-    dist_store->ref_size = isize[0];
+    dist_store->ref_index = ref_index;
+    dist_store->ref_size = ref_size;
 
     /* Calculate the reference group mass if needed */
     dist_store->bCOM = bCOM;
+    dist_store->bUnwrapRef = bUnwrapRef;
     if (bCOM) {
-        dist_store->mass = get_mass(index[0], isize[0], top);
+        dist_store->mass = get_mass(ref_index, ref_size, top);
     }
     else {
         dist_store->mass = 0;
     }
+    /* The minimum distance is searched with a cell list, or among the
+     * projected reference atoms when the list can not be used */
+    clear_rvec(dist_store->com);
+    dist_store->nmols = 0;
+    dist_store->mol_start = NULL;
+    dist_store->mol_mass = NULL;
+    dist_store->mol_com = NULL;
+    dist_store->mol_index = NULL;
+    dist_store->ref_cells = NULL;
+    dist_store->ref_2D = NULL;
+    if (!bCOM) {
+        dist_store->ref_cells = build_cell_list(normal_axis,
+                dist_store->ref_size);
+        snew(dist_store->ref_2D, max(dist_store->ref_size, 1));
+    }
+
+    init_window_stats(&dist_store->stats, length);
 
     /* Open the files */
+    dist_store->out_dist = NULL;
+    dist_store->out_sampling = NULL;
+    dist_store->out_error = NULL;
+    dist_store->data_start[0] = -1;
+    dist_store->data_start[1] = -1;
+    dist_store->data_start[2] = -1;
+    if (!dist_fn) {
+        return dist_store;
+    }
     dist_store->out_dist = xvgropen(dist_fn,"Thickness",
             "Distance from Protein (nm)","z coordinate (nm)",oenv);
     dist_store->out_sampling = xvgropen(sampling_fn,"Sampling",
             "Distance from Protein (nm)","Average number of hit",oenv);
+    if (error_fn) {
+        dist_store->out_error = xvgropen(error_fn,"Standard error",
+                "Distance from Protein (nm)","Standard error (nm)",oenv);
+    }
+    /* The profiles are written after the headers, maybe several times */
+    fflush(dist_store->out_dist);
+    dist_store->data_start[0] = gmx_ftell(dist_store->out_dist);
+    fflush(dist_store->out_sampling);
+    dist_store->data_start[1] = gmx_ftell(dist_store->out_sampling);
+    if (dist_store->out_error) {
+        fflush(dist_store->out_error);
+        dist_store->data_start[2] = gmx_ftell(dist_store->out_error);
+    }
     return dist_store;
 }
 
+/** Allocate the buffers of the centers of mass of the molecules and of
+ * their cell list
+ */
+static void _alloc_molecules(DistMode *dist_store) {
+    int i;
+    snew(dist_store->mol_com, dist_store->nmols);
+    snew(dist_store->mol_index, dist_store->nmols);
+    for (i=0; i < dist_store->nmols; ++i) {
+        dist_store->mol_index[i] = i;
+    }
+    dist_store->ref_cells = build_cell_list(dist_store->axis[0],
+            dist_store->nmols);
+    snew(dist_store->ref_2D, dist_store->nmols);
+}
+
+/** Measure the distances to the center of mass of the nearest molecule of
+ * the reference group
+ *
+ * The reference group is split by the molecules of the topology; it is
+ * typically made of several copies of a protein. The centers of mass of
+ * all the molecules are computed at each frame, and the nearest one is
+ * found with a cell list, so the cost per atom does not grow with the
+ * number of molecules. The atoms of the reference group are sorted by
+ * molecule. Only the center of mass distances can be split this way; the
+ * minimum distance is already the one to the nearest molecule. Without
+ * topology, as when merging accumulator files, the setting is only
+ * recorded.
+ */
+void dist_nearest_molecule(DistMode *dist_store, t_topology *top) {
+    atom_id *sorted;
+    int *mol_of, *rank, *fill;
+    int lower, upper, middle, mol, i;
+
+    if (!dist_store || !dist_store->bCOM) {
+        return;
+    }
+    dist_store->bRefMols = TRUE;
+    if (!top) {
+        return;
+    }
+    if (top->mols.nr <= 0) {
+        gmx_fatal(FARGS, "The topology does not describe its molecules\n");
+    }
+    /* Find the molecule of each atom by bisection on the molecule starts */
+    snew(mol_of, max(dist_store->ref_size, 1));
+    snew(rank, top->mols.nr);
+    for (i=0; i < dist_store->ref_size; ++i) {
+        lower = 0;
+        upper = top->mols.nr;
+        while (upper - lower > 1) {
+            middle = (lower + upper) / 2;
+            if (top->mols.index[middle] <= dist_store->ref_index[i]) {
+                lower = middle;
+            }
+            else {
+                upper = middle;
+            }
+        }
+        mol_of[i] = lower;
+        rank[lower] += 1;
+    }
+    /* Number the molecules that have atoms in the group, in topology
+     * order */
+    snew(dist_store->mol_start, top->mols.nr + 1);
+    dist_store->nmols = 0;
+    for (mol=0; mol < top->mols.nr; ++mol) {
+        if (rank[mol] > 0) {
+            dist_store->mol_start[dist_store->nmols + 1] =
+                dist_store->mol_start[dist_store->nmols] + rank[mol];
+            rank[mol] = dist_store->nmols++;
+        }
+    }
+    srenew(dist_store->mol_start, dist_store->nmols + 1);
+    /* Sort the atoms by molecule, keeping their order in each molecule */
+    snew(sorted, max(dist_store->ref_size, 1));
+    snew(fill, max(dist_store->nmols, 1));
+    for (i=0; i < dist_store->ref_size; ++i) {
+        mol = rank[mol_of[i]];
+        sorted[dist_store->mol_start[mol] + fill[mol]++] =
+            dist_store->ref_index[i];
+    }
+    sfree(dist_store->ref_index);
+    dist_store->ref_index = sorted;
+    snew(dist_store->mol_mass, max(dist_store->nmols, 1));
+    for (mol=0; mol < dist_store->nmols; ++mol) {
+        dist_store->mol_mass[mol] = get_mass(
+                dist_store->ref_index + dist_store->mol_start[mol],
+                dist_store->mol_start[mol + 1] - dist_store->mol_start[mol],
+                top);
+    }
+    _alloc_molecules(dist_store);
+    fprintf(stderr, "Measuring the distances to the nearest of %d reference "
+            "molecules\n", dist_store->nmols);
+    sfree(mol_of);
+    sfree(rank);
+    sfree(fill);
+}
+
+/** Contruct an empty instance of DistMode with the settings of another one
+ *
+ * The copy has its own copy of the reference group but does not own any
+ * output file. It is meant to accumulate frames on a worker thread; the
+ * windows it closes are kept until they are folded back with
+ * dist_commit_windows, and the unfinished window with dist_reduce_fields.
+ */
+DistMode *dist_worker_copy(DistMode *dist_store) {
+    DistMode *copy;
+    int prof, i;
+
+    if (!dist_store) {
+        return NULL;
+    }
+    snew(copy, 1);
+    copy->nframes = 0;
+    copy->length = dist_store->length;
+    copy->width = 0;
+    copy->box_width = 0.0;
+    copy->axis[0] = dist_store->axis[0];
+    copy->axis[1] = dist_store->axis[1];
+    copy->adt = dist_store->adt;
+    copy->bDefer = TRUE;
+    copy->pending = NULL;
+    copy->npending = 0;
+    copy->pending_alloc = 0;
+    snew(copy->touched, copy->length);
+    copy->ntouched = 0;
+    for (prof = 0; prof < 3; ++prof) {
+        snew(copy->height[prof], copy->length);
+        snew(copy->sampling[prof], copy->length);
+    }
+    snew(copy->ref_index, dist_store->ref_size);
+    for (i=0; i < dist_store->ref_size; ++i) {
+        copy->ref_index[i] = dist_store->ref_index[i];
+    }
+    copy->ref_size = dist_store->ref_size;
+    copy->mass = dist_store->mass;
+    copy->bCOM = dist_store->bCOM;
+    copy->bUnwrapRef = dist_store->bUnwrapRef;
+    clear_rvec(copy->com);
+    copy->bRefMols = dist_store->bRefMols;
+    copy->nmols = dist_store->nmols;
+    copy->mol_start = NULL;
+    copy->mol_mass = NULL;
+    copy->mol_com = NULL;
+    copy->mol_index = NULL;
+    copy->ref_cells = NULL;
+    copy->ref_2D = NULL;
+    if (copy->nmols > 0) {
+        snew(copy->mol_start, copy->nmols + 1);
+        snew(copy->mol_mass, copy->nmols);
+        for (i=0; i < copy->nmols; ++i) {
+            copy->mol_start[i] = dist_store->mol_start[i];
+            copy->mol_mass[i] = dist_store->mol_mass[i];
+        }
+        copy->mol_start[copy->nmols] = dist_store->mol_start[copy->nmols];
+        _alloc_molecules(copy);
+    }
+    else if (!copy->bCOM) {
+        copy->ref_cells = build_cell_list(copy->axis[0], copy->ref_size);
+        snew(copy->ref_2D, max(copy->ref_size, 1));
+    }
+    copy->out_dist = NULL;
+    copy->out_sampling = NULL;
+    copy->out_error = NULL;
+    /* The copy never folds a window, so it has no statistics */
+    init_window_stats(&copy->stats, 0);
+    return copy;
+}
+
 void clean_dist(DistMode *dist_store) {
     int prof = 0;
     if (dist_store) {
@@ -99,19 +344,46 @@ void clean_dist(DistMode *dist_store) {
             sfree(dist_store->height[prof]);
             sfree(dist_store->sampling[prof]);
         }
+        for (prof = 0; prof < dist_store->pending_alloc; ++prof) {
+            sfree(dist_store->pending[prof].bins);
+            sfree(dist_store->pending[prof].thickness);
+            sfree(dist_store->pending[prof].sampling);
+        }
+        sfree(dist_store->pending);
+        sfree(dist_store->touched);
         sfree(dist_store->ref_index);
-        fclose(dist_store->out_dist);
-        fclose(dist_store->out_sampling);
+        clean_cell_list(dist_store->ref_cells);
+        sfree(dist_store->ref_2D);
+        sfree(dist_store->mol_start);
+        sfree(dist_store->mol_mass);
+        sfree(dist_store->mol_com);
+        sfree(dist_store->mol_index);
+        if (dist_store->out_dist) {
+            fclose(dist_store->out_dist);
+        }
+        if (dist_store->out_sampling) {
+            fclose(dist_store->out_sampling);
+        }
+        if (dist_store->out_error) {
+            fclose(dist_store->out_error);
+        }
+        clean_window_stats(&dist_store->stats);
         sfree(dist_store);
     }
 }
 
-void dist_start_frame(DistMode *dist_store, matrix box, t_topology *top,
-                      rvec *x) {
+/** Account for the box of a new frame
+ *
+ * Update the frame count, the bin width and the sum of the box widths.
+ */
+void dist_count_frame(DistMode *dist_store, matrix box) {
     int i = 0;
     real max_box_size = 0;
     if (dist_store) {
-        /* Find what the maximum distance is */
+        /* Find what the maximum distance is; the diagonal of the box also
+         * bounds the in-plane minimum image distances of a triclinic box,
+         * since GROMACS keeps the off-diagonal elements below half the
+         * diagonal ones */
         for (i=0; i<DIM; ++i) {
             if (i != dist_store->axis[0]) {
                 max_box_size += box[i][i] * box[i][i];
@@ -121,31 +393,185 @@ void dist_start_frame(DistMode *dist_store, matrix box, t_topology *top,
         dist_store->nframes += 1;
         dist_store->width = max_box_size/dist_store->length;
         dist_store->box_width += max_box_size;
+    }
+}
+
+/** Compute the center of mass of each molecule of the reference group and
+ * index them for the nearest molecule searches
+ */
+static void _molecule_centers(DistMode *dist_store, matrix box,
+        t_topology *top, rvec *x, t_pbc *pbc) {
+    atom_id *group;
+    int mol, size;
+    for (mol=0; mol < dist_store->nmols; ++mol) {
+        group = dist_store->ref_index + dist_store->mol_start[mol];
+        size = dist_store->mol_start[mol + 1] - dist_store->mol_start[mol];
+        if (dist_store->bUnwrapRef) {
+            center_of_mass_pbc(group, size, x, top,
+                    dist_store->mol_mass[mol], pbc,
+                    dist_store->mol_com[mol]);
+        }
+        else {
+            center_of_mass(group, size, x, top, dist_store->mol_mass[mol],
+                    dist_store->mol_com[mol]);
+        }
+    }
+    cell_list_fill(dist_store->ref_cells, box, dist_store->mol_index,
+            dist_store->nmols, dist_store->mol_com);
+    if (!pbc || !dist_store->ref_cells->bValid) {
+        make_2D_group(dist_store->mol_index, dist_store->nmols,
+                dist_store->mol_com, dist_store->axis[0],
+                dist_store->ref_2D);
+    }
+}
+
+void dist_start_frame(DistMode *dist_store, matrix box, t_topology *top,
+                      rvec *x, t_pbc *pbc) {
+    if (dist_store) {
+        dist_count_frame(dist_store, box);
         /* Get reference group center of mass if needed */
-        if (dist_store->bCOM) {
-            dist_store->com = center_of_mass(dist_store->ref_index,
-                    dist_store->ref_size, x, top, dist_store->mass);
+        if (dist_store->nmols > 0) {
+            _molecule_centers(dist_store, box, top, x, pbc);
+        }
+        else if (dist_store->bCOM && dist_store->bUnwrapRef) {
+            center_of_mass_pbc(dist_store->ref_index, dist_store->ref_size,
+                    x, top, dist_store->mass, pbc, dist_store->com);
+        }
+        else if (dist_store->bCOM) {
+            center_of_mass(dist_store->ref_index, dist_store->ref_size,
+                    x, top, dist_store->mass, dist_store->com);
+        }
+        else {
+            cell_list_fill(dist_store->ref_cells, box, dist_store->ref_index,
+                    dist_store->ref_size, x);
+            if (!pbc || !dist_store->ref_cells->bValid) {
+                make_2D_group(dist_store->ref_index, dist_store->ref_size,
+                        x, dist_store->axis[0], dist_store->ref_2D);
+            }
         }
     }
 }
 
-void dist_end_frame(DistMode *dist_store, int adt) {
-    int i, leaflet;
-    if (dist_store && adt > 0 && dist_store->nframes % adt == 0) {
-        /* Average the fields */
-        _average_field_dist(dist_store);
-        /* Calculate the thickness */
-        _calculate_thickness_dist(dist_store);
-        /* Empty the fields */
-        for (leaflet = 0; leaflet < 2; ++leaflet) {
-            for (i=0; i < dist_store->length; ++i) {
-                dist_store->height[leaflet][i] = 0.0;
-                dist_store->sampling[leaflet][i] = 0;
+/** Whether the trajectory ends on an open window, folded in the results
+ * by the end of the analysis
+ *
+ * That is the single window of a negative -adt, or an -adt longer than the
+ * trajectory.
+ */
+static gmx_bool _ends_on_open_window(DistMode *dist_store) {
+    return dist_store->adt < 0 || dist_store->adt > dist_store->nframes;
+}
+
+/** Close the window if the frame is the last one of an -adt window
+ *
+ * The window is folded in the thickness right away, unless the instance is
+ * a worker copy.
+ */
+void dist_end_frame(DistMode *dist_store) {
+    if (dist_store && dist_store->adt > 0
+            && dist_store->nframes % dist_store->adt == 0) {
+        dist_close_window(dist_store);
+        if (!dist_store->bDefer) {
+            dist_commit_windows(dist_store, dist_store);
+        }
+    }
+}
+
+/** Compute the thickness of the window accumulated in "window", keep it
+ * until the next dist_commit_windows, and empty the leaflets
+ */
+void dist_close_window(DistMode *window) {
+    if (window) {
+        if (window->npending == window->pending_alloc) {
+            srenew(window->pending, window->pending_alloc + 1);
+            snew(window->pending[window->pending_alloc].bins,
+                    window->length);
+            snew(window->pending[window->pending_alloc].thickness,
+                    window->length);
+            snew(window->pending[window->pending_alloc].sampling,
+                    window->length);
+            window->pending_alloc += 1;
+        }
+        stats_count(COUNTER_CELLS, window->ntouched);
+        _close_window_dist_into(window, &window->pending[window->npending]);
+        window->npending += 1;
+    }
+}
+
+/** Fold the windows closed by "window" into the thickness of "dist_store",
+ * in the order they were closed
+ */
+void dist_commit_windows(DistMode *dist_store, DistMode *window) {
+    int i;
+    if (dist_store && window) {
+        for (i=0; i < window->npending; ++i) {
+            _apply_window_dist(dist_store, &window->pending[i]);
+        }
+        window->npending = 0;
+    }
+}
+
+/** Add the unfinished window of "other" to the one of "dist_store"
+ *
+ * The frame count and box widths are not touched. "other" is a worker copy,
+ * so it has no thickness of its own.
+ */
+void dist_reduce_fields(DistMode *dist_store, DistMode *other) {
+    int leaflet, bin, i;
+    if (dist_store && other) {
+        for (i=0; i < other->ntouched; ++i) {
+            bin = other->touched[i];
+            if (dist_store->sampling[0][bin] == 0
+                    && dist_store->sampling[1][bin] == 0) {
+                dist_store->touched[dist_store->ntouched++] = bin;
+            }
+            for (leaflet = 0; leaflet < 2; ++leaflet) {
+                dist_store->height[leaflet][bin] += other->height[leaflet][bin];
+                dist_store->sampling[leaflet][bin]
+                    += other->sampling[leaflet][bin];
             }
         }
-        /* Free the center of mass if needed */
-        if (dist_store->bCOM) {
-            sfree(dist_store->com);
+    }
+}
+
+/** Add the frames analysed by another instance with the same settings, as
+ * grid_add does for the grids
+ */
+void dist_add(DistMode *dist_store, DistMode *other) {
+    int leaflet, bin;
+    if (dist_store && other) {
+        dist_store->nframes += other->nframes;
+        dist_store->box_width += other->box_width;
+        for (bin = 0; bin < other->length; ++bin) {
+            for (leaflet = 0; leaflet < 3; ++leaflet) {
+                dist_store->height[leaflet][bin] += other->height[leaflet][bin];
+            }
+            for (leaflet = 0; leaflet < 2; ++leaflet) {
+                dist_store->sampling[leaflet][bin]
+                    += other->sampling[leaflet][bin];
+            }
+            window_stats_merge(&dist_store->stats, bin,
+                    dist_store->sampling[2][bin], other->stats.mean[bin],
+                    other->stats.m2[bin], other->stats.w2[bin],
+                    other->sampling[2][bin]);
+            dist_store->sampling[2][bin] += other->sampling[2][bin];
+        }
+        dist_find_touched(dist_store);
+    }
+}
+
+/** List again the bins hit during the open window, after the leaflets were
+ * filled directly as when accumulator files are merged
+ */
+void dist_find_touched(DistMode *dist_store) {
+    int i;
+    if (dist_store) {
+        dist_store->ntouched = 0;
+        for (i=0; i < dist_store->length; ++i) {
+            if (dist_store->sampling[0][i] > 0
+                    || dist_store->sampling[1][i] > 0) {
+                dist_store->touched[dist_store->ntouched++] = i;
+            }
         }
     }
 }
@@ -154,47 +580,179 @@ void dist_store(DistMode *dist, int leaflet, int atom, rvec *x, t_pbc *pbc) {
     int slice = 0;
     int i = 0;
     real distance = 0;
-    rvec *com = NULL;
     /*real distance2 = 0;*/
     if (dist) {
-        if (dist->bCOM) {
-            distance = dist_2D(x[atom], *(dist->com), pbc, dist->axis[0]);
+        /* The nearest molecule is searched like the nearest atom */
+        if (dist->bCOM && dist->nmols == 0) {
+            distance = dist_2D(x[atom], dist->com, pbc, dist->axis[0]);
+        }
+        else if (pbc && dist->ref_cells->bValid) {
+            distance = cell_list_min_dist(dist->ref_cells, x[atom]);
         }
         else {
-            distance = min_dist(x[atom], dist->ref_index, dist->ref_size,
-                    x, pbc, dist->axis[0]);
+            distance = min_dist(x[atom], dist->ref_2D,
+                    dist->nmols > 0 ? dist->nmols : dist->ref_size,
+                    pbc, dist->axis[0]);
         }
 
         slice = distance/dist->width;
+        /* Rounding can put the farthest atoms beyond the last bin */
         if (slice >= dist->length) {
-            printf("arrggg: %d >= %d\n", slice, dist->length);
+            stats_count(COUNTER_OUT_OF_RANGE, 1);
+            return;
+        }
+        if (dist->sampling[leaflet][slice] == 0
+                && dist->sampling[1 - leaflet][slice] == 0) {
+            dist->touched[dist->ntouched++] = slice;
         }
         dist->height[leaflet][slice] += x[atom][dist->axis[0]];
         dist->sampling[leaflet][slice] += 1;
     }
 }
 
-void dist_end(DistMode *dist_store, int adt) {
+/** Copy the results of a distance profile as dist_end would write them if
+ * the trajectory stopped at the last frame
+ *
+ * The arrays hold one value per bin and any of them can be NULL; the width
+ * of the bins is given in "bin_size". The open window is handled as in
+ * grid_snapshot.
+ */
+void dist_snapshot(DistMode *dist_store, real *bin_size, real *thickness,
+        int *sampling, real *error) {
+    int bin, leaflet, minsamp, weight, i;
+    real height[2], window, sum;
+    double mean, m2, w2;
+    WindowStats stats = {1, &mean, &m2, &w2};
+    if (!dist_store) {
+        return;
+    }
+    if (bin_size) {
+        *bin_size = dist_store->box_width / dist_store->nframes
+            / dist_store->length;
+    }
+    for (bin=0; bin < dist_store->length; ++bin) {
+        if (thickness) {
+            thickness[bin] = dist_store->height[2][bin]
+                / dist_store->sampling[2][bin];
+        }
+        if (sampling) {
+            sampling[bin] = dist_store->sampling[2][bin];
+        }
+        if (error) {
+            error[bin] = window_stats_error(&dist_store->stats, bin,
+                    dist_store->sampling[2][bin]);
+        }
+    }
+    if (!_ends_on_open_window(dist_store)) {
+        return;
+    }
+    /* Fold the open window on copies of the bins it hit */
+    for (i=0; i < dist_store->ntouched; ++i) {
+        bin = dist_store->touched[i];
+        minsamp = min(dist_store->sampling[0][bin],
+                dist_store->sampling[1][bin]);
+        if (minsamp == 0) {
+            continue;
+        }
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            height[leaflet] = dist_store->height[leaflet][bin]
+                / dist_store->sampling[leaflet][bin];
+        }
+        window = (real)fabs(height[0] - height[1]);
+        weight = dist_store->sampling[2][bin];
+        sum = dist_store->height[2][bin];
+        sum += window * minsamp;
+        if (thickness) {
+            thickness[bin] = sum / (weight + minsamp);
+        }
+        if (sampling) {
+            sampling[bin] = weight + minsamp;
+        }
+        if (error) {
+            mean = dist_store->stats.mean[bin];
+            m2 = dist_store->stats.m2[bin];
+            w2 = dist_store->stats.w2[bin];
+            window_stats_add(&stats, 0, weight, window, minsamp);
+            error[bin] = window_stats_error(&stats, 0, weight + minsamp);
+        }
+    }
+}
+
+/** Write the profiles from the beginning of their data, so they can be
+ * written again with newer results
+ *
+ * "error" is only read if the standard error is written.
+ */
+static void _write_profiles(DistMode *dist_store, real bin_size,
+        real *thickness, int *sampling, real *error) {
+    int i;
+    rewind_output(dist_store->out_dist, dist_store->data_start[0]);
+    rewind_output(dist_store->out_sampling, dist_store->data_start[1]);
+    rewind_output(dist_store->out_error, dist_store->data_start[2]);
+    for (i=0; i<dist_store->length; ++i) {
+        if (sampling[i] > 0) {
+            fprintf(dist_store->out_dist, "%7.3f %7.3f\n",
+                    i*bin_size, thickness[i]);
+            fprintf(dist_store->out_sampling, "%7.3f %7d\n",
+                    i*bin_size, sampling[i]);
+            if (dist_store->out_error) {
+                fprintf(dist_store->out_error, "%7.3f %7.3f\n",
+                        i*bin_size, error[i]);
+            }
+        }
+    }
+    truncate_output(dist_store->out_dist);
+    truncate_output(dist_store->out_sampling);
+    truncate_output(dist_store->out_error);
+}
+
+/** Write the output files with the results of the frames analysed so far
+ *
+ * The files are written again at each call, and by dist_end.
+ */
+void dist_flush(DistMode *dist_store) {
+    real *thickness, *error;
+    int *sampling;
+    real bin_size;
+    if (dist_store && dist_store->out_dist) {
+        snew(thickness, dist_store->length);
+        snew(sampling, dist_store->length);
+        snew(error, dist_store->length);
+        dist_snapshot(dist_store, &bin_size, thickness, sampling, error);
+        _write_profiles(dist_store, bin_size, thickness, sampling, error);
+        sfree(thickness);
+        sfree(sampling);
+        sfree(error);
+    }
+}
+
+void dist_end(DistMode *dist_store) {
     if (dist_store) {
-        int i, leaflet;
+        int i;
         real bin_size = 0;
+        real *error = NULL;
         dist_store->box_width /= dist_store->nframes;
         bin_size = dist_store->box_width/dist_store->length;
-        if (adt < 0 || adt > dist_store->nframes) {
-            _average_field_dist(dist_store);
-            _calculate_thickness_dist(dist_store);
+        if (_ends_on_open_window(dist_store)) {
+            dist_close_window(dist_store);
+            dist_commit_windows(dist_store, dist_store);
         }
         for (i=0; i < dist_store->length; ++i) {
             dist_store->height[2][i] /= dist_store->sampling[2][i];
         }
-        /* Write the output */
-        for (i=0; i<dist_store->length; ++i) {
-            if (dist_store->sampling[2][i] > 0) {
-                fprintf(dist_store->out_dist, "%7.3f %7.3f\n",
-                        i*bin_size, dist_store->height[2][i]);
-                fprintf(dist_store->out_sampling, "%7.3f %7d\n",
-                        i*bin_size, dist_store->sampling[2][i]);
+        /* Write the output, if any */
+        if (!dist_store->out_dist) {
+            return;
+        }
+        if (dist_store->out_error) {
+            snew(error, dist_store->length);
+            for (i=0; i < dist_store->length; ++i) {
+                error[i] = window_stats_error(&dist_store->stats, i,
+                        dist_store->sampling[2][i]);
             }
         }
+        _write_profiles(dist_store, bin_size, dist_store->height[2],
+                dist_store->sampling[2], error);
+        sfree(error);
     }
 }
@@ -13,6 +13,21 @@
 #include <gromacs/vec.h>
 
 #include "distances.h"
+#include "output_file.h"
+#include "cell_list.h"
+#include "run_stats.h"
+#include "window_stats.h"
+
+/** Thickness of a closed -adt window waiting to be folded in the thickness
+ *
+ * Only the bins sampled by both leaflets are kept.
+ */
+typedef struct DistWindow {
+    int  *bins;
+    real *thickness;
+    int  *sampling;     /* Sampling of the least sampled leaflet */
+    int nbins;
+} DistWindow;
 
 typedef struct DistMode {
     real *height[3];    
@@ -20,6 +35,8 @@ typedef struct DistMode {
     int  length;
     FILE *out_dist;
     FILE *out_sampling;
+    FILE *out_error;    /* Standard error of the thickness, or NULL */
+    gmx_off_t data_start[3];    /* End of the header of each output file */
     real width;
     int axis[2];
     real box_width;
@@ -28,24 +45,75 @@ typedef struct DistMode {
     int ref_size;
     real mass;
     gmx_bool bCOM;
-    rvec *com;
+    gmx_bool bUnwrapRef;    /* Unwrap the reference group for its COM */
+    rvec com;               /* Center of mass of the reference group */
+    /* The distance is the one to the center of mass of the nearest
+     * molecule; set even when merging, without the molecules */
+    gmx_bool bRefMols;
+    /* Molecules of the reference group, when the distance is the one to the
+     * center of mass of the nearest molecule; nmols is 0 otherwise */
+    int nmols;
+    int *mol_start;         /* First atom of each molecule in ref_index */
+    real *mol_mass;
+    rvec *mol_com;
+    atom_id *mol_index;     /* 0 to nmols - 1, to index mol_com */
+    /* Cell list of the reference atoms, or of the centers of mass of the
+     * molecules */
+    CellList2D *ref_cells;
+    /* Reference points projected on the plane, for the frames the cell list
+     * can not handle */
+    rvec *ref_2D;
+    /* Frames per window; a single window if lesser than 0 */
+    int adt;
+    /* Closed windows wait for dist_commit_windows instead of being folded
+     * at once; this is the case of the worker copies */
+    gmx_bool bDefer;
+    DistWindow *pending;
+    int npending;
+    int pending_alloc;
+    /* Bins hit during the open window; only them are averaged and emptied
+     * when the window is closed */
+    int *touched;
+    int ntouched;
+    /* Statistics of the window thickness of each bin */
+    WindowStats stats;
 } DistMode; 
 
-DistMode *build_dist(int length, int normal_axis,
-        const char *dist_fn, const char *sampling_fn, output_env_t oenv,
-        const char *index_fn, t_topology *top, gmx_bool bCOM);
+DistMode *build_dist_group(int length, int normal_axis, int adt,
+        const char *dist_fn, const char *sampling_fn, const char *error_fn,
+        output_env_t oenv, atom_id *ref_index, int ref_size, t_topology *top,
+        gmx_bool bCOM, gmx_bool bUnwrapRef);
 
-void clean_dist(DistMode *dist_store);
+void dist_nearest_molecule(DistMode *dist_store, t_topology *top);
+
+DistMode *dist_worker_copy(DistMode *dist_store);
 
 void clean_dist(DistMode *dist_store);
 
+void dist_count_frame(DistMode *dist_store, matrix box);
+
 void dist_start_frame(DistMode *dist_store, matrix box, t_topology *top,
-                      rvec *x);
+                      rvec *x, t_pbc *pbc);
+
+void dist_end_frame(DistMode *dist_store);
+
+void dist_close_window(DistMode *window);
 
-void dist_end_frame(DistMode *dist_store, int adt);
+void dist_commit_windows(DistMode *dist_store, DistMode *window);
+
+void dist_reduce_fields(DistMode *dist_store, DistMode *other);
+
+void dist_add(DistMode *dist_store, DistMode *other);
+
+void dist_find_touched(DistMode *dist_store);
 
 void dist_store(DistMode *dist, int leaflet, int atom, rvec *x, t_pbc *pbc);
 
-void dist_end(DistMode *dist_store, int adt);
+void dist_snapshot(DistMode *dist_store, real *bin_size, real *thickness,
+        int *sampling, real *error);
+
+void dist_flush(DistMode *dist_store);
+
+void dist_end(DistMode *dist_store);
 
 #endif
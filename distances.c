@@ -40,15 +40,22 @@ real get_distance(rvec pointA, rvec pointB, t_pbc *pbc) {
     return dist;
 }
 
-real min_dist(rvec pointA, atom_id *group, int grp_size, rvec *x, t_pbc *pbc, int axis) {
+void make_2D_group(atom_id *group, int grp_size, rvec *x, int axis,
+        rvec *result) {
+    int i;
+    for (i=0; i<grp_size; ++i) {
+        make_2D(x[group[i]], axis, result[i]);
+    }
+}
+
+real min_dist(rvec pointA, rvec *points, int npoints, t_pbc *pbc, int axis) {
     int i;
     real dist;
     real min_dist = GMX_REAL_MAX;
-    rvec pointA_mod, pointB;
+    rvec pointA_mod;
     make_2D(pointA, axis, pointA_mod);
-    for (i=0; i<grp_size; ++i) {
-        make_2D(x[group[i]], axis, pointB);
-        dist = get_distance(pointA_mod, pointB, pbc);
+    for (i=0; i<npoints; ++i) {
+        dist = get_distance(pointA_mod, points[i], pbc);
         if (dist < min_dist) {
             min_dist = dist;
         }
@@ -65,20 +72,39 @@ real get_mass(atom_id *group, int grp_size, t_topology *top) {
     return mass;
 }
 
-rvec *center_of_mass(atom_id *group, int grp_size, rvec *x,
-        t_topology *top, real mass) {
-    rvec *com = NULL;
+void center_of_mass(atom_id *group, int grp_size, rvec *x,
+        t_topology *top, real mass, rvec com) {
     int i = 0, dim=0;
-    snew(com, 1);
+    clear_rvec(com);
+    for (i=0; i<grp_size; ++i) {
+        for (dim=0; dim<DIM; ++dim) {
+            com[dim] += x[group[i]][dim] * top->atoms.atom[group[i]].m;
+        }
+    }
+    for (dim=0; dim<DIM; ++dim) {
+        com[dim] /= mass;
+    }
+}
+
+void center_of_mass_pbc(atom_id *group, int grp_size, rvec *x,
+        t_topology *top, real mass, t_pbc *pbc, rvec com) {
+    rvec dx;
+    int i = 0, dim=0;
+    if (!pbc || grp_size <= 0) {
+        center_of_mass(group, grp_size, x, top, mass, com);
+        return;
+    }
+    clear_rvec(com);
+    /* Unwrap every atom relative to the first one */
     for (i=0; i<grp_size; ++i) {
+        pbc_dx(pbc, x[group[i]], x[group[0]], dx);
         for (dim=0; dim<DIM; ++dim) {
-            (*com)[dim] += x[group[i]][dim] * top->atoms.atom[group[i]].m;
+            com[dim] += dx[dim] * top->atoms.atom[group[i]].m;
         }
     }
     for (dim=0; dim<DIM; ++dim) {
-        (*com)[dim] /= mass;
+        com[dim] = x[group[0]][dim] + com[dim] / mass;
     }
-    return com;
 }
 
 real dist_2D(rvec pointA, rvec pointB, t_pbc *pbc, int axis) {
@@ -5,6 +5,13 @@
 
 void make_2D(rvec vector, int axis, rvec result);
 
+/** Project the atoms of a group on the plane normal to "axis"
+ *
+ * "result" holds at least grp_size vectors.
+ */
+void make_2D_group(atom_id *group, int grp_size, rvec *x, int axis,
+        rvec *result);
+
 /** Substract 2 vector of coordinates and take PBC into account if needed
  *
  * :Parameters:
@@ -19,19 +26,30 @@ void pbc_rvec_sub(const t_pbc *pbc,const rvec xi,const rvec xj,rvec dx);
  */
 real get_distance(rvec pointA, rvec pointB, t_pbc *pbc);
 
-/** Get the minimum distance between a point and a group of points
+/** Get the minimum in-plane distance between a point and a group of points
+ *
+ * The points of the group are already projected with make_2D_group.
  */
-real min_dist(rvec pointA, atom_id *group, int grp_size, rvec *x, t_pbc *pbc,
-        int axis);
+real min_dist(rvec pointA, rvec *points, int npoints, t_pbc *pbc, int axis);
 
 /** Get mass of a group
  */
 real get_mass(atom_id *group, int grp_size, t_topology *top);
 
-/** Get the center of mass of a group of atoms
+/** Get the center of mass of a group of atoms in "com"
+ */
+void center_of_mass(atom_id *group, int grp_size, rvec *x,
+        t_topology *top, real mass, rvec com);
+
+/** Get the center of mass of a group of atoms that may be split by the
+ * periodic boundaries
+ *
+ * The atoms are unwrapped relative to the first atom of the group, so the
+ * group has to be smaller than half the box. Without PBC, this is the same
+ * as center_of_mass.
  */
-rvec *center_of_mass(atom_id *group, int grp_size, rvec *x,
-        t_topology *top, real mass);
+void center_of_mass_pbc(atom_id *group, int grp_size, rvec *x,
+        t_topology *top, real mass, t_pbc *pbc, rvec com);
 
 /** Get the distance between two point in 2D
  */
@@ -0,0 +1,313 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <gromacs/futil.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/statutil.h>
+
+#include "frame_index.h"
+
+/* Size in bytes of the header of the sidecar file */
+#define FRAME_INDEX_HEADER 64
+
+/** Decode a big endian (XDR) 32 bits integer
+ */
+static uint32_t read_be32(const unsigned char *bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16)
+        | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+/** Decode a big endian (XDR) 32 bits float
+ */
+static float read_be_float(const unsigned char *bytes) {
+    uint32_t bits = read_be32(bytes);
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+gmx_bool xtc_decode_header(const unsigned char *bytes,
+        XtcFrameHeader *header) {
+    int i;
+    if (read_be32(bytes) != XTC_MAGIC) {
+        return FALSE;
+    }
+    header->natoms = read_be32(bytes + 4);
+    header->step = read_be32(bytes + 8);
+    header->time = read_be_float(bytes + 12);
+    for (i = 0; i < DIM * DIM; ++i) {
+        header->box[i] = read_be_float(bytes + 16 + 4 * i);
+    }
+    return TRUE;
+}
+
+static void add_frame(FrameIndex *index, int *nalloc, gmx_off_t offset,
+        real time) {
+    if (index->nframes == *nalloc) {
+        *nalloc = max(2 * (*nalloc), 1024);
+        srenew(index->offsets, *nalloc);
+        srenew(index->times, *nalloc);
+    }
+    index->offsets[index->nframes] = offset;
+    index->times[index->nframes] = time;
+    index->nframes += 1;
+}
+
+/** Build the index by jumping from frame header to frame header
+ *
+ * Only the headers are read; the coordinates are never decompressed.
+ */
+static FrameIndex *scan_xtc(const char *traj_fn) {
+    FrameIndex *index;
+    FILE *traj;
+    unsigned char header[XTC_COMPRESSED_HEADER];
+    XtcFrameHeader fields;
+    gmx_off_t offset = 0, size;
+    int natoms, nalloc = 0;
+
+    snew(index, 1);
+    index->natoms = -1;
+    index->nframes = 0;
+    index->offsets = NULL;
+    index->times = NULL;
+    traj = ffopen(traj_fn, "rb");
+    while (fread(header, 1, XTC_HEADER, traj) == XTC_HEADER) {
+        if (!xtc_decode_header(header, &fields)) {
+            gmx_fatal(FARGS, "%s is not an XTC file or is corrupted "
+                    "(frame %d)\n", traj_fn, index->nframes);
+        }
+        natoms = fields.natoms;
+        if (index->natoms < 0) {
+            index->natoms = natoms;
+        }
+        else if (natoms != index->natoms) {
+            gmx_fatal(FARGS, "The number of atoms changes at frame %d of %s\n",
+                    index->nframes, traj_fn);
+        }
+        /* Few atoms are stored uncompressed */
+        if (natoms <= 9) {
+            size = XTC_HEADER + 3 * natoms * sizeof(float);
+        }
+        else {
+            if (fread(header + XTC_HEADER, 1,
+                        XTC_COMPRESSED_HEADER - XTC_HEADER, traj)
+                    != XTC_COMPRESSED_HEADER - XTC_HEADER) {
+                break;
+            }
+            size = XTC_COMPRESSED_HEADER
+                + ((read_be32(header + XTC_COMPRESSED_HEADER - 4) + 3) & ~3u);
+        }
+        if (gmx_fseek(traj, offset + size, SEEK_SET) != 0) {
+            break;
+        }
+        add_frame(index, &nalloc, offset, fields.time);
+        offset += size;
+    }
+    /* A truncated last frame is ignored, like the trajectory readers do */
+    if (index->nframes > 0) {
+        gmx_fseek(traj, 0, SEEK_END);
+        if (gmx_ftell(traj) < offset) {
+            index->nframes -= 1;
+        }
+    }
+    ffclose(traj);
+    return index;
+}
+
+static gmx_bool read_sidecar(FrameIndex *index, const char *sidecar_fn,
+        struct stat *traj_stat) {
+    FILE *sidecar;
+    char header[FRAME_INDEX_HEADER];
+    int32_t values[4];
+    int64_t stamps[2];
+    int64_t *offsets;
+    double *times;
+    int i;
+    gmx_bool bValid;
+
+    sidecar = fopen(sidecar_fn, "rb");
+    if (!sidecar) {
+        return FALSE;
+    }
+    bValid = (fread(header, 1, FRAME_INDEX_HEADER, sidecar)
+            == FRAME_INDEX_HEADER);
+    if (bValid) {
+        memcpy(values, header + 8, sizeof(values));
+        memcpy(stamps, header + 24, sizeof(stamps));
+        bValid = (strncmp(header, "GTHKFIDX", 8) == 0
+                && values[0] == 1 && values[1] == 0x01020304
+                && values[3] >= 0
+                && stamps[0] == (int64_t)traj_stat->st_size
+                && stamps[1] == (int64_t)traj_stat->st_mtime);
+    }
+    if (bValid) {
+        index->natoms = values[2];
+        index->nframes = values[3];
+        snew(offsets, index->nframes);
+        snew(times, index->nframes);
+        bValid = (fread(offsets, sizeof(int64_t), index->nframes, sidecar)
+                    == (size_t)index->nframes
+                && fread(times, sizeof(double), index->nframes, sidecar)
+                    == (size_t)index->nframes);
+        snew(index->offsets, index->nframes);
+        snew(index->times, index->nframes);
+        for (i = 0; i < index->nframes; ++i) {
+            index->offsets[i] = offsets[i];
+            index->times[i] = times[i];
+        }
+        sfree(offsets);
+        sfree(times);
+        if (!bValid) {
+            sfree(index->offsets);
+            sfree(index->times);
+        }
+    }
+    fclose(sidecar);
+    return bValid;
+}
+
+/** Write the sidecar file of an index
+ *
+ * The file starts with a FRAME_INDEX_HEADER bytes long header in the native
+ * byte order:
+ *
+ *  - offset  0: magic string "GTHKFIDX" (8 bytes)
+ *  - offset  8: int32, format version (1)
+ *  - offset 12: int32, byte order mark (0x01020304)
+ *  - offset 16: int32, number of atoms
+ *  - offset 20: int32, number of frames
+ *  - offset 24: int64, size of the trajectory in bytes
+ *  - offset 32: int64, modification time of the trajectory
+ *
+ * The int64 frame offsets and the float64 frame times follow.
+ *
+ * Failing to write the file is not an error; the index will just be built
+ * again next time.
+ */
+static void write_sidecar(FrameIndex *index, const char *sidecar_fn,
+        struct stat *traj_stat) {
+    FILE *sidecar;
+    char header[FRAME_INDEX_HEADER];
+    int32_t values[4] = {1, 0x01020304, 0, 0};
+    int64_t stamps[2];
+    int64_t offset;
+    double time;
+    int i;
+    gmx_bool bOK;
+
+    sidecar = fopen(sidecar_fn, "wb");
+    if (!sidecar) {
+        fprintf(stderr, "Can not write the frame index to %s\n", sidecar_fn);
+        return;
+    }
+    values[2] = index->natoms;
+    values[3] = index->nframes;
+    stamps[0] = traj_stat->st_size;
+    stamps[1] = traj_stat->st_mtime;
+    memset(header, 0, FRAME_INDEX_HEADER);
+    memcpy(header, "GTHKFIDX", 8);
+    memcpy(header + 8, values, sizeof(values));
+    memcpy(header + 24, stamps, sizeof(stamps));
+    bOK = (fwrite(header, 1, FRAME_INDEX_HEADER, sidecar)
+            == FRAME_INDEX_HEADER);
+    for (i = 0; bOK && i < index->nframes; ++i) {
+        offset = index->offsets[i];
+        bOK = (fwrite(&offset, sizeof(int64_t), 1, sidecar) == 1);
+    }
+    for (i = 0; bOK && i < index->nframes; ++i) {
+        time = index->times[i];
+        bOK = (fwrite(&time, sizeof(double), 1, sidecar) == 1);
+    }
+    if (fclose(sidecar) != 0 || !bOK) {
+        fprintf(stderr, "Can not write the frame index to %s\n", sidecar_fn);
+        remove(sidecar_fn);
+    }
+}
+
+FrameIndex *build_frame_index(const char *traj_fn) {
+    FrameIndex *index;
+    struct stat traj_stat;
+    char *sidecar_fn;
+
+    if (fn2ftp(traj_fn) != efXTC) {
+        gmx_fatal(FARGS, "Seeking in the trajectory is only possible with "
+                "XTC files\n");
+    }
+    if (stat(traj_fn, &traj_stat) != 0) {
+        gmx_fatal(FARGS, "Can not access %s\n", traj_fn);
+    }
+    snew(sidecar_fn, strlen(traj_fn) + strlen(FRAME_INDEX_EXT) + 1);
+    sprintf(sidecar_fn, "%s%s", traj_fn, FRAME_INDEX_EXT);
+
+    snew(index, 1);
+    if (read_sidecar(index, sidecar_fn, &traj_stat)) {
+        fprintf(stderr, "Read the index of %d frames from %s\n",
+                index->nframes, sidecar_fn);
+    }
+    else {
+        sfree(index);
+        index = scan_xtc(traj_fn);
+        fprintf(stderr, "Indexed %d frames of %s\n", index->nframes, traj_fn);
+        write_sidecar(index, sidecar_fn, &traj_stat);
+    }
+    sfree(sidecar_fn);
+    return index;
+}
+
+void clean_frame_index(FrameIndex *index) {
+    if (index) {
+        sfree(index->offsets);
+        sfree(index->times);
+        sfree(index);
+    }
+}
+
+int frame_index_find_time(FrameIndex *index, real time) {
+    int low = 0, high = index->nframes, mid;
+    /* Times grow along the trajectory */
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (index->times[mid] < time) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/** Tell if the time of a frame from "t0" is a multiple of "dt", with the
+ * tolerance the trajectory readers of GROMACS use
+ */
+static gmx_bool time_multiple(double time, double t0, double dt) {
+    double tol = 2 * GMX_FLOAT_EPS;
+    int iq = (int)((time - t0 + tol * time) / dt);
+    return fabs(time - t0 - dt * iq) <= tol * fabs(time);
+}
+
+int frame_index_select(FrameIndex *index, int **frames) {
+    int first = 0, end = index->nframes, nselected = 0, i;
+
+    if (bTimeSet(TBEGIN)) {
+        first = frame_index_find_time(index, rTimeValue(TBEGIN));
+    }
+    if (bTimeSet(TEND)) {
+        end = frame_index_find_time(index, rTimeValue(TEND));
+        while (end < index->nframes
+                && index->times[end] <= rTimeValue(TEND)) {
+            end += 1;
+        }
+    }
+    snew(*frames, max(end - first, 1));
+    for (i = first; i < end; ++i) {
+        if (!bTimeSet(TDELTA) || time_multiple(index->times[i],
+                    index->times[first], rTimeValue(TDELTA))) {
+            (*frames)[nselected++] = i;
+        }
+    }
+    return nselected;
+}
@@ -0,0 +1,72 @@
+#ifndef _frame_index_h
+#define _frame_index_h
+
+#include <gromacs/typedefs.h>
+
+/** Byte offset and time of every frame of an XTC trajectory
+ *
+ * The index lets the trajectory reader seek to any frame instead of
+ * decoding the trajectory from the beginning. It is cached next to the
+ * trajectory in a sidecar file named after it with FRAME_INDEX_EXT appended.
+ */
+typedef struct FrameIndex {
+    int natoms;
+    int nframes;
+    gmx_off_t *offsets;
+    real *times;
+} FrameIndex;
+
+#define FRAME_INDEX_EXT ".tidx"
+
+/* Magic number at the beginning of every XTC frame */
+#define XTC_MAGIC 1995
+/* An XTC frame starts with the int32 magic number, number of atoms and
+ * step, the float32 time and the float32[3][3] box, in big endian (XDR).
+ * The coordinate block follows at XTC_COORDS_OFFSET with the number of
+ * atoms again, then, for more than 9 atoms, with the precision, the integer
+ * bounds, the smallidx and the byte count of the compressed coordinates */
+#define XTC_COORDS_OFFSET 52
+#define XTC_HEADER 56
+#define XTC_COMPRESSED_HEADER 92
+
+/** Fields of the header of an XTC frame
+ */
+typedef struct XtcFrameHeader {
+    int natoms;
+    int step;
+    float time;
+    float box[DIM * DIM];
+} XtcFrameHeader;
+
+/** Decode the first XTC_HEADER bytes of an XTC frame
+ *
+ * Return FALSE if they do not start with XTC_MAGIC.
+ */
+gmx_bool xtc_decode_header(const unsigned char *bytes,
+        XtcFrameHeader *header);
+
+/** Load the index of an XTC trajectory from its sidecar file, or build it
+ * by scanning the frame headers and write the sidecar file
+ *
+ * A sidecar file is only used if the size and modification time of the
+ * trajectory it records match the ones of the trajectory on disk.
+ */
+FrameIndex *build_frame_index(const char *traj_fn);
+
+void clean_frame_index(FrameIndex *index);
+
+/** Get the first frame with a time larger or equal to "time"
+ *
+ * Return index->nframes if there is no such frame.
+ */
+int frame_index_find_time(FrameIndex *index, real time);
+
+/** Get the frames the trajectory readers keep with -b, -e and -dt
+ *
+ * With -dt, a frame is kept when its time from the first frame at or after
+ * -b is a multiple of -dt. "frames" is allocated with the indices of the
+ * kept frames, in trajectory order; return their number.
+ */
+int frame_index_select(FrameIndex *index, int **frames);
+
+#endif /* _frame_index_h */
@@ -12,8 +12,12 @@
 #include <gromacs/vec.h>
 #include <gromacs/xvgr.h>
 
-#include "grid_mode.h"
-#include "dist_mode.h"
+#include "accumulators.h"
+#include "analyses.h"
+#include "pipeline.h"
+#include "replicas.h"
+#include "run_stats.h"
+#include "traj_reader.h"
 
 static const char *authors[] = {
     "Written by Jonathan Barnoud (jonathan.barnoud@inserm.fr)",
@@ -38,60 +42,65 @@ void sp_print(FILE *out, const char *txt)
 }
 
 
-typedef struct GeneralData {
-    int ngrps;
-    atom_id **index;
-    int *isize;
-    char **grpnames;
-    const char *traj_fn;
-    int adt;
-} GeneralData;
-
-typedef struct t_modes {
-    GridHeight *grid_store;
-    DistMode *dist_store;
-    GeneralData *general;
-} t_modes;
-
 /*****************************************************************************
  *                               I/O stuff                                   *
  *****************************************************************************/
-void clean_modes(t_modes *modes) {
-    int group;
-    clean_grids(modes->grid_store);
-    clean_dist(modes->dist_store);
-    for (group = 0; group < modes->general->ngrps; ++group) {
-        sfree(modes->general->index[group]);
-        sfree(modes->general->grpnames[group]);
-    }
-    sfree(modes->general->index);
-    sfree(modes->general->isize);
-    sfree(modes->general->grpnames);
-}
-
 /** Read user choices and prepare the run
+ *
+ * "replicas" is set when several trajectories are given, else it is NULL.
  */
-t_modes handle_user(int argc, char **argv,
-        output_env_t *oenv, t_topology **top, int *ePBC) {
+Thickness *handle_user(int argc, char **argv, output_env_t *oenv,
+        ReplicaSet **replicas) {
     int i;
     /* Output variable */
-    t_modes modes;
+    Thickness *th;
+    t_topology *top = NULL;
+    int ePBC = epbcNONE;
     /* Variables for the reading of the arguments */
     static const char *axtitle[] = { NULL, "z", "x", "y", NULL };
     static const char *prof_axtitle[] = { NULL, "d", "z", "x", "y", NULL };
+    /* In the order of the GRID_STORAGE values */
+    static const char *storage[] = { NULL, "auto", "dense", "tiled", NULL };
     int axis = 0;
     int axis_prof = 0;
     int sl = 100;
     int sl2 = -1;
     int adt = -1;
+    int nthreads = 1;
+    int ndecoders = 1;
+    int chunk = 0;
+    int nchunks = 1;
+    /* Variables for the reading of a stream */
+    const char *stream_fn = NULL;
+    /* In the order of the STREAM values */
+    static const char *stream_format[] = { NULL, "xtc", "raw", NULL };
+    int nflush = 0;
+    /* Variables for the merge of accumulator files */
+    char **merge_fns = NULL;
+    int nmerge = 0;
+    /* Replicas of the same system */
+    char **traj_fns = NULL;
+    int ntraj = 1;
+    /* Analyses to run on the frames */
+    AnalysisSpec spec;
+    AnalysisSpec *specs = NULL;
+    int nspecs = 0;
     gmx_bool bGrid = TRUE;
     gmx_bool bDist = TRUE;
     gmx_bool bCOM = TRUE;
+    gmx_bool bRefMols = FALSE;
+    gmx_bool bBinary = FALSE;
+    real sigma = 0;
+    gmx_bool bRmPBC = TRUE;
+    gmx_bool bAuto = FALSE;
+    real leaflet_cutoff = 1.5;
+    int leaflet_refresh = 100;
     /* Variables for the reading of the common index file */
     atom_id **index = NULL;
     int *isize = NULL;
     char **grpnames = NULL;
-    static const int ngrps = 2;
+    int ngrps = 2;
+    int group;
     
     const char *desc[] = {
         "Calculate the local thickness of a membrane.",
@@ -99,7 +108,7 @@ t_modes handle_user(int argc, char **argv,
         "The program can calculate the thickness landscape of the membrane",
         "using the [TT]-og[tt] option and the thickness profile as a function",
         "to the distance of a group using the [TT]-od[tt] option. At least",
-        "one of these two options have to be used.",
+        "one of these two options, or [TT]-cfg[tt], have to be used.",
         "[PAR]",
         "Thickness is calculated as the distance between its two leaflets",
         "along the normal axis. This axis have to be a unit axis; it can be",
@@ -111,15 +120,156 @@ t_modes handle_user(int argc, char **argv,
         "[TT]-sl[tt] corresponds to the number of bins; [TT]-sl2[tt] is",
         "ignored.",
         "[PAR]",
+        "The cells of a landscape follow the box vectors: the atoms are",
+        "binned in reduced coordinates, so triclinic boxes, like the",
+        "hexagonal boxes of membranes, are divided into parallelogram cells.",
+        "[PAR]",
         "The distance to a reference group is calculated, by default, as the",
         "distance to the center of mass of the reference group. It can be",
-        "calculated as the minimum distance using [TT]-nocom[tt].",
+        "calculated as the minimum distance using [TT]-nocom[tt]. With",
+        "[TT]-refmol[tt], the reference group is split into its molecules,",
+        "like several copies of a protein, and the distance is the one to",
+        "the center of mass of the nearest molecule; it can not be combined",
+        "with [TT]-nocom[tt].",
         "[PAR]",
         "The [TT]-adt[tt] option allows to chose how frequently the thickness",
         "is calculated. When this option is set to a value greater than one,",
         "the center of mass of each leaflet for a cell or a bin is averaged",
         "over several frames.",
         "[PAR]",
+        "With [TT]-nt[tt] greater than one, frames are read by the main",
+        "thread and analysed by a pool of worker threads. Each worker",
+        "processes whole [TT]-adt[tt] windows so the results are identical",
+        "to the ones of a serial run. With several analyses, the workers get",
+        "batches of frames of the least common multiple of their",
+        "[TT]-adt[tt]. If an [TT]-adt[tt] is negative, there is only one",
+        "window; every worker sums its own frames and the sums are added at",
+        "the end, which may change the results by rounding.",
+        "[PAR]",
+        "With [TT]-ndec[tt] greater than one, the frames of an XTC",
+        "trajectory are decompressed by this number of threads. The",
+        "trajectory is mapped in memory and the frames are found with the",
+        "frame index of [TT]-nchunks[tt]; they are still analysed in the",
+        "order of the trajectory.",
+        "[PAR]",
+        "With [TT]-binary[tt], the landscape is written in a binary format",
+        "holding both the thickness and the sampling; [TT]-ogs[tt] is then",
+        "ignored.",
+        "[PAR]",
+        "[TT]-storage tiled[tt] only stores the tiles of the landscape that",
+        "are hit by the leaflets, so the memory and the time spent closing",
+        "the windows grow with the area covered by the membrane rather than",
+        "with the size of the grid. This helps with very fine grids or with",
+        "systems that only cover a part of the box. By default, grids of more",
+        "than a million cells are tiled unless the leaflets have enough atoms",
+        "to fill them.",
+        "[PAR]",
+        "[TT]-sigma[tt] smooths the landscape of each [TT]-adt[tt] window",
+        "with a Gaussian of this width, in nm. The heights and the sampling",
+        "of the leaflets are binned as usual, then convolved with the",
+        "Gaussian by FFT over the periodic membrane plane, so fine grids",
+        "give smooth landscapes from fewer frames. The sampling of a cell",
+        "is then its smoothed sampling, rounded. In a triclinic box, the",
+        "Gaussian follows the in-plane box vectors. A smoothed landscape is",
+        "never tiled.",
+        "[PAR]",
+        "[TT]-oge[tt] and [TT]-ode[tt] write the standard error of the",
+        "thickness of each cell or bin. Each [TT]-adt[tt] window is taken as",
+        "an independent block weighted by its sampling, so the windows have",
+        "to be longer than the correlation time of the thickness; with a",
+        "single window, the error is not defined. The statistics are updated",
+        "as the windows are closed and cost three numbers per cell.",
+        "[PAR]",
+        "[TT]-ow[tt] writes the landscape of every [TT]-adt[tt] window to a",
+        "gzip compressed binary stream as soon as the window is closed. The",
+        "stream is written by a background thread.",
+        "[PAR]",
+        "By default, molecules are made whole for the whole system at each",
+        "frame. With [TT]-normpbc[tt], only the selected atoms are handled:",
+        "the leaflet atoms are put in the box and the reference group is",
+        "made whole relative to its first atom before computing its center",
+        "of mass. This is much faster for solvated systems, but requires the",
+        "reference group to be smaller than half the box.",
+        "[PAR]",
+        "With [TT]-auto[tt], a single group holding the headgroups of both",
+        "leaflets is selected instead of one group per leaflet. Headgroups",
+        "closer than [TT]-lcut[tt] are put in the same leaflet, and the two",
+        "largest clusters are the leaflets. The leaflets are detected again",
+        "every [TT]-lfreq[tt] frames, or when the box changes by more than",
+        "5%, so lipids that flip from one leaflet to the other are followed.",
+        "[PAR]",
+        "[TT]-nchunks[tt] and [TT]-chunk[tt] analyse only one part of an XTC",
+        "trajectory, so a long trajectory can be spread over several runs.",
+        "The frames kept with [TT]-b[tt], [TT]-e[tt] and [TT]-dt[tt] are",
+        "split in chunks of whole [TT]-adt[tt] windows of all the analyses.",
+        "The reader seeks directly to the first frame of the chunk using an",
+        "index of the frame offsets. The index is built on the first use and",
+        "cached next to the trajectory in a file with the [TT].tidx[tt]",
+        "extension.",
+        "[PAR]",
+        "[TT]-stream[tt] reads the frames from a named pipe, or from the",
+        "standard input with [TT]-stream -[tt], instead of [TT]-f[tt], so",
+        "a running simulation or a decompressor can feed the analysis",
+        "directly. The frames are in XTC format or, with [TT]-sfmt raw[tt],",
+        "in a raw binary format: for each frame, the number of atoms as a",
+        "32 bits integer, then the 9 floats of the box and the 3 floats of",
+        "each atom, in the byte order of the machine. Raw frames have no",
+        "time; [TT]-b[tt] and [TT]-e[tt] are then frame numbers. A stream",
+        "can not be split in chunks. With [TT]-flush[tt], the output files",
+        "are rewritten every this number of frames with the results so far,",
+        "so a long run gives usable intermediate results; this requires",
+        "[TT]-nt[tt] 1.",
+        "[PAR]",
+        "Several trajectories can be given to [TT]-f[tt], for replicas of",
+        "the same system. The topology and the groups are read once, and",
+        "the replicas are analysed at the same time by [TT]-nt[tt] threads,",
+        "one replica per thread. Each replica writes its own outputs, named",
+        "after the ones of the options with the number of the replica",
+        "before the extension (from 0), and the outputs of the options",
+        "combine all the replicas weighted by their sampling, as",
+        "[TT]-merge[tt] would do with the accumulators of the replicas.",
+        "[PAR]",
+        "[TT]-cache[tt] keeps the coordinates of the atoms of the leaflet",
+        "and reference groups in a compact file, so the analyses of the",
+        "same trajectory with other settings do not decode the whole",
+        "frames again. The file is written by a run with [TT]-nt[tt] 1;",
+        "the next runs read it instead of [TT]-f[tt] if it was written from",
+        "the same trajectory with the same [TT]-b[tt], [TT]-e[tt], [TT]-dt[tt]",
+        "and [TT]-rmpbc[tt], and holds the atoms of their groups. Otherwise it",
+        "is written again.",
+        "[PAR]",
+        "[TT]-oacc[tt] writes the raw sums and counts accumulated over the",
+        "trajectory, before any averaging. The files written by several runs,",
+        "on chunks of a trajectory or on replicas, can be given to",
+        "[TT]-merge[tt] to produce the outputs of the whole set of frames as",
+        "if they were analysed in one run. When merging, no trajectory is",
+        "read; the [TT]-f[tt], [TT]-s[tt] and [TT]-n[tt] options are not",
+        "needed, and the grid shape, the number of bins, the normal axis,",
+        "[TT]-adt[tt], [TT]-sigma[tt], [TT]-com[tt] and [TT]-refmol[tt] are",
+        "taken from the first file. The same [TT]-og[tt], [TT]-od[tt] and",
+        "[TT]-cfg[tt] analyses as for the runs have to be requested, or only",
+        "the ones of a kind.",
+        "[PAR]",
+        "At the end of the run, the time spent in each stage of the analysis",
+        "and some counters are printed. [TT]-report[tt] writes them as a",
+        "JSON object too.",
+        "[PAR]",
+        "[TT]-cfg[tt] reads more grid and distance analyses from a file, one",
+        "per line, so several resolutions, [TT]-adt[tt] values or reference",
+        "groups are computed in a single pass over the trajectory. Each line",
+        "starts with [TT]grid[tt] or [TT]dist[tt] and is followed by",
+        "key=value settings named after the command line options: [TT]sl[tt],",
+        "[TT]adt[tt] and [TT]d[tt] for both, [TT]sl2[tt], [TT]binary[tt],",
+        "[TT]storage[tt], [TT]sigma[tt], [TT]og[tt], [TT]ogs[tt],",
+        "[TT]oge[tt] and [TT]ow[tt] for a grid,",
+        "[TT]com[tt], [TT]refmol[tt], [TT]od[tt], [TT]ods[tt],",
+        "[TT]ode[tt] and",
+        "[TT]group[tt] (the name of the reference group in the index file)",
+        "for a distance profile. The",
+        "output file is required; the other settings default to the command",
+        "line options. Text after a # is ignored. The analyses run after the",
+        "ones of [TT]-og[tt] and [TT]-od[tt].",
+        "[PAR]",
         "See the README for more details."
     };
 
@@ -131,21 +281,73 @@ t_modes handle_user(int argc, char **argv,
         { "-adt", FALSE, etINT, {&adt},
             "Thickness will be averaged when nsteps \% adt will be null or at "
                 "the end if adt is lesser than 0 or bigger than the simulation "
-                "length."},
+                "length. It can not be 0."},
         { "-com", FALSE, etBOOL, {&bCOM},
             "If true center of mass distance, else use minimum distance."},
+        { "-refmol", FALSE, etBOOL, {&bRefMols},
+            "Use the center of mass of the nearest molecule of the "
+                "reference group."},
+        { "-binary", FALSE, etBOOL, {&bBinary},
+            "Write the landscape and its sampling in a single binary file."},
+        { "-storage", FALSE, etENUM, {storage},
+            "Storage of the landscape cells: every cell, only the tiles of "
+                "cells that are hit, or chosen from the size of the grid."},
+        { "-sigma", FALSE, etREAL, {&sigma},
+            "Width (nm) of the Gaussian smoothing of the landscape of each "
+                "-adt window; 0 for no smoothing."},
+        { "-rmpbc", FALSE, etBOOL, {&bRmPBC},
+            "Make molecules whole for the whole system at each frame."},
+        { "-auto", FALSE, etBOOL, {&bAuto},
+            "Detect the leaflets from a group of headgroup atoms."},
+        { "-lcut", FALSE, etREAL, {&leaflet_cutoff},
+            "Cutoff (nm) between headgroups of the same leaflet for -auto."},
+        { "-lfreq", FALSE, etINT, {&leaflet_refresh},
+            "Detect the leaflets every this number of frames with -auto; "
+                "only once if lesser or equal 0."},
+        { "-nt", FALSE, etINT, {&nthreads},
+            "Number of worker threads analysing the frames."},
+        { "-ndec", FALSE, etINT, {&ndecoders},
+            "Number of threads decompressing the frames (XTC only)."},
+        { "-nchunks", FALSE, etINT, {&nchunks},
+            "Split the trajectory in this number of chunks of whole -adt "
+                "windows (XTC only)."},
+        { "-chunk", FALSE, etINT, {&chunk},
+            "Chunk to analyse, from 0 to -nchunks minus 1."},
+        { "-stream", FALSE, etSTR, {&stream_fn},
+            "Read the frames from this pipe, or from the standard input if "
+                "-, instead of -f."},
+        { "-sfmt", FALSE, etENUM, {stream_format},
+            "Format of the frames of -stream."},
+        { "-flush", FALSE, etINT, {&nflush},
+            "Rewrite the outputs every this number of frames; never if "
+                "lesser or equal 0."},
     };
     #define NPA asize(pa)
     t_filenm fnm[] = {
-        { efTPX, "-s", NULL, ffREAD},  /* this is for the topology   */
-        { efTRX, "-f", NULL, ffREAD},  /* this is for the trajectory */
-        { efNDX, "-n", NULL, ffREAD},  /* this is for the index file */
-        /* output for the grid mode data and sampling */
+        /* the inputs are not needed when merging accumulator files */
+        { efTPX, "-s", NULL, ffOPTRD},  /* this is for the topology   */
+        { efTRX, "-f", NULL, ffOPTRDMULT},  /* the trajectory, or replicas */
+        { efNDX, "-n", NULL, ffOPTRD},  /* this is for the index file */
+        /* output for the grid mode data, sampling and standard error */
         { efDAT, "-og", "thickness_grid", ffOPTWR }, 
         { efDAT, "-ogs", "thickness_grid_sampling", ffOPTWR }, 
-        /* output for the dist mode data and sampling */
+        { efDAT, "-oge", "thickness_grid_error", ffOPTWR }, 
+        /* output for the landscape of each window */
+        { efDAT, "-ow", "thickness_windows", ffOPTWR }, 
+        /* output for the dist mode data, sampling and standard error */
         { efXVG, "-od", "thickness_dist", ffOPTWR }, 
         { efXVG, "-ods", "thickness_dist_sampling", ffOPTWR }, 
+        { efXVG, "-ode", "thickness_dist_error", ffOPTWR }, 
+        /* raw accumulators to write, or to merge instead of reading a
+         * trajectory */
+        { efDAT, "-oacc", "thickness_acc", ffOPTWR }, 
+        { efDAT, "-merge", "thickness_acc", ffOPTRDMULT }, 
+        /* coordinates of the selected atoms, read or written */
+        { efDAT, "-cache", "thickness_cache", ffOPTWR }, 
+        /* timing and counters of the run */
+        { efDAT, "-report", "thickness_report", ffOPTWR }, 
+        /* more analyses to run on the same frames */
+        { efDAT, "-cfg", "thickness_analyses", ffOPTRD }, 
     };
     #define NFILE asize(fnm)
 
@@ -163,121 +365,276 @@ t_modes handle_user(int argc, char **argv,
     CopyRight(stderr,argv[0]);
     /* Parse the command line arguments */
     parse_common_args(&argc,argv,PCA_CAN_TIME | PCA_BE_NICE,
-	    NFILE,fnm,NPA,pa,asize(desc),desc,0,NULL,oenv);
-	bGrid = opt2bSet("-og",NFILE,fnm);
-	bDist = opt2bSet("-od",NFILE,fnm);
-
-	if (! (bDist || bGrid)) {
-	    gmx_fatal(FARGS, "You need to choose at least one output"
-	                     "(see -og and -od options)");
-	}
+        NFILE,fnm,NPA,pa,asize(desc),desc,0,NULL,oenv);
+    bGrid = opt2bSet("-og",NFILE,fnm);
+    bDist = opt2bSet("-od",NFILE,fnm);
 
-	/* Convert axis in int */
+    /* Convert axis in int */
     axis = toupper(axtitle[0][0]) - 'X';
 
+    /* Replicas are read whole, one per thread */
+    if (opt2bSet("-f",NFILE,fnm)) {
+        ntraj = opt2fns(&traj_fns,"-f",NFILE,fnm);
+    }
+    if (ntraj > 1 && (stream_fn || nchunks > 1 || nflush > 0
+                || opt2bSet("-merge",NFILE,fnm)
+                || opt2bSet("-cache",NFILE,fnm))) {
+        gmx_fatal(FARGS, "Several trajectories can not be used with "
+                "-stream, -nchunks, -flush, -merge or -cache");
+    }
+    if (opt2bSet("-cache",NFILE,fnm) && (stream_fn || nchunks > 1)) {
+        gmx_fatal(FARGS, "The selection cache can not be used with -stream "
+                "or -nchunks");
+    }
+
+    /* An -adt of 0 would never close a window */
+    if (adt == 0) {
+        gmx_fatal(FARGS, "-adt can not be 0; use a negative value to "
+                "average over the whole trajectory");
+    }
+
+    /* The outputs are rewritten between two frames of the serial reader */
+    if (nflush > 0 && nthreads > 1) {
+        gmx_fatal(FARGS, "-flush can not be used with -nt greater than 1");
+    }
+
     /* Look at -sl2 */
     if (sl2 <= 0) {
         sl2 = sl;
     }
 
-	/* Read topology */
-    (*top)=read_top(ftp2fn(efTPX,NFILE,fnm),ePBC);
-
-	/* Read index */
-    snew(index, ngrps);
-    snew(isize, ngrps);
-    snew(grpnames, ngrps);
-    printf("Select groups for the leaflets:\n");
-    get_index(&((*top)->atoms),ftp2fn(efNDX,NFILE,fnm),ngrps,
-            isize,index,grpnames);
+    /* List the analyses; the ones of the command line come first */
+    spec.sl = sl;
+    spec.sl2 = sl2;
+    spec.axis = axis;
+    spec.adt = adt;
+    spec.bCOM = bCOM;
+    spec.bRefMols = bRefMols;
+    spec.bBinary = bBinary;
+    spec.storage = GRID_STORAGE_AUTO;
+    for (i = 1; storage[i]; ++i) {
+        if (strcmp(storage[0], storage[i]) == 0) {
+            spec.storage = i - 1;
+        }
+    }
+    spec.sigma = sigma;
+    spec.error_fn = NULL;
+    spec.windows_fn = NULL;
+    spec.group = NULL;
+    if (bGrid) {
+        spec.bGrid = TRUE;
+        spec.out_fn = (char *)opt2fn("-og",NFILE,fnm);
+        spec.sampling_fn = (char *)opt2fn("-ogs",NFILE,fnm);
+        if (opt2bSet("-oge",NFILE,fnm)) {
+            spec.error_fn = (char *)opt2fn("-oge",NFILE,fnm);
+        }
+        if (opt2bSet("-ow",NFILE,fnm)) {
+            spec.windows_fn = (char *)opt2fn("-ow",NFILE,fnm);
+        }
+        nspecs = add_analysis(&specs, nspecs, &spec);
+        spec.error_fn = NULL;
+        spec.windows_fn = NULL;
+    }
+    if (bDist) {
+        spec.bGrid = FALSE;
+        spec.out_fn = (char *)opt2fn("-od",NFILE,fnm);
+        spec.sampling_fn = (char *)opt2fn("-ods",NFILE,fnm);
+        if (opt2bSet("-ode",NFILE,fnm)) {
+            spec.error_fn = (char *)opt2fn("-ode",NFILE,fnm);
+        }
+        nspecs = add_analysis(&specs, nspecs, &spec);
+        spec.error_fn = NULL;
+    }
+    if (opt2bSet("-cfg",NFILE,fnm)) {
+        nspecs = read_analysis_file(opt2fn("-cfg",NFILE,fnm), &spec, &specs,
+                nspecs);
+    }
+    if (nspecs == 0) {
+        gmx_fatal(FARGS, "You need to choose at least one output"
+                         "(see -og, -od and -cfg options)");
+    }
 
-	/* Create the mode objects */
-    snew(modes.general, 1);
-	modes.general->ngrps = ngrps;
-	modes.general->index = index;
-	modes.general->isize = isize;
-	modes.general->grpnames = grpnames;
-	modes.general->traj_fn = ftp2fn(efTRX,NFILE,fnm);
-	modes.general->adt = adt;
+    if (opt2bSet("-merge",NFILE,fnm)) {
+        /* The settings come from the accumulator files */
+        nmerge = opt2fns(&merge_fns,"-merge",NFILE,fnm);
+        read_accumulator_settings(merge_fns[0], specs, nspecs);
+    }
+    else {
+        /* Read topology */
+        top=read_top(ftp2fn(efTPX,NFILE,fnm),&ePBC);
 
-	modes.grid_store = NULL;
-	modes.dist_store = NULL;
-	if (bGrid) {
-	    modes.grid_store = build_grids((int [2]){sl, sl2}, axis,
-	            opt2fn("-og",NFILE,fnm), opt2fn("-ogs",NFILE,fnm));
-	}
-	if (bDist) {
-        modes.dist_store = build_dist(sl, axis,
-                opt2fn("-od",NFILE,fnm), opt2fn("-ods",NFILE,fnm), *oenv,
-                ftp2fn(efNDX,NFILE,fnm), *top, bCOM);
-	}
-	
-	return modes;
-}
+        /* Read index; with -auto, a single group holds the headgroups of
+         * both leaflets */
+        if (bAuto) {
+            ngrps = 1;
+        }
+        snew(index, ngrps);
+        snew(isize, ngrps);
+        snew(grpnames, ngrps);
+        if (bAuto) {
+            printf("Select the headgroups of both leaflets:\n");
+        }
+        else {
+            printf("Select groups for the leaflets:\n");
+        }
+        get_index(&(top->atoms),ftp2fn(efNDX,NFILE,fnm),ngrps,
+                isize,index,grpnames);
+    }
 
-/*****************************************************************************
- *                            Trajectory reading                             *
- *****************************************************************************/
-void do_frame(t_modes modes, t_pbc *pbc, int ePBC, matrix box, rvec *x,
-        gmx_rmpbc_t gpbc, int natoms, t_topology *top) {
-    int leaflet = 0;
-    int atom = 0;
-    if (pbc) {
-        set_pbc(pbc,ePBC,box);
-        /* make molecules whole again */
-        gmx_rmpbc(gpbc,natoms,box,x);
+    /* Set up the analysis; the library keeps copies of the groups */
+    th = thickness_create(top, ePBC, *oenv);
+    if (nmerge == 0) {
+        thickness_set_rmpbc(th, bRmPBC);
+        if (bAuto) {
+            thickness_detect_leaflets(th, index[0], isize[0], axis,
+                    leaflet_cutoff, leaflet_refresh);
+        }
+        else {
+            thickness_set_leaflets(th, index, isize);
+        }
+        for (group = 0; group < ngrps; ++group) {
+            sfree(index[group]);
+            sfree(grpnames[group]);
+        }
+        sfree(index);
+        sfree(isize);
+        sfree(grpnames);
+    }
+    build_analyses(th, specs, nspecs, ftp2fn(efNDX,NFILE,fnm));
+    *replicas = NULL;
+    if (ntraj > 1) {
+        *replicas = build_replicas(th, specs, nspecs, traj_fns, ntraj,
+                nthreads);
     }
-    grid_start_frame(modes.grid_store, box);
-    dist_start_frame(modes.dist_store, box, top, x);
-    for (leaflet = 0; leaflet < modes.general->ngrps; ++leaflet) {
-        for (atom = 0; atom < modes.general->isize[leaflet]; ++atom) {
-            grid_store(modes.grid_store, leaflet, 
-                    x[modes.general->index[leaflet][atom]], pbc);
-            dist_store(modes.dist_store, leaflet,
-                    modes.general->index[leaflet][atom], x, pbc);
+    clean_analysis_specs(specs, nspecs);
+
+    /* What only matters to the command line tool */
+    th->modes.general->traj_fn = ftp2fn(efTRX,NFILE,fnm);
+    th->modes.general->nthreads = nthreads;
+    th->modes.general->ndecoders = ndecoders;
+    th->modes.general->chunk = chunk;
+    th->modes.general->nchunks = nchunks;
+    th->modes.general->stream_fn = stream_fn;
+    th->modes.general->stream_format = STREAM_XTC;
+    for (i = 1; stream_format[i]; ++i) {
+        if (strcmp(stream_format[0], stream_format[i]) == 0) {
+            th->modes.general->stream_format = i - 1;
         }
     }
-    grid_end_frame(modes.grid_store, modes.general->adt);
-    dist_end_frame(modes.dist_store, modes.general->adt);
+    th->modes.general->nflush = max(nflush, 0);
+    th->modes.general->merge_fns = merge_fns;
+    th->modes.general->nmerge = nmerge;
+    th->modes.general->acc_fn = NULL;
+    if (opt2bSet("-oacc",NFILE,fnm)) {
+        th->modes.general->acc_fn = opt2fn("-oacc",NFILE,fnm);
+    }
+    th->modes.general->cache_fn = NULL;
+    if (opt2bSet("-cache",NFILE,fnm)) {
+        th->modes.general->cache_fn = opt2fn("-cache",NFILE,fnm);
+    }
+    th->modes.general->report_fn = NULL;
+    if (opt2bSet("-report",NFILE,fnm)) {
+        th->modes.general->report_fn = opt2fn("-report",NFILE,fnm);
+    }
+    return th;
 }
 
-void read_traj(t_modes modes, output_env_t oenv, t_topology *top, int ePBC) {
-    int natoms;
+/*****************************************************************************
+ *                            Trajectory reading                             *
+ *****************************************************************************/
+/** Read the frames and hand them to the analysis
+ */
+void read_traj(Thickness *th, output_env_t oenv) {
+    GeneralData *general = th->modes.general;
     real time;
     rvec *x;
     matrix box;
-    t_pbc *pbc;
-    t_trxstatus *status;
-    gmx_rmpbc_t gpbc=NULL;
+    TrajReader *reader;
+    StageTimer timer;
+    gmx_bool bRead;
+    int nread = 0;
+
+    /* The selection cache holds the coordinates once they are whole, only
+     * the serial loop sees them */
+    if (general->cache_fn) {
+        general->cache = open_selection_cache(general->cache_fn,
+                general->traj_fn, th->modes, general->nthreads <= 1);
+    }
+    if (general->nthreads > 1) {
+        read_traj_threaded(th->modes, oenv, th->top, th->ePBC);
+        close_selection_cache(general->cache);
+        general->cache = NULL;
+        return;
+    }
 
     /* Read the first frame to get basic informations about the system */
-    natoms=read_first_x(oenv,&status,modes.general->traj_fn,&time,&x,box);
-    /* Set PBC stiff */
-    if (ePBC != epbcNONE)
-        snew(pbc,1);
-    else
-        pbc = NULL;
-    gpbc = gmx_rmpbc_init(&top->idef,ePBC,natoms,box);
+    stats_start(&timer);
+    reader = open_traj_reader(th->modes.general, oenv, &time, &x, box);
+    stats_stop(STAGE_READ, &timer);
     /* Read the trajectory */
     do {
-        do_frame(modes, pbc, ePBC, box, x, gpbc, natoms, top);
-    } while(read_next_x(oenv,status,&time,natoms,x,box));
+        thickness_feed_frame(th, reader->natoms, x, box);
+        nread += 1;
+        /* The molecules are whole once the frame is analysed */
+        if (general->cache && general->cache->bWrite) {
+            selection_cache_add(general->cache, time, reader->natoms, x,
+                    box);
+        }
+        /* Let the user look at the results of a long stream */
+        if (general->nflush > 0 && nread % general->nflush == 0) {
+            thickness_flush(th);
+        }
+        stats_start(&timer);
+        bRead = traj_reader_next(reader,&time,x,box);
+        stats_stop(STAGE_READ, &timer);
+    } while(bRead);
+    close_traj_reader(reader);
+    close_selection_cache(general->cache);
+    general->cache = NULL;
+    sfree(x);
 }
 
 int main(int argc, char **argv) {
     output_env_t oenv;
-    t_topology *top;
-    int ePBC;
-    t_modes modes;
+    Thickness *th;
+    ReplicaSet *replicas;
+    StageTimer timer;
+    int nthreads;
+    const char *report_fn;
 
+    stats_init();
     /* Read user input */
-    modes = handle_user(argc, argv, &oenv, &top, &ePBC);
-    /* Read the trajectory */
-    read_traj(modes, oenv, top, ePBC);
+    th = handle_user(argc, argv, &oenv, &replicas);
+    /* Read the trajectory, or sum the results of previous runs */
+    if (th->modes.general->nmerge > 0) {
+        stats_start(&timer);
+        merge_accumulators(th->modes, th->modes.general->merge_fns,
+                th->modes.general->nmerge);
+        stats_stop(STAGE_READ, &timer);
+    }
+    else if (replicas) {
+        read_replicas(replicas, oenv);
+        clean_replicas(replicas);
+    }
+    else {
+        read_traj(th, oenv);
+    }
+    stats_start(&timer);
+    /* Write the raw sums, they are lost when averaging */
+    if (th->modes.general->acc_fn) {
+        write_accumulators(th->modes, th->modes.general->acc_fn);
+    }
     /* Write results */
-    grid_end(modes.grid_store, modes.general->adt);
-    dist_end(modes.dist_store, modes.general->adt);
-    /* Clean everything */
-    clean_modes(&modes);
+    thickness_end(th);
+    /* Clean everything; this closes the output files */
+    nthreads = th->modes.general->nthreads;
+    report_fn = th->modes.general->report_fn;
+    thickness_destroy(th);
+    stats_stop(STAGE_OUTPUT, &timer);
+    /* Report where the time went */
+    stats_print(stderr, nthreads);
+    if (report_fn) {
+        stats_write_json(report_fn, nthreads);
+    }
     return 0;
 }
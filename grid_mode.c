@@ -1,42 +1,348 @@
 #include "grid_mode.h"
 
-void _average_field(GridHeight *grid_store) {
-    int leaflet, i, j;
-    for (leaflet = 0; leaflet < 2; ++leaflet) {
-        for (i=0; i < grid_store->shape[0]; ++i) {
-            for (j=0; j < grid_store->shape[1]; ++j) {
-                grid_store->grids[leaflet][i][j] /=
-                    grid_store->sampling[leaflet][i][j];
+/** Tile stored in a slot; the slots of a dense grid are its tiles
+ */
+static int _slot_tile(GridHeight *grid_store, int slot) {
+    return grid_store->bTiled ? grid_store->slot_tile[slot] : slot;
+}
+
+/** Store a new tile, or the empty tile if "tile" is -1, in the next slot
+ * of a tiled grid and return the slot
+ */
+static int _add_tile(GridHeight *grid_store, int tile) {
+    int slot = grid_store->nslots;
+    int alloc, grid, cell;
+    if (slot == grid_store->slot_alloc) {
+        alloc = slot + slot / 2 + 16;
+        for (grid = 0; grid < 3; ++grid) {
+            srenew(grid_store->grids[grid], alloc * GRID_TILE);
+            srenew(grid_store->sampling[grid], alloc * GRID_TILE);
+            for (cell = slot * GRID_TILE; cell < alloc * GRID_TILE; ++cell) {
+                grid_store->grids[grid][cell] = 0.0;
+                grid_store->sampling[grid][cell] = 0;
             }
         }
+        srenew(grid_store->slot_tile, alloc);
+        srenew(grid_store->touched, alloc * GRID_TILE);
+        /* The worker copies have no statistics */
+        if (grid_store->stats.n > 0) {
+            window_stats_resize(&grid_store->stats, alloc * GRID_TILE);
+        }
+        grid_store->slot_alloc = alloc;
+    }
+    grid_store->slot_tile[slot] = tile;
+    if (tile >= 0) {
+        grid_store->tile_slot[tile] = slot;
     }
+    grid_store->nslots += 1;
+    grid_store->nstored = grid_store->nslots * GRID_TILE;
+    return slot;
 }
 
-void _calculate_thickness(GridHeight *grid_store) {
-    int i, j;
+/** Allocate the empty buffers of the cells, dense or tiled
+ */
+static void _alloc_storage(GridHeight *grid_store, gmx_bool bTiled) {
+    int grid;
+    grid_store->bTiled = bTiled;
+    grid_store->ntiles = (grid_store->ncells + GRID_TILE - 1) / GRID_TILE;
+    grid_store->tile_slot = NULL;
+    grid_store->slot_tile = NULL;
+    grid_store->slot_alloc = 0;
+    grid_store->touched = NULL;
+    grid_store->ntouched = 0;
+    if (bTiled) {
+        for (grid = 0; grid < 3; ++grid) {
+            grid_store->grids[grid] = NULL;
+            grid_store->sampling[grid] = NULL;
+        }
+        snew(grid_store->tile_slot, grid_store->ntiles);
+        grid_store->nslots = 0;
+        _add_tile(grid_store, -1);
+    }
+    else {
+        for (grid = 0; grid < 3; ++grid) {
+            grid_store->grids[grid] = realMatrix(grid_store->shape[0],
+                    grid_store->shape[1], 0.0);
+            grid_store->sampling[grid] = intMatrix(grid_store->shape[0],
+                    grid_store->shape[1], 0);
+        }
+        grid_store->nslots = grid_store->ntiles;
+        grid_store->nstored = grid_store->ncells;
+        snew(grid_store->touched, grid_store->ncells);
+    }
+}
+
+static void _free_storage(GridHeight *grid_store) {
+    int grid;
+    for (grid = 0; grid < 3; ++grid) {
+        if (grid_store->bTiled) {
+            sfree(grid_store->grids[grid]);
+            sfree(grid_store->sampling[grid]);
+        }
+        else {
+            deleteRealMat(grid_store->grids[grid]);
+            deleteIntMat(grid_store->sampling[grid]);
+        }
+    }
+    sfree(grid_store->tile_slot);
+    sfree(grid_store->slot_tile);
+    sfree(grid_store->touched);
+}
+
+/** Number of cells of a tile; only the last one can be shorter than
+ * GRID_TILE
+ */
+int grid_tile_cells(GridHeight *grid_store, int tile) {
+    return min(GRID_TILE, grid_store->ncells - tile * GRID_TILE);
+}
+
+/** Offset in the buffers of the first cell of a tile
+ *
+ * A tile that is not stored in a tiled grid is added if "bCreate" is true;
+ * else the offset of the empty tile is returned.
+ */
+int grid_tile_offset(GridHeight *grid_store, int tile, gmx_bool bCreate) {
+    int slot;
+    if (!grid_store->bTiled) {
+        return tile * GRID_TILE;
+    }
+    slot = grid_store->tile_slot[tile];
+    if (slot == 0 && bCreate) {
+        slot = _add_tile(grid_store, tile);
+    }
+    return slot * GRID_TILE;
+}
+
+/** Offset in the buffers of a cell given by its row-major index
+ */
+static inline int _cell_offset(GridHeight *grid_store, int cell,
+        gmx_bool bCreate) {
+    if (!grid_store->bTiled) {
+        return cell;
+    }
+    return grid_tile_offset(grid_store, cell >> GRID_TILE_BITS, bCreate)
+        + (cell & (GRID_TILE - 1));
+}
+
+/** Row-major index of the cell at an offset of the buffers
+ */
+static inline int _cell_index(GridHeight *grid_store, int offset) {
+    if (!grid_store->bTiled) {
+        return offset;
+    }
+    return grid_store->slot_tile[offset >> GRID_TILE_BITS] * GRID_TILE
+        + (offset & (GRID_TILE - 1));
+}
+
+/** Add a height to a cell of a leaflet, given by its offset, and list the
+ * cell the first time it is hit during the window
+ */
+static inline void _add_height(GridHeight *grid_store, int leaflet, int cell,
+        real height) {
+    if (grid_store->sampling[leaflet][cell] == 0
+            && grid_store->sampling[1 - leaflet][cell] == 0) {
+        grid_store->touched[grid_store->ntouched++] = cell;
+    }
+    grid_store->grids[leaflet][cell] += height;
+    grid_store->sampling[leaflet][cell] += 1;
+}
+
+/** Make room for "ncells" cells in a closed window
+ */
+static void _reserve_window(GridWindow *closed, int ncells) {
+    if (closed->alloc < ncells) {
+        srenew(closed->cells, ncells);
+        srenew(closed->thickness, ncells);
+        srenew(closed->sampling, ncells);
+        closed->alloc = ncells;
+    }
+}
+
+/** Compute the smoothed thickness of the window accumulated in "window" in
+ * "closed"
+ *
+ * The sums of the heights and the samplings of both leaflets are smoothed
+ * separately, so the height of a cell is the average of the heights around
+ * it weighted by the kernel. The sampling of a cell is its smoothed
+ * sampling, rounded; the cells with less than half an atom in a leaflet are
+ * left out.
+ */
+static void _smoothed_thickness(GridHeight *window, GridWindow *closed) {
+    GridSmoother *smoother = window->smoother;
+    real box_width[2];
+    real weight[2], height[2];
+    int cell, offset, leaflet, minsamp, i;
+
+    _reserve_window(closed, window->ncells);
+    smoother_clear(smoother);
+    for (i=0; i < window->ntouched; ++i) {
+        cell = window->touched[i];
+        offset = smoother_offset(smoother, cell);
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            smoother->fields[2 * leaflet][offset] =
+                window->grids[leaflet][cell];
+            smoother->fields[2 * leaflet + 1][offset] =
+                window->sampling[leaflet][cell];
+        }
+    }
+    for (i=0; i<2; ++i) {
+        box_width[i] = window->window_box_width[i] / window->window_nframes;
+    }
+    smoother_apply(smoother, box_width,
+            window->window_shear / window->window_nframes);
+    for (cell=0; cell < window->ncells; ++cell) {
+        offset = smoother_offset(smoother, cell);
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            weight[leaflet] = smoother->fields[2 * leaflet + 1][offset];
+        }
+        minsamp = (int)(min(weight[0], weight[1]) + 0.5);
+        if (minsamp > 0) {
+            for (leaflet = 0; leaflet < 2; ++leaflet) {
+                height[leaflet] = smoother->fields[2 * leaflet][offset]
+                    / weight[leaflet];
+            }
+            closed->cells[closed->ncells] = cell;
+            closed->sampling[closed->ncells] = minsamp;
+            closed->thickness[closed->ncells] =
+                (real)fabs(height[0] - height[1]);
+            closed->ncells += 1;
+        }
+    }
+}
+
+/** Compute the thickness of the window accumulated in "window" in "closed"
+ *
+ * Only the cells hit during the window are visited, unless the window is
+ * smoothed. The leaflets are not modified.
+ */
+static void _window_thickness(GridHeight *window, GridWindow *closed) {
+    int cell, leaflet, i;
     int minsamp = 0;
-    for (i=0; i < grid_store->shape[0]; ++i) {
-        for (j=0; j < grid_store->shape[1]; ++j) {
-            minsamp = min(grid_store->sampling[0][i][j],
-                    grid_store->sampling[1][i][j]);
-            if (minsamp > 0) {
-                grid_store->grids[2][i][j] +=
-                    (real)fabs(grid_store->grids[0][i][j] - 
-                            grid_store->grids[1][i][j]) * minsamp;
-                grid_store->sampling[2][i][j] += minsamp;
+    real height[2];
+    closed->ncells = 0;
+    closed->nframes = window->window_nframes;
+    for (i=0; i<2; ++i) {
+        closed->box_width[i] = window->window_box_width[i];
+    }
+    if (window->smoother && window->ntouched > 0) {
+        _smoothed_thickness(window, closed);
+        return;
+    }
+    _reserve_window(closed, window->ntouched);
+    for (i=0; i < window->ntouched; ++i) {
+        cell = window->touched[i];
+        minsamp = min(window->sampling[0][cell], window->sampling[1][cell]);
+        if (minsamp > 0) {
+            for (leaflet = 0; leaflet < 2; ++leaflet) {
+                height[leaflet] = window->grids[leaflet][cell]
+                    / window->sampling[leaflet][cell];
             }
+            closed->cells[closed->ncells] = cell;
+            closed->sampling[closed->ncells] = minsamp;
+            closed->thickness[closed->ncells] =
+                (real)fabs(height[0] - height[1]);
+            closed->ncells += 1;
         }
     }
 }
 
+/** Compute the thickness of the window accumulated in "window" in "closed",
+ * then empty the leaflets
+ *
+ * Only the cells hit during the window are emptied.
+ */
+void _close_window_into(GridHeight *window, GridWindow *closed) {
+    int cell, leaflet, i;
+    _window_thickness(window, closed);
+    for (i=0; i < window->ntouched; ++i) {
+        cell = window->touched[i];
+        for (leaflet = 0; leaflet < 2; ++leaflet) {
+            window->grids[leaflet][cell] = 0.0;
+            window->sampling[leaflet][cell] = 0;
+        }
+    }
+    window->ntouched = 0;
+    window->window_nframes = 0;
+    window->window_box_width[0] = 0.0;
+    window->window_box_width[1] = 0.0;
+    window->window_shear = 0.0;
+}
+
+/** Add the thickness of a window closed by "window" to the thickness of
+ * "grid_store" and hand the window to the stream, if any
+ */
+void _apply_window(GridHeight *grid_store, GridHeight *window,
+        GridWindow *closed) {
+    int cell, index, i;
+    int minsamp = 0;
+    real thickness;
+    WindowRecord *record = NULL;
+    if (grid_store->writer) {
+        record = window_writer_acquire(grid_store->writer);
+        record->nframes = closed->nframes;
+        for (i=0; i<2; ++i) {
+            record->box_width[i] = closed->box_width[i]/closed->nframes;
+        }
+    }
+    for (i = 0; i < closed->ncells; ++i) {
+        /* The offsets of a worker copy differ from the ones of grid_store
+         * if the grids are tiled */
+        cell = closed->cells[i];
+        index = _cell_index(window, cell);
+        if (window != grid_store) {
+            cell = _cell_offset(grid_store, index, TRUE);
+        }
+        minsamp = closed->sampling[i];
+        thickness = closed->thickness[i];
+        window_stats_add(&grid_store->stats, cell,
+                grid_store->sampling[2][cell], thickness, minsamp);
+        grid_store->grids[2][cell] += thickness * minsamp;
+        grid_store->sampling[2][cell] += minsamp;
+        if (record) {
+            record->thickness[index] = thickness;
+            record->sampling[index] = minsamp;
+            record->filled[record->nfilled++] = index;
+        }
+    }
+    if (record) {
+        window_writer_publish(grid_store->writer);
+    }
+}
+
+/** Choose between the dense and the tiled storage of a grid
+ *
+ * GRID_STORAGE_AUTO tiles the grids of at least GRID_TILED_MIN_CELLS cells
+ * when the leaflets are expected to cover less than a
+ * GRID_TILED_OCCUPANCY-th of them at each frame. "natoms" is the number of
+ * leaflet atoms, or 0 if it is unknown; the size of the grid decides alone
+ * then.
+ */
+gmx_bool grid_use_tiles(int storage, int shape[2], int natoms) {
+    gmx_large_int_t ncells = (gmx_large_int_t)shape[0] * shape[1];
+    switch (storage) {
+        case GRID_STORAGE_DENSE:
+            return FALSE;
+        case GRID_STORAGE_TILED:
+            return TRUE;
+        default:
+            return ncells >= GRID_TILED_MIN_CELLS
+                && (natoms <= 0 || natoms < ncells / GRID_TILED_OCCUPANCY);
+    }
+}
+
 /** Contruct an instance of GridHeight
  *
  * All the dimensions described in the "shape" array have to be greater than 0.
+ * The standard error of the thickness is written in "error_fn" if it is not
+ * NULL. The cells are tiled if "bTiled" is true. Without "grid_fn", no file
+ * is written and the results are only read with grid_snapshot. A negative
+ * "adt" makes one window of the whole trajectory; 0 is a fatal error.
  */
-GridHeight *build_grids(int shape[2], int normal_axis,
-        const char *grid_fn, const char *sampling_fn) {
+GridHeight *build_grids(int shape[2], int normal_axis, int adt,
+        const char *grid_fn, const char *sampling_fn, const char *error_fn,
+        gmx_bool bBinary, gmx_bool bTiled) {
     GridHeight *grid_store;
-    int grid, i;
+    int i;
 
     /* Check dimensions */
     if (shape[0] <= 0 || shape[1] <= 0) {
@@ -45,6 +351,10 @@ GridHeight *build_grids(int shape[2], int normal_axis,
                 shape[0], shape[1]);
         exit(1);
     }
+    /* Windows of 0 frames would never be closed */
+    if (adt == 0) {
+        gmx_fatal(FARGS, "The -adt can not be 0\n");
+    }
 
     /* Allocate empty structure */
     snew(grid_store, 1);
@@ -53,11 +363,20 @@ GridHeight *build_grids(int shape[2], int normal_axis,
     for (i=0; i<2; ++i) {
         /* Store the shape */
         grid_store->shape[i] = shape[i];
-        /* Set the slice width to 0, just in case */
-        grid_store->width[i] = 0;
         /* Set box_width sommation to 0 */
         grid_store->box_width[i] = 0.0;
+        grid_store->window_box_width[i] = 0.0;
     }
+    grid_store->window_shear = 0.0;
+    grid_store->window_nframes = 0;
+    grid_store->writer = NULL;
+    grid_store->smoother = NULL;
+    grid_store->ncells = shape[0] * shape[1];
+    grid_store->adt = adt;
+    grid_store->bDefer = FALSE;
+    grid_store->pending = NULL;
+    grid_store->npending = 0;
+    grid_store->pending_alloc = 0;
     /* Define the axis */
     grid_store->axis[0] = normal_axis;
     switch (normal_axis) {
@@ -74,138 +393,708 @@ GridHeight *build_grids(int shape[2], int normal_axis,
             gmx_fatal(FARGS,"Invalid axes. Terminating. \n");
     }
 
-    /* Allocate the grids */
-    for (grid = 0; grid < 3; ++grid) {
-        (grid_store->grids)[grid] = realMatrix(shape[0], shape[1], 0.0);
-        (grid_store->sampling)[grid] = intMatrix(shape[0], shape[1], 0);
+    for (i=0; i<3; ++i) {
+        grid_store->binning.axis[i] = grid_store->axis[i];
+    }
+    for (i=0; i<2; ++i) {
+        grid_store->binning.shape[i] = shape[i];
+    }
+    binning_init();
+
+    /* Allocate the grids; a tiled grid grows its statistics with its
+     * tiles */
+    init_window_stats(&grid_store->stats, 0);
+    _alloc_storage(grid_store, bTiled);
+    window_stats_resize(&grid_store->stats,
+            bTiled ? grid_store->slot_alloc * GRID_TILE : grid_store->ncells);
+    if (bTiled) {
+        fprintf(stderr, "Storing the %d x %d grid by tiles of %d cells\n",
+                shape[0], shape[1], GRID_TILE);
     }
 
-    /* Open the files */
-    grid_store->out_grid = ffopen(grid_fn, "w");
+    /* Open the files; the binary output holds the sampling too */
+    grid_store->bBinary = bBinary;
+    grid_store->out_grid = NULL;
+    grid_store->out_sampling = NULL;
+    grid_store->out_error = NULL;
+    if (!grid_fn) {
+        return grid_store;
+    }
+    grid_store->out_grid = ffopen(grid_fn, bBinary ? "wb" : "w");
     if (grid_store->out_grid == NULL) {
         fprintf(stderr, "Error oppenning %s for grid mode\n", grid_fn);
         exit(1);
     }
-    grid_store->out_sampling = ffopen(sampling_fn, "w");
-    if (grid_store->out_sampling == NULL && sampling_fn != NULL) {
-        fprintf(stderr, "Error oppenning %s for grid mode\n", sampling_fn);
-        exit(1);
+    if (!bBinary) {
+        grid_store->out_sampling = ffopen(sampling_fn, "w");
+        if (grid_store->out_sampling == NULL && sampling_fn != NULL) {
+            fprintf(stderr, "Error oppenning %s for grid mode\n",
+                    sampling_fn);
+            exit(1);
+        }
+    }
+    if (error_fn) {
+        grid_store->out_error = ffopen(error_fn, bBinary ? "wb" : "w");
     }
 
     return grid_store;
 }
 
+/** Contruct an empty instance of GridHeight with the settings of another one
+ *
+ * The copy does not own any output file. It is meant to accumulate frames on
+ * a worker thread; the windows it closes are kept until they are folded
+ * back with grid_commit_windows, and the unfinished window with
+ * grid_reduce_fields.
+ */
+GridHeight *grid_worker_copy(GridHeight *grid_store) {
+    GridHeight *copy;
+    int i;
+
+    if (!grid_store) {
+        return NULL;
+    }
+    snew(copy, 1);
+    copy->nframes = 0;
+    for (i=0; i<2; ++i) {
+        copy->shape[i] = grid_store->shape[i];
+        copy->box_width[i] = 0.0;
+        copy->window_box_width[i] = 0.0;
+    }
+    copy->window_shear = 0.0;
+    copy->window_nframes = 0;
+    copy->writer = NULL;
+    /* The copy closes its windows, so it smooths them too */
+    copy->smoother = NULL;
+    if (grid_store->smoother) {
+        copy->smoother = build_smoother(grid_store->shape,
+                grid_store->smoother->sigma);
+    }
+    copy->ncells = grid_store->ncells;
+    copy->adt = grid_store->adt;
+    copy->bDefer = TRUE;
+    copy->pending = NULL;
+    copy->npending = 0;
+    copy->pending_alloc = 0;
+    for (i=0; i<3; ++i) {
+        copy->axis[i] = grid_store->axis[i];
+    }
+    copy->binning = grid_store->binning;
+    copy->bBinary = grid_store->bBinary;
+    copy->out_grid = NULL;
+    copy->out_sampling = NULL;
+    copy->out_error = NULL;
+    /* The copy never folds a window, so it has no statistics */
+    init_window_stats(&copy->stats, 0);
+    /* The copy stores its own tiles */
+    _alloc_storage(copy, grid_store->bTiled);
+    return copy;
+}
+
 /** Clean an instance of GridHeight
  */
 void clean_grids(GridHeight *grid_store) {
     int grid = 0;
     if (grid_store) {
-        for (grid = 0; grid < 3; ++grid) {
-            deleteRealMat(grid_store->grids[grid], grid_store->shape[0]);
-            deleteIntMat(grid_store->sampling[grid], grid_store->shape[0]);
+        _free_storage(grid_store);
+        for (grid = 0; grid < grid_store->pending_alloc; ++grid) {
+            sfree(grid_store->pending[grid].cells);
+            sfree(grid_store->pending[grid].thickness);
+            sfree(grid_store->pending[grid].sampling);
+        }
+        sfree(grid_store->pending);
+        clean_window_writer(grid_store->writer);
+        clean_smoother(grid_store->smoother);
+        if (grid_store->out_grid) {
+            ffclose(grid_store->out_grid);
+        }
+        if (grid_store->out_sampling) {
+            ffclose(grid_store->out_sampling);
         }
-        ffclose(grid_store->out_grid);
-        ffclose(grid_store->out_sampling);
+        if (grid_store->out_error) {
+            ffclose(grid_store->out_error);
+        }
+        clean_window_stats(&grid_store->stats);
         sfree(grid_store);
     }
 }
 
-void grid_start_frame(GridHeight *grid_store, matrix box) {
+/** Write the thickness landscape of every -adt window to a compressed
+ * stream as soon as the window is closed
+ */
+void grid_stream_windows(GridHeight *grid_store, const char *fn) {
+    if (grid_store) {
+        grid_store->writer = build_window_writer(fn, grid_store->shape,
+                grid_store->axis);
+    }
+}
+
+/** Smooth the thickness of every -adt window with a Gaussian of width
+ * "sigma", in nm, over the membrane plane
+ *
+ * The smoothing needs every cell of the grid, so the grid has to be dense.
+ */
+void grid_smooth(GridHeight *grid_store, real sigma) {
+    if (grid_store && sigma > 0) {
+        if (grid_store->bTiled) {
+            gmx_fatal(FARGS, "A smoothed landscape can not be tiled\n");
+        }
+        grid_store->smoother = build_smoother(grid_store->shape, sigma);
+    }
+}
+
+/** Width of the smoothing Gaussian, or 0 if the grid is not smoothed
+ */
+real grid_sigma(GridHeight *grid_store) {
+    return grid_store->smoother ? grid_store->smoother->sigma : 0;
+}
+
+/** Account for the box of a new frame
+ *
+ * Update the frame count and the sum of the box widths.
+ */
+void grid_count_frame(GridHeight *grid_store, matrix box) {
     int i = 0;
     int axis = 0;
     if (grid_store) {
         grid_store->nframes += 1;
         for (i=0; i<2; ++i) {
             axis = grid_store->axis[i+1];
-            grid_store->width[i] = box[axis][axis]/grid_store->shape[i];
             grid_store->box_width[i] += box[axis][axis];
         }
     }
 }
 
-void grid_end_frame(GridHeight *grid_store, int adt) {
-    int i, j, leaflet;
-    int minsamp=0;
-    if (grid_store && adt > 0 && grid_store->nframes % adt == 0) {
-        /* Average the fields */
-        _average_field(grid_store);
-        /* Calculate the thickness */
-        _calculate_thickness(grid_store);
-        /* Empty the fields */
-        for (leaflet = 0; leaflet < 2; ++leaflet) {
-            for (i=0; i < grid_store->shape[0]; ++i) {
-                for (j=0; j < grid_store->shape[1]; ++j) {
-                    grid_store->grids[leaflet][i][j] = 0.0;
-                    grid_store->sampling[leaflet][i][j] = 0;
+void grid_start_frame(GridHeight *grid_store, matrix box) {
+    int i = 0;
+    int axis = 0;
+    if (grid_store) {
+        grid_count_frame(grid_store, box);
+        grid_store->window_nframes += 1;
+        for (i=0; i<2; ++i) {
+            axis = grid_store->axis[i+1];
+            grid_store->window_box_width[i] += box[axis][axis];
+        }
+        grid_store->window_shear +=
+            box[grid_store->axis[2]][grid_store->axis[1]];
+        binning_set_box(&grid_store->binning, box);
+    }
+}
+
+/** Whether the trajectory ends on an open window, folded in the results
+ * by the end of the analysis
+ *
+ * That is the single window of a negative -adt, or an -adt longer than the
+ * trajectory.
+ */
+static gmx_bool _ends_on_open_window(GridHeight *grid_store) {
+    return grid_store->adt < 0 || grid_store->adt > grid_store->nframes;
+}
+
+/** Close the window if the frame is the last one of an -adt window
+ *
+ * The window is folded in the thickness right away, unless the instance is
+ * a worker copy.
+ */
+void grid_end_frame(GridHeight *grid_store) {
+    if (grid_store && grid_store->adt > 0
+            && grid_store->nframes % grid_store->adt == 0) {
+        grid_close_window(grid_store);
+        if (!grid_store->bDefer) {
+            grid_commit_windows(grid_store, grid_store);
+        }
+    }
+}
+
+/** Compute the thickness of the window accumulated in "window", keep it
+ * until the next grid_commit_windows, and empty the leaflets
+ */
+void grid_close_window(GridHeight *window) {
+    GridWindow *closed;
+    if (window) {
+        if (window->npending == window->pending_alloc) {
+            srenew(window->pending, window->pending_alloc + 1);
+            closed = &window->pending[window->pending_alloc];
+            closed->cells = NULL;
+            closed->thickness = NULL;
+            closed->sampling = NULL;
+            closed->alloc = 0;
+            window->pending_alloc += 1;
+        }
+        stats_count(COUNTER_CELLS, window->ntouched);
+        _close_window_into(window, &window->pending[window->npending]);
+        window->npending += 1;
+    }
+}
+
+/** Fold the windows closed by "window" into the thickness of "grid_store",
+ * in the order they were closed
+ */
+void grid_commit_windows(GridHeight *grid_store, GridHeight *window) {
+    int i;
+    if (grid_store && window) {
+        for (i=0; i < window->npending; ++i) {
+            _apply_window(grid_store, window, &window->pending[i]);
+        }
+        window->npending = 0;
+    }
+}
+
+/** Add the unfinished window of "other" to the one of "grid_store"
+ *
+ * The frame count and box widths are not touched, but the counters of the
+ * unfinished window are added. "other" is a worker copy, so it has no
+ * thickness of its own.
+ */
+void grid_reduce_fields(GridHeight *grid_store, GridHeight *other) {
+    int leaflet, source, target, i;
+    if (grid_store && other) {
+        grid_store->window_nframes += other->window_nframes;
+        grid_store->window_box_width[0] += other->window_box_width[0];
+        grid_store->window_box_width[1] += other->window_box_width[1];
+        grid_store->window_shear += other->window_shear;
+        for (i = 0; i < other->ntouched; ++i) {
+            source = other->touched[i];
+            target = _cell_offset(grid_store, _cell_index(other, source),
+                    TRUE);
+            if (grid_store->sampling[0][target] == 0
+                    && grid_store->sampling[1][target] == 0) {
+                grid_store->touched[grid_store->ntouched++] = target;
+            }
+            for (leaflet = 0; leaflet < 2; ++leaflet) {
+                grid_store->grids[leaflet][target]
+                    += other->grids[leaflet][source];
+                grid_store->sampling[leaflet][target]
+                    += other->sampling[leaflet][source];
+            }
+        }
+    }
+}
+
+/** Add the frames analysed by another instance with the same settings
+ *
+ * The result is the one of merging the accumulator files of both: the
+ * frame counts, box widths and sums are added, the unfinished windows are
+ * joined, and the statistics of the window thickness are combined. "other"
+ * is not modified.
+ */
+void grid_add(GridHeight *grid_store, GridHeight *other) {
+    int slot, tile, source, target, count, leaflet, i;
+    if (grid_store && other) {
+        grid_store->nframes += other->nframes;
+        grid_store->window_nframes += other->window_nframes;
+        for (i = 0; i < 2; ++i) {
+            grid_store->box_width[i] += other->box_width[i];
+            grid_store->window_box_width[i] += other->window_box_width[i];
+        }
+        grid_store->window_shear += other->window_shear;
+        for (slot = 0; slot < other->nslots; ++slot) {
+            tile = _slot_tile(other, slot);
+            if (tile < 0) {
+                continue;
+            }
+            source = slot * GRID_TILE;
+            target = grid_tile_offset(grid_store, tile, TRUE);
+            count = grid_tile_cells(other, tile);
+            for (i = 0; i < count; ++i) {
+                for (leaflet = 0; leaflet < 3; ++leaflet) {
+                    grid_store->grids[leaflet][target + i]
+                        += other->grids[leaflet][source + i];
                 }
+                for (leaflet = 0; leaflet < 2; ++leaflet) {
+                    grid_store->sampling[leaflet][target + i]
+                        += other->sampling[leaflet][source + i];
+                }
+                window_stats_merge(&grid_store->stats, target + i,
+                        grid_store->sampling[2][target + i],
+                        other->stats.mean[source + i],
+                        other->stats.m2[source + i],
+                        other->stats.w2[source + i],
+                        other->sampling[2][source + i]);
+                grid_store->sampling[2][target + i]
+                    += other->sampling[2][source + i];
             }
         }
+        grid_find_touched(grid_store);
     }
 }
 
-void grid_store(GridHeight *grid, int leaflet, rvec atom, t_pbc *pbc) {
-    int axis = 0;
-    int slice[2] = {0, 0};
-    int i = 0;
+/** List again the cells hit during the open window, after the leaflets
+ * were filled directly as when accumulator files are merged
+ */
+void grid_find_touched(GridHeight *grid_store) {
+    int slot, tile, first, count, i;
+    if (grid_store) {
+        grid_store->ntouched = 0;
+        for (slot = 0; slot < grid_store->nslots; ++slot) {
+            tile = _slot_tile(grid_store, slot);
+            if (tile < 0) {
+                continue;
+            }
+            first = slot * GRID_TILE;
+            count = grid_tile_cells(grid_store, tile);
+            for (i = first; i < first + count; ++i) {
+                if (grid_store->sampling[0][i] > 0
+                        || grid_store->sampling[1][i] > 0) {
+                    grid_store->touched[grid_store->ntouched++] = i;
+                }
+            }
+        }
+    }
+}
+
+/** Store one atom of a leaflet
+ *
+ * The atom is binned in reduced coordinates like grid_store_batch does,
+ * with the box given to grid_start_frame; it is not moved in the box.
+ */
+void grid_store(GridHeight *grid, int leaflet, rvec atom) {
+    int cell = 0;
+    real height = 0;
     if (grid) {
-        put_atom_in_box((real (*)[3])pbc->box,atom);
-        axis = grid->axis[0];
-        for (i =0; i<2; ++i) {
-            slice[i] = atom[grid->axis[i+1]]/grid->width[i];
+        binning_locate(&grid->binning, atom, &cell, &height);
+        cell = _cell_offset(grid, cell, TRUE);
+        _add_height(grid, leaflet, cell, height);
+    }
+}
+
+/** Store the atoms x[index[0]] to x[index[natoms - 1]] of a leaflet
+ *
+ * This is equivalent to calling grid_store for each atom, but the cells are
+ * computed by batches with the fastest binning kernel available, and the
+ * coordinates are not modified. The tiles of a tiled grid are added as the
+ * atoms hit them.
+ */
+void grid_store_batch(GridHeight *grid, int leaflet, rvec *x,
+        atom_id *index, int natoms) {
+    int cells[BINNING_BATCH];
+    real heights[BINNING_BATCH];
+    binning_kernel_t kernel;
+    real *field;
+    int *sampling, *other, *touched;
+    int start, count, cell, ntouched, i;
+    if (grid) {
+        kernel = binning_kernel(&grid->binning);
+        field = grid->grids[leaflet];
+        sampling = grid->sampling[leaflet];
+        other = grid->sampling[1 - leaflet];
+        touched = grid->touched;
+        for (start = 0; start < natoms; start += BINNING_BATCH) {
+            count = min(BINNING_BATCH, natoms - start);
+            kernel(&grid->binning, x, index + start, count, cells, heights);
+            if (grid->bTiled) {
+                /* Adding a tile moves the buffers */
+                for (i = 0; i < count; ++i) {
+                    cell = _cell_offset(grid, cells[i], TRUE);
+                    _add_height(grid, leaflet, cell, heights[i]);
+                }
+                continue;
+            }
+            ntouched = grid->ntouched;
+            for (i = 0; i < count; ++i) {
+                cell = cells[i];
+                if (sampling[cell] == 0 && other[cell] == 0) {
+                    touched[ntouched++] = cell;
+                }
+                field[cell] += heights[i];
+                sampling[cell] += 1;
+            }
+            grid->ntouched = ntouched;
         }
-        grid->grids[leaflet][slice[0]][slice[1]] += atom[axis];
-        grid->sampling[leaflet][slice[0]][slice[1]] += 1;
     }
 }
 
-void grid_end(GridHeight *grid_store, int adt) {
+/** Write the header of a text output file
+ */
+void _write_text_header(GridHeight *grid_store, FILE *out,
+        const char *legend) {
     char labels[] = "XYZ";
+    fprintf(out, "@xwidth %7.3f\n",
+            grid_store->box_width[0]/grid_store->nframes);
+    fprintf(out, "@ywidth %7.3f\n",
+            grid_store->box_width[1]/grid_store->nframes);
+    fprintf(out, "@xlabel %c (nm)\n", labels[grid_store->axis[1]]);
+    fprintf(out, "@ylabel %c (nm)\n", labels[grid_store->axis[2]]);
+    fprintf(out, "@legend %s\n", legend);
+}
+
+/** Write a grid of values as text
+ */
+void _write_text_grid(GridHeight *grid_store, FILE *out, real *grid,
+        const char *legend) {
+    int i, j;
+    _write_text_header(grid_store, out, legend);
+    for (i=0; i < grid_store->shape[0]; ++i) {
+        for (j=0; j < grid_store->shape[1]; ++j) {
+            if (j > 0) {
+                fprintf(out, "\t");
+            }
+            fprintf(out, "%7.3f", grid[_cell_offset(grid_store,
+                        i * grid_store->shape[1] + j, FALSE)]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/** Write the thickness and the sampling as text, one file after the other
+ */
+void _write_text(GridHeight *grid_store, real *thickness, int *sampling) {
+    int i, j;
+
+    _write_text_grid(grid_store, grid_store->out_grid, thickness,
+            "Thickness (nm)");
+
+    _write_text_header(grid_store, grid_store->out_sampling,
+            "Thickness (nm)");
+    for (i=0; i < grid_store->shape[0]; ++i) {
+        for (j=0; j < grid_store->shape[1]; ++j) {
+            if (j > 0) {
+                fprintf(grid_store->out_sampling, "\t");
+            }
+            fprintf(grid_store->out_sampling, "%d",
+                    sampling[_cell_offset(grid_store,
+                        i * grid_store->shape[1] + j, FALSE)]);
+        }
+        fprintf(grid_store->out_sampling, "\n");
+    }
+}
+
+/** Write a grid of values and the sampling in the binary format
+ *
+ * The file starts with a GRID_BINARY_HEADER bytes long header; all the
+ * values are in the native byte order of the machine:
+ *
+ *  - offset  0: magic string "GTHKGRID" (8 bytes)
+ *  - offset  8: int32, format version (1)
+ *  - offset 12: int32, byte order mark (0x01020304)
+ *  - offset 16: int32, size of a thickness value in bytes (4 or 8)
+ *  - offset 20: int32[2], shape of the grid
+ *  - offset 28: int32[3], normal axis then the axes of the two grid
+ *    dimensions (0 for X, 1 for Y, 2 for Z)
+ *  - offset 40: int32, number of frames
+ *  - offset 48: float64[2], mean box widths along the grid dimensions (nm)
+ *  - offset 64: int64, offset of the thickness array
+ *  - offset 72: int64, offset of the sampling array
+ *
+ * The header is followed by the thickness grid (float32 or float64) then
+ * by the sampling grid (int32), both row-major with shape[0] rows. The
+ * standard error output has the same layout, with the standard error in
+ * place of the thickness. "values" and "samplings" are in the storage order
+ * of the grid.
+ */
+void _write_binary(GridHeight *grid_store, FILE *out, real *values,
+        int *samplings) {
+    char header[GRID_BINARY_HEADER];
+    int32_t version = 1;
+    int32_t bom = 0x01020304;
+    int32_t real_size = sizeof(real);
+    int32_t shape[2], axis[3], nframes;
+    double widths[2];
+    int64_t grid_offset, sampling_offset;
+    int32_t sampling[GRID_TILE];
+    int tile, offset, count, i;
+    gmx_bool bError = FALSE;
+
+    for (i=0; i<2; ++i) {
+        shape[i] = grid_store->shape[i];
+        widths[i] = grid_store->box_width[i]/grid_store->nframes;
+    }
+    for (i=0; i<3; ++i) {
+        axis[i] = grid_store->axis[i];
+    }
+    nframes = grid_store->nframes;
+    grid_offset = GRID_BINARY_HEADER;
+    sampling_offset = grid_offset + (int64_t)grid_store->ncells * sizeof(real);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "GTHKGRID", 8);
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &bom, 4);
+    memcpy(header + 16, &real_size, 4);
+    memcpy(header + 20, shape, 8);
+    memcpy(header + 28, axis, 12);
+    memcpy(header + 40, &nframes, 4);
+    memcpy(header + 48, widths, 16);
+    memcpy(header + 64, &grid_offset, 8);
+    memcpy(header + 72, &sampling_offset, 8);
+
+    bError = fwrite(header, 1, sizeof(header), out) != sizeof(header);
+    /* The arrays are written tile by tile, in row-major order */
+    for (tile=0; tile < grid_store->ntiles && !bError; ++tile) {
+        offset = grid_tile_offset(grid_store, tile, FALSE);
+        count = grid_tile_cells(grid_store, tile);
+        bError = fwrite(values + offset, sizeof(real), count, out)
+            != (size_t)count;
+    }
+    for (tile=0; tile < grid_store->ntiles && !bError; ++tile) {
+        offset = grid_tile_offset(grid_store, tile, FALSE);
+        count = grid_tile_cells(grid_store, tile);
+        for (i=0; i < count; ++i) {
+            sampling[i] = samplings[offset + i];
+        }
+        bError = fwrite(sampling, sizeof(int32_t), count, out)
+            != (size_t)count;
+    }
+    if (bError) {
+        gmx_fatal(FARGS, "Error while writing the binary grid output\n");
+    }
+}
+
+/** Write the output files from values in the storage order of the grid
+ *
+ * The files are written from their beginning, so they can be written
+ * again with newer results. "error" is only read if the standard error
+ * is written.
+ */
+static void _write_results(GridHeight *grid_store, real *thickness,
+        int *sampling, real *error) {
+    rewind_output(grid_store->out_grid, 0);
+    rewind_output(grid_store->out_sampling, 0);
+    rewind_output(grid_store->out_error, 0);
+    if (grid_store->bBinary) {
+        _write_binary(grid_store, grid_store->out_grid, thickness, sampling);
+    }
+    else {
+        _write_text(grid_store, thickness, sampling);
+    }
+    if (grid_store->out_error) {
+        if (grid_store->bBinary) {
+            _write_binary(grid_store, grid_store->out_error, error,
+                    sampling);
+        }
+        else {
+            _write_text_grid(grid_store, grid_store->out_error, error,
+                    "Standard error of the thickness (nm)");
+        }
+    }
+    truncate_output(grid_store->out_grid);
+    truncate_output(grid_store->out_sampling);
+    truncate_output(grid_store->out_error);
+}
+
+/** Fill arrays with the results of a grid, in row-major order or in the
+ * storage order of the grid; see grid_snapshot
+ */
+static void _snapshot(GridHeight *grid_store, real *thickness, int *sampling,
+        real *error, gmx_bool bStorageOrder) {
+    int tile, offset, count, cell, index, minsamp, weight, i;
+    real window, sum;
+    double mean, m2, w2;
+    WindowStats stats = {1, &mean, &m2, &w2};
+    GridWindow open = {NULL, NULL, NULL, 0, 0, 0, {0.0, 0.0}};
+    for (tile=0; tile < grid_store->ntiles; ++tile) {
+        offset = grid_tile_offset(grid_store, tile, FALSE);
+        count = grid_tile_cells(grid_store, tile);
+        for (i=0; i < count; ++i) {
+            cell = offset + i;
+            index = bStorageOrder ? cell : tile * GRID_TILE + i;
+            if (thickness) {
+                thickness[index] = grid_store->grids[2][cell]
+                    / grid_store->sampling[2][cell];
+            }
+            if (sampling) {
+                sampling[index] = grid_store->sampling[2][cell];
+            }
+            if (error) {
+                error[index] = window_stats_error(&grid_store->stats, cell,
+                        grid_store->sampling[2][cell]);
+            }
+        }
+    }
+    if (!_ends_on_open_window(grid_store)) {
+        return;
+    }
+    /* Fold the open window on copies of the cells it hit */
+    _window_thickness(grid_store, &open);
+    for (i=0; i < open.ncells; ++i) {
+        cell = open.cells[i];
+        minsamp = open.sampling[i];
+        window = open.thickness[i];
+        index = bStorageOrder ? cell : _cell_index(grid_store, cell);
+        weight = grid_store->sampling[2][cell];
+        sum = grid_store->grids[2][cell];
+        sum += window * minsamp;
+        if (thickness) {
+            thickness[index] = sum / (weight + minsamp);
+        }
+        if (sampling) {
+            sampling[index] = weight + minsamp;
+        }
+        if (error) {
+            mean = grid_store->stats.mean[cell];
+            m2 = grid_store->stats.m2[cell];
+            w2 = grid_store->stats.w2[cell];
+            window_stats_add(&stats, 0, weight, window, minsamp);
+            error[index] = window_stats_error(&stats, 0, weight + minsamp);
+        }
+    }
+    sfree(open.cells);
+    sfree(open.thickness);
+    sfree(open.sampling);
+}
+
+/** Copy the results of a grid as grid_end would write them if the
+ * trajectory stopped at the last frame
+ *
+ * The arrays hold one value per cell in row-major order; any of them can
+ * be NULL. The thickness of the cells that were never sampled by both
+ * leaflets is NAN, as is the standard error with less than two windows.
+ * The open window counts in the results when grid_end would close it; it
+ * is left open so frames can still be added.
+ */
+void grid_snapshot(GridHeight *grid_store, real *thickness, int *sampling,
+        real *error) {
     if (grid_store) {
-        int i, j, leaflet;
-        if (adt < 0 || adt > grid_store->nframes) {
-            _average_field(grid_store);
-            _calculate_thickness(grid_store);
-        }
-        for (i=0; i < grid_store->shape[0]; ++i) {
-            for (j=0; j < grid_store->shape[1]; ++j) {
-                grid_store->grids[2][i][j] /= grid_store->sampling[2][i][j];
-            }
-        }
-        /* Write the output */
-        fprintf(grid_store->out_grid, "@xwidth %7.3f\n",
-                grid_store->box_width[0]/grid_store->nframes);
-        fprintf(grid_store->out_grid, "@ywidth %7.3f\n",
-                grid_store->box_width[1]/grid_store->nframes);
-        fprintf(grid_store->out_sampling, "@xwidth %7.3f\n",
-                grid_store->box_width[0]/grid_store->nframes);
-        fprintf(grid_store->out_sampling, "@ywidth %7.3f\n",
-                grid_store->box_width[1]/grid_store->nframes);
-        fprintf(grid_store->out_grid, "@xlabel %c (nm)\n",
-                labels[grid_store->axis[1]]);
-        fprintf(grid_store->out_grid, "@ylabel %c (nm)\n",
-                labels[grid_store->axis[2]]);
-        fprintf(grid_store->out_sampling, "@xlabel %c (nm)\n",
-                labels[grid_store->axis[1]]);
-        fprintf(grid_store->out_sampling, "@ylabel %c (nm)\n",
-                labels[grid_store->axis[2]]);
-        fprintf(grid_store->out_grid, "@legend Thickness (nm)\n");
-        fprintf(grid_store->out_sampling, "@legend Thickness (nm)\n");
-        for (leaflet = 2; leaflet < 3; ++leaflet) {
-            for (i=0; i < grid_store->shape[0]; ++i) {
-                for (j=0; j < grid_store->shape[1]; ++j) {
-                    if (j > 0) {
-                        fprintf(grid_store->out_grid, "\t");
-                        fprintf(grid_store->out_sampling, "\t");
-                    }
-                    fprintf(grid_store->out_grid, "%7.3f",
-                            grid_store->grids[leaflet][i][j]);
-                    fprintf(grid_store->out_sampling, "%d",
-                            grid_store->sampling[leaflet][i][j]);
-                }
-                fprintf(grid_store->out_grid, "\n");
-                fprintf(grid_store->out_sampling, "\n");
+        _snapshot(grid_store, thickness, sampling, error, FALSE);
+    }
+}
+
+/** Write the output files with the results of the frames analysed so far
+ *
+ * The files are written again at each call, and by grid_end.
+ */
+void grid_flush(GridHeight *grid_store) {
+    real *thickness, *error = NULL;
+    int *sampling;
+    if (grid_store && grid_store->out_grid) {
+        snew(thickness, grid_store->nstored);
+        snew(sampling, grid_store->nstored);
+        if (grid_store->out_error) {
+            snew(error, grid_store->nstored);
+        }
+        _snapshot(grid_store, thickness, sampling, error, TRUE);
+        _write_results(grid_store, thickness, sampling, error);
+        sfree(thickness);
+        sfree(sampling);
+        sfree(error);
+    }
+}
+
+void grid_end(GridHeight *grid_store) {
+    if (grid_store) {
+        int cell;
+        real *error = NULL;
+        if (_ends_on_open_window(grid_store)) {
+            grid_close_window(grid_store);
+            grid_commit_windows(grid_store, grid_store);
+        }
+        for (cell=0; cell < grid_store->nstored; ++cell) {
+            grid_store->grids[2][cell] /= grid_store->sampling[2][cell];
+        }
+        /* Write the output, if any */
+        if (!grid_store->out_grid) {
+            return;
+        }
+        if (grid_store->out_error) {
+            snew(error, grid_store->nstored);
+            for (cell=0; cell < grid_store->nstored; ++cell) {
+                error[cell] = window_stats_error(&grid_store->stats, cell,
+                        grid_store->sampling[2][cell]);
             }
         }
+        _write_results(grid_store, grid_store->grids[2],
+                grid_store->sampling[2], error);
+        sfree(error);
     }
 }
 
@@ -2,6 +2,8 @@
 #define _grid_mode_h
 
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <gromacs/macros.h>
 #include <gromacs/smalloc.h>
@@ -11,6 +13,46 @@
 #include <gromacs/futil.h>
 
 #include "matrix.h"
+#include "output_file.h"
+#include "binning.h"
+#include "run_stats.h"
+#include "smoothing.h"
+#include "window_stats.h"
+#include "window_writer.h"
+
+/* Size in bytes of the header of the binary grid output */
+#define GRID_BINARY_HEADER 128
+
+/* A tile is a run of 2^GRID_TILE_BITS consecutive row-major cells */
+#define GRID_TILE_BITS 8
+#define GRID_TILE (1 << GRID_TILE_BITS)
+
+/* With the automatic storage, grids of at least this number of cells are
+ * tiled, unless the leaflets have more atoms than the grid has cells over
+ * GRID_TILED_OCCUPANCY */
+#define GRID_TILED_MIN_CELLS (1 << 20)
+#define GRID_TILED_OCCUPANCY 4
+
+/* Storage of the cells of a grid, see grid_use_tiles */
+enum {
+    GRID_STORAGE_AUTO,
+    GRID_STORAGE_DENSE,
+    GRID_STORAGE_TILED
+};
+
+/** Thickness of a closed -adt window waiting to be folded in the thickness
+ *
+ * Only the cells sampled by both leaflets are kept.
+ */
+typedef struct GridWindow {
+    int  *cells;        /* Offsets of the cells in the buffers of the grid */
+    real *thickness;
+    int  *sampling;     /* Sampling of the least sampled leaflet */
+    int ncells;
+    int alloc;
+    int nframes;
+    real box_width[2];  /* Sums of the box widths over the window */
+} GridWindow;
 
 /** Store the height field of each leaflet and the membrane thickness as grids
  *
@@ -21,30 +63,109 @@
  * lealet and the thickness.
  *
  * The shape of the grids is also stored to avoid looking out of boundaries.
+ * The cell (i, j) has the row-major index i * shape[1] + j. A dense grid
+ * stores each cell at its index in contiguous buffers. A tiled grid cuts
+ * the cells in tiles of GRID_TILE consecutive indices and only stores the
+ * tiles that were hit, one after the other in slots; slot 0 is an empty
+ * tile that stands for all the tiles that are not stored. The memory and
+ * the sweeps over the cells then scale with the area covered by the
+ * membrane rather than with the grid. grid_tile_offset gives where a tile
+ * is stored in both cases.
  */
 typedef struct GridHeight {
-    real **grids[3];    
-    int  **sampling[3];
+    real *grids[3];    
+    int  *sampling[3];
     int  shape[2];
+    int  ncells;
+    /* Storage of the cells; the buffers hold nstored cells */
+    gmx_bool bTiled;
+    int ntiles;
+    int nstored;
+    int *tile_slot;     /* Slot of each tile, 0 if it is not stored */
+    int *slot_tile;     /* Tile of each slot, -1 for the empty tile */
+    int nslots;
+    int slot_alloc;
+    /* Cells hit during the open window, as offsets in the buffers; only
+     * them are averaged and emptied when the window is closed */
+    int *touched;
+    int ntouched;
     FILE *out_grid;
     FILE *out_sampling;
-    real width[2];
+    FILE *out_error;    /* Standard error of the thickness, or NULL */
+    gmx_bool bBinary;
     int axis[3];
     real box_width[2];
     int nframes;
+    /* Frames and box widths of the window being accumulated */
+    real window_box_width[2];
+    /* Sum over the window of the component along the first grid dimension
+     * of the box vector of the second one; 0 unless the box is triclinic */
+    real window_shear;
+    int window_nframes;
+    /* Parameters of the binning kernel for the current frame */
+    BinningFrame binning;
+    /* Stream of the per window landscapes, if any */
+    WindowWriter *writer;
+    /* Gaussian smoothing of the windows, or NULL */
+    GridSmoother *smoother;
+    /* Frames per window; a single window if lesser than 0 */
+    int adt;
+    /* Closed windows wait for grid_commit_windows instead of being folded
+     * at once; this is the case of the worker copies */
+    gmx_bool bDefer;
+    GridWindow *pending;
+    int npending;
+    int pending_alloc;
+    /* Statistics of the window thickness of each cell */
+    WindowStats stats;
 } GridHeight;
 
-GridHeight *build_grids(int shape[2], int normal_axis,
-        const char *grid_fn, const char *sampling_fn);
+gmx_bool grid_use_tiles(int storage, int shape[2], int natoms);
+
+GridHeight *build_grids(int shape[2], int normal_axis, int adt,
+        const char *grid_fn, const char *sampling_fn, const char *error_fn,
+        gmx_bool bBinary, gmx_bool bTiled);
+
+GridHeight *grid_worker_copy(GridHeight *grid_store);
 
 void clean_grids(GridHeight *grid_store);
 
+int grid_tile_cells(GridHeight *grid_store, int tile);
+
+int grid_tile_offset(GridHeight *grid_store, int tile, gmx_bool bCreate);
+
+void grid_stream_windows(GridHeight *grid_store, const char *fn);
+
+void grid_smooth(GridHeight *grid_store, real sigma);
+
+real grid_sigma(GridHeight *grid_store);
+
+void grid_count_frame(GridHeight *grid_store, matrix box);
+
 void grid_start_frame(GridHeight *grid_store, matrix box);
 
-void grid_end_frame(GridHeight *grid_store, int adt);
+void grid_end_frame(GridHeight *grid_store);
+
+void grid_close_window(GridHeight *window);
+
+void grid_commit_windows(GridHeight *grid_store, GridHeight *window);
+
+void grid_reduce_fields(GridHeight *grid_store, GridHeight *other);
+
+void grid_add(GridHeight *grid_store, GridHeight *other);
+
+void grid_find_touched(GridHeight *grid_store);
+
+void grid_store(GridHeight *grid, int leaflet, rvec atom);
+
+void grid_store_batch(GridHeight *grid, int leaflet, rvec *x,
+        atom_id *index, int natoms);
+
+void grid_snapshot(GridHeight *grid_store, real *thickness, int *sampling,
+        real *error);
 
-void grid_store(GridHeight *grid, int leaflet, rvec atom, t_pbc *pbc);
+void grid_flush(GridHeight *grid_store);
 
-void grid_end(GridHeight *grid_store, int adt);
+void grid_end(GridHeight *grid_store);
 
 #endif /*  _grid_mode_h */
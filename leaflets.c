@@ -0,0 +1,392 @@
+#include <math.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/vec.h>
+
+#include "leaflets.h"
+
+/* Largest number of cells along one dimension of the clustering grid */
+#define LEAFLET_MAX_CELLS 64
+/* Smallest fraction of the headgroups a leaflet can hold; a smaller second
+ * cluster means the leaflets were merged */
+#define LEAFLET_MIN_FRACTION 0.1
+
+LeafletSet *build_static_leaflets(atom_id **index, int *isize) {
+    LeafletSet *set;
+    int leaflet;
+    snew(set, 1);
+    for (leaflet = 0; leaflet < 2; ++leaflet) {
+        set->index[leaflet] = index[leaflet];
+        set->isize[leaflet] = isize[leaflet];
+    }
+    set->refcount = 1;
+    set->bOwned = FALSE;
+    return set;
+}
+
+LeafletSet *leaflet_set_retain(LeafletSet *set) {
+    __sync_fetch_and_add(&set->refcount, 1);
+    return set;
+}
+
+void leaflet_set_release(LeafletSet *set) {
+    if (set && __sync_sub_and_fetch(&set->refcount, 1) == 0) {
+        if (set->bOwned) {
+            sfree(set->index[0]);
+            sfree(set->index[1]);
+        }
+        sfree(set);
+    }
+}
+
+LeafletFinder *build_leaflet_finder(atom_id *heads, int nheads,
+        int normal_axis, int ePBC, real cutoff, int refresh) {
+    LeafletFinder *finder;
+    int i;
+
+    if (nheads < 2) {
+        gmx_fatal(FARGS, "At least two headgroup atoms are needed to detect "
+                "the leaflets\n");
+    }
+    if (cutoff <= 0) {
+        gmx_fatal(FARGS, "The leaflet detection cutoff has to be positive\n");
+    }
+    snew(finder, 1);
+    finder->heads = heads;
+    finder->nheads = nheads;
+    finder->normal_axis = normal_axis;
+    finder->ePBC = ePBC;
+    finder->cutoff = cutoff;
+    finder->refresh = refresh;
+    finder->age = 0;
+    finder->current = NULL;
+    finder->ndetections = 0;
+    snew(finder->label, nheads);
+    for (i = 0; i < nheads; ++i) {
+        finder->label[i] = -1;
+    }
+    snew(finder->parent, nheads);
+    snew(finder->size, nheads);
+    snew(finder->cell_of, nheads);
+    snew(finder->cell_heads, nheads);
+    snew(finder->pos, nheads);
+    finder->cell_start = NULL;
+    finder->cells_alloc = 0;
+    return finder;
+}
+
+void clean_leaflet_finder(LeafletFinder *finder) {
+    if (finder) {
+        leaflet_set_release(finder->current);
+        sfree(finder->label);
+        sfree(finder->parent);
+        sfree(finder->size);
+        sfree(finder->cell_of);
+        sfree(finder->cell_start);
+        sfree(finder->cell_heads);
+        sfree(finder->pos);
+        sfree(finder);
+    }
+}
+
+/** Find the cluster of a headgroup, with path halving
+ */
+static int find_root(int *parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static void join(LeafletFinder *finder, int i, int j) {
+    i = find_root(finder->parent, i);
+    j = find_root(finder->parent, j);
+    if (i != j) {
+        /* Attach the smallest cluster to the largest */
+        if (finder->size[i] < finder->size[j]) {
+            finder->parent[i] = j;
+            finder->size[j] += finder->size[i];
+        }
+        else {
+            finder->parent[j] = i;
+            finder->size[i] += finder->size[j];
+        }
+    }
+}
+
+/** Cluster the headgroups with a grid of cells at least "cutoff" wide
+ *
+ * Only used for rectangular boxes periodic in all dimensions; the positions
+ * are wrapped in the box.
+ */
+static void cluster_cells(LeafletFinder *finder, matrix box) {
+    int ncells[DIM], offsets[DIM][3], noffsets[DIM];
+    int c[DIM], n[DIM], o[DIM];
+    int d, i, j, p, q, cell, other, total;
+    real cutoff2 = finder->cutoff * finder->cutoff;
+    real half[DIM], dx, d2;
+
+    for (d = 0; d < DIM; ++d) {
+        ncells[d] = (int)(box[d][d] / finder->cutoff);
+        ncells[d] = max(1, min(ncells[d], LEAFLET_MAX_CELLS));
+        half[d] = 0.5 * box[d][d];
+        /* With less than three cells, the neighbours wrap on each other */
+        noffsets[d] = min(ncells[d], 3);
+        for (i = 0; i < noffsets[d]; ++i) {
+            offsets[d][i] = (noffsets[d] == 3) ? i - 1 : i;
+        }
+    }
+    total = ncells[XX] * ncells[YY] * ncells[ZZ];
+    if (total + 1 > finder->cells_alloc) {
+        finder->cells_alloc = total + 1;
+        srenew(finder->cell_start, finder->cells_alloc);
+    }
+
+    /* Sort the headgroups by cell */
+    for (cell = 0; cell <= total; ++cell) {
+        finder->cell_start[cell] = 0;
+    }
+    for (i = 0; i < finder->nheads; ++i) {
+        cell = 0;
+        for (d = 0; d < DIM; ++d) {
+            c[d] = (int)(finder->pos[i][d] / box[d][d] * ncells[d]);
+            c[d] = min(c[d], ncells[d] - 1);
+            cell = cell * ncells[d] + c[d];
+        }
+        finder->cell_of[i] = cell;
+        finder->cell_start[cell + 1] += 1;
+    }
+    for (cell = 0; cell < total; ++cell) {
+        finder->cell_start[cell + 1] += finder->cell_start[cell];
+    }
+    for (i = finder->nheads - 1; i >= 0; --i) {
+        cell = finder->cell_of[i];
+        finder->cell_start[cell + 1] -= 1;
+        finder->cell_heads[finder->cell_start[cell + 1]] = i;
+    }
+    /* cell_start[cell + 1] now holds the start of the cell; shift back */
+    for (cell = 0; cell < total; ++cell) {
+        finder->cell_start[cell] = finder->cell_start[cell + 1];
+    }
+    finder->cell_start[total] = finder->nheads;
+
+    /* Link the headgroups of neighbouring cells */
+    for (c[XX] = 0; c[XX] < ncells[XX]; ++c[XX])
+    for (c[YY] = 0; c[YY] < ncells[YY]; ++c[YY])
+    for (c[ZZ] = 0; c[ZZ] < ncells[ZZ]; ++c[ZZ]) {
+        cell = (c[XX] * ncells[YY] + c[YY]) * ncells[ZZ] + c[ZZ];
+        for (o[XX] = 0; o[XX] < noffsets[XX]; ++o[XX])
+        for (o[YY] = 0; o[YY] < noffsets[YY]; ++o[YY])
+        for (o[ZZ] = 0; o[ZZ] < noffsets[ZZ]; ++o[ZZ]) {
+            for (d = 0; d < DIM; ++d) {
+                n[d] = (c[d] + offsets[d][o[d]] + ncells[d]) % ncells[d];
+            }
+            other = (n[XX] * ncells[YY] + n[YY]) * ncells[ZZ] + n[ZZ];
+            /* Each pair of cells is seen twice; keep one */
+            if (other < cell) {
+                continue;
+            }
+            for (p = finder->cell_start[cell];
+                    p < finder->cell_start[cell + 1]; ++p) {
+                i = finder->cell_heads[p];
+                q = (other == cell) ? p + 1 : finder->cell_start[other];
+                for (; q < finder->cell_start[other + 1]; ++q) {
+                    j = finder->cell_heads[q];
+                    d2 = 0;
+                    for (d = 0; d < DIM; ++d) {
+                        dx = finder->pos[j][d] - finder->pos[i][d];
+                        if (dx > half[d]) {
+                            dx -= box[d][d];
+                        }
+                        else if (dx < -half[d]) {
+                            dx += box[d][d];
+                        }
+                        d2 += dx * dx;
+                    }
+                    if (d2 < cutoff2) {
+                        join(finder, i, j);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/** Cluster the headgroups by looking at every pair
+ *
+ * Used for triclinic boxes and partial periodicity.
+ */
+static void cluster_pairs(LeafletFinder *finder, matrix box, rvec *x) {
+    t_pbc pbc;
+    rvec dx;
+    int i, j;
+    real cutoff2 = finder->cutoff * finder->cutoff;
+
+    if (finder->ePBC != epbcNONE) {
+        set_pbc(&pbc, finder->ePBC, box);
+    }
+    for (i = 0; i < finder->nheads; ++i) {
+        for (j = i + 1; j < finder->nheads; ++j) {
+            if (finder->ePBC != epbcNONE) {
+                pbc_dx(&pbc, x[finder->heads[j]], x[finder->heads[i]], dx);
+            }
+            else {
+                rvec_sub(x[finder->heads[j]], x[finder->heads[i]], dx);
+            }
+            if (norm2(dx) < cutoff2) {
+                join(finder, i, j);
+            }
+        }
+    }
+}
+
+/** Position of a cluster along the normal, unwrapped around its first atom
+ */
+static real cluster_height(LeafletFinder *finder, int root, matrix box) {
+    int i, first = -1, count = 0;
+    int axis = finder->normal_axis;
+    real sum = 0, dx;
+    for (i = 0; i < finder->nheads; ++i) {
+        if (find_root(finder->parent, i) == root) {
+            if (first < 0) {
+                first = i;
+            }
+            dx = finder->pos[i][axis] - finder->pos[first][axis];
+            if (finder->ePBC == epbcXYZ) {
+                dx -= box[axis][axis] * floor(dx / box[axis][axis] + 0.5);
+            }
+            sum += dx;
+            count += 1;
+        }
+    }
+    return finder->pos[first][axis] + sum / count;
+}
+
+/** Detect the leaflets and build the set of the frame
+ *
+ * Return FALSE if two leaflets can not be found.
+ */
+static gmx_bool detect(LeafletFinder *finder, matrix box, rvec *x) {
+    LeafletSet *set;
+    int i, d, root, roots[2] = {-1, -1};
+    int votes[2][2] = {{0, 0}, {0, 0}};
+    gmx_bool bCells, bSwap;
+
+    bCells = (finder->ePBC == epbcXYZ && !TRICLINIC(box));
+    for (i = 0; i < finder->nheads; ++i) {
+        finder->parent[i] = i;
+        finder->size[i] = 1;
+        copy_rvec(x[finder->heads[i]], finder->pos[i]);
+        if (bCells) {
+            for (d = 0; d < DIM; ++d) {
+                finder->pos[i][d] -= box[d][d]
+                    * floor(finder->pos[i][d] / box[d][d]);
+            }
+        }
+    }
+    if (bCells) {
+        cluster_cells(finder, box);
+    }
+    else {
+        if (finder->ndetections == 0) {
+            fprintf(stderr, "The box is not rectangular and periodic in all "
+                    "dimensions: the leaflet detection looks at every pair "
+                    "of headgroups\n");
+        }
+        cluster_pairs(finder, box, x);
+    }
+
+    /* The two largest clusters are the leaflets */
+    for (i = 0; i < finder->nheads; ++i) {
+        if (finder->parent[i] != i) {
+            continue;
+        }
+        if (roots[0] < 0 || finder->size[i] > finder->size[roots[0]]) {
+            roots[1] = roots[0];
+            roots[0] = i;
+        }
+        else if (roots[1] < 0 || finder->size[i] > finder->size[roots[1]]) {
+            roots[1] = i;
+        }
+    }
+    if (roots[1] < 0
+            || finder->size[roots[1]] < LEAFLET_MIN_FRACTION * finder->nheads) {
+        return FALSE;
+    }
+
+    /* Keep the order of the previous detection; order the leaflets along
+     * the normal the first time */
+    if (finder->ndetections > 0) {
+        for (i = 0; i < finder->nheads; ++i) {
+            root = find_root(finder->parent, i);
+            if (finder->label[i] >= 0 && (root == roots[0]
+                        || root == roots[1])) {
+                votes[root == roots[1]][finder->label[i]] += 1;
+            }
+        }
+        bSwap = (votes[0][1] + votes[1][0] > votes[0][0] + votes[1][1]);
+    }
+    else {
+        bSwap = (cluster_height(finder, roots[0], box)
+                > cluster_height(finder, roots[1], box));
+    }
+    if (bSwap) {
+        root = roots[0];
+        roots[0] = roots[1];
+        roots[1] = root;
+    }
+
+    snew(set, 1);
+    set->refcount = 1;
+    set->bOwned = TRUE;
+    for (d = 0; d < 2; ++d) {
+        snew(set->index[d], finder->size[roots[d]]);
+        set->isize[d] = 0;
+    }
+    for (i = 0; i < finder->nheads; ++i) {
+        root = find_root(finder->parent, i);
+        finder->label[i] = (root == roots[0]) ? 0
+            : ((root == roots[1]) ? 1 : -1);
+        if (finder->label[i] >= 0) {
+            d = finder->label[i];
+            set->index[d][set->isize[d]] = finder->heads[i];
+            set->isize[d] += 1;
+        }
+    }
+    leaflet_set_release(finder->current);
+    finder->current = set;
+    finder->ndetections += 1;
+    return TRUE;
+}
+
+LeafletSet *leaflet_finder_update(LeafletFinder *finder, matrix box,
+        rvec *x) {
+    gmx_bool bDetect;
+    int d;
+
+    bDetect = (finder->current == NULL
+            || (finder->refresh > 0 && finder->age >= finder->refresh));
+    for (d = 0; d < DIM && !bDetect; ++d) {
+        bDetect = (fabs(box[d][d] - finder->box[d])
+                > LEAFLET_BOX_TOLERANCE * finder->box[d]);
+    }
+    if (bDetect) {
+        if (!detect(finder, box, x)) {
+            if (finder->current == NULL) {
+                gmx_fatal(FARGS, "Can not find two leaflets among the "
+                        "headgroups; try another cutoff\n");
+            }
+            fprintf(stderr, "\nCan not find two leaflets; keeping the "
+                    "previous assignment\n");
+        }
+        for (d = 0; d < DIM; ++d) {
+            finder->box[d] = box[d][d];
+        }
+        finder->age = 0;
+    }
+    finder->age += 1;
+    return leaflet_set_retain(finder->current);
+}
@@ -0,0 +1,78 @@
+#ifndef _leaflets_h
+#define _leaflets_h
+
+#include <gromacs/typedefs.h>
+
+/* Relative change of the box that triggers a new leaflet detection */
+#define LEAFLET_BOX_TOLERANCE 0.05
+
+/** Atoms of the two leaflets for one or more frames
+ *
+ * A set is shared by all the frames analysed between two leaflet detections.
+ * It is reference counted so that frames still waiting in the queue of a
+ * worker thread keep their set alive after a new one was detected.
+ */
+typedef struct LeafletSet {
+    atom_id *index[2];
+    int isize[2];
+    int refcount;
+    gmx_bool bOwned;    /* The index arrays are freed with the set */
+} LeafletSet;
+
+/** Wrap groups selected by the user in a set; the arrays are not copied
+ * and stay owned by the caller
+ */
+LeafletSet *build_static_leaflets(atom_id **index, int *isize);
+
+LeafletSet *leaflet_set_retain(LeafletSet *set);
+
+/** Drop a reference to a set and free it with the last one
+ */
+void leaflet_set_release(LeafletSet *set);
+
+/** Assign headgroup atoms to leaflets
+ *
+ * The headgroups are clustered by single linkage: two headgroups within
+ * "cutoff" of each other are in the same leaflet. The two largest clusters
+ * are the leaflets; the other headgroups are ignored. The detection is only
+ * done every "refresh" frames, or when the box changes by more than
+ * LEAFLET_BOX_TOLERANCE; the previous assignment is used in between. The
+ * leaflets keep their order from one detection to the next. The headgroup
+ * index stays owned by the caller.
+ */
+typedef struct LeafletFinder {
+    atom_id *heads;
+    int nheads;
+    int normal_axis;
+    int ePBC;
+    real cutoff;
+    int refresh;
+    int age;            /* Frames since the last detection */
+    real box[DIM];      /* Box diagonal at the last detection */
+    LeafletSet *current;
+    int *label;         /* Leaflet of each headgroup, or -1 */
+    /* Work arrays of the clustering */
+    int *parent;
+    int *size;
+    int *cell_of;
+    int *cell_start;
+    int *cell_heads;
+    int cells_alloc;
+    rvec *pos;
+    int ndetections;
+} LeafletFinder;
+
+LeafletFinder *build_leaflet_finder(atom_id *heads, int nheads,
+        int normal_axis, int ePBC, real cutoff, int refresh);
+
+void clean_leaflet_finder(LeafletFinder *finder);
+
+/** Get the leaflets of a new frame, detecting them again if needed
+ *
+ * The caller gets a reference to the returned set and has to release it.
+ * Frames have to be given in trajectory order.
+ */
+LeafletSet *leaflet_finder_update(LeafletFinder *finder, matrix box,
+        rvec *x);
+
+#endif /* _leaflets_h */
@@ -1,8 +1,28 @@
+#include <stdlib.h>
+
+#include <gromacs/gmx_fatal.h>
+
 #include "matrix.h"
 
+/** Allocate an aligned buffer
+ */
+static void *aligned_buffer(size_t size) {
+    void *buffer = NULL;
+    if (size == 0) {
+        size = MATRIX_ALIGN;
+    }
+    if (posix_memalign(&buffer, MATRIX_ALIGN, size) != 0) {
+        gmx_fatal(FARGS, "Not enough memory to allocate a %lu bytes matrix\n",
+                (unsigned long)size);
+    }
+    return buffer;
+}
+
 /** Create a matrix of real numbers
  *
- * The matrix is pre-filled with a value.
+ * The matrix is stored row-major in a single contiguous and aligned buffer;
+ * the cell (i, j) is at index i * d2 + j. The matrix is pre-filled with a
+ * value.
  *
  * Parameters:
  *  - d1: number of rows
@@ -12,16 +32,13 @@
  * Return:
  *  The filled matrix.
  */
-real **realMatrix(int d1, int d2, real defval) {
-    int i, j;
-    real **mat;
+real *realMatrix(int d1, int d2, real defval) {
+    int i;
+    real *mat;
   
-    smalloc(mat, d1 * sizeof(real*));
-    for(i = 0; i < d1; i++){
-        smalloc(mat[i], d2 * sizeof(real));
-        for(j = 0; j < d2; j++) {
-            mat[i][j] = defval;
-        }
+    mat = aligned_buffer((size_t)d1 * d2 * sizeof(real));
+    for(i = 0; i < d1 * d2; i++){
+        mat[i] = defval;
     }
     return mat;
 }
@@ -30,19 +47,16 @@ real **realMatrix(int d1, int d2, real defval) {
  *
  * Parameters:
  *  - mat: the matrix to destroy
- *  - d1: the number of rows in the matrix
  */
-void deleteRealMat(real **mat, int d1) {
-    int i;
-    for(i = 0; i < d1; i++) {
-        sfree(mat[i]);
-    }
-    sfree(mat);
+void deleteRealMat(real *mat) {
+    free(mat);
 }
 
 /** Create a matrix of integer
  *
- * The matrix is pre-filled with a value.
+ * The matrix is stored row-major in a single contiguous and aligned buffer;
+ * the cell (i, j) is at index i * d2 + j. The matrix is pre-filled with a
+ * value.
  *
  * Parameters:
  *  - d1: number of rows
@@ -52,16 +66,13 @@ void deleteRealMat(real **mat, int d1) {
  * Return:
  *  The filled matrix.
  */
-int **intMatrix(int d1, int d2, int defval) {
-    int i, j;
-    int **mat;
+int *intMatrix(int d1, int d2, int defval) {
+    int i;
+    int *mat;
   
-    smalloc(mat, d1 * sizeof(int*));
-    for(i = 0; i < d1; i++){
-        smalloc(mat[i], d2 * sizeof(real));
-        for(j = 0; j < d2; j++) {
-            mat[i][j] = defval;
-        }
+    mat = aligned_buffer((size_t)d1 * d2 * sizeof(int));
+    for(i = 0; i < d1 * d2; i++){
+        mat[i] = defval;
     }
     return mat;
 }
@@ -70,14 +81,7 @@ int **intMatrix(int d1, int d2, int defval) {
  *
  * Parameters:
  *  - mat: the matrix to destroy
- *  - d1: the number of rows in the matrix
  */
-void deleteIntMat(int **mat, int d1) {
-    int i;
-    for(i = 0; i < d1; i++) {
-        sfree(mat[i]);
-    }
-    sfree(mat);
+void deleteIntMat(int *mat) {
+    free(mat);
 }
-
-
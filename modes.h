@@ -0,0 +1,72 @@
+#ifndef _modes_h
+#define _modes_h
+
+#include <gromacs/typedefs.h>
+#include <gromacs/rmpbc.h>
+
+#include "grid_mode.h"
+#include "dist_mode.h"
+#include "leaflets.h"
+
+typedef struct GeneralData {
+    int ngrps;
+    atom_id **index;
+    int *isize;
+    const char *traj_fn;
+    /* Stream to read the frames from instead of traj_fn, or NULL; - is the
+     * standard input */
+    const char *stream_fn;
+    int stream_format;
+    /* Rewrite the outputs every this number of frames, or never if 0 */
+    int nflush;
+    /* Selection cache to read the frames from or to write, or NULL */
+    const char *cache_fn;
+    struct SelectionCache *cache;
+    /* Least common multiple of the positive -adt of the analyses; frames
+     * are handed to the workers and split in chunks by batches of this
+     * size so that no window is cut */
+    int batch;
+    /* One of the analyses averages over the whole trajectory */
+    gmx_bool bWholeTraj;
+    int nthreads;
+    /* Threads decoding the XTC frames; the frames are decoded by the
+     * reading thread if lesser than 2 */
+    int ndecoders;
+    gmx_bool bRmPBC;
+    /* The frames already hold whole molecules, like the ones of a selection
+     * cache; they are not made whole again */
+    gmx_bool bWhole;
+    int chunk;
+    int nchunks;
+    /* Accumulator files to merge instead of reading a trajectory */
+    char **merge_fns;
+    int nmerge;
+    /* Where to write the accumulators, or NULL */
+    const char *acc_fn;
+    /* Where to write the JSON report of the run, or NULL */
+    const char *report_fn;
+    /* Leaflets selected by the user, or detected from the headgroups */
+    LeafletSet *leaflets;
+    LeafletFinder *finder;
+} GeneralData;
+
+/** Analyses run on the same frames
+ *
+ * Every grid and distance analysis has its own resolution, -adt and
+ * reference group. The frames are read, and their PBC handled, once for all
+ * of them.
+ */
+typedef struct t_modes {
+    GridHeight **grids;
+    int ngrids;
+    DistMode **dists;
+    int ndists;
+    GeneralData *general;
+} t_modes;
+
+LeafletSet *frame_leaflets(GeneralData *general, matrix box, rvec *x);
+
+void do_frame(t_modes modes, LeafletSet *leaflets, t_pbc *pbc, int ePBC,
+        matrix box, rvec *x, gmx_rmpbc_t gpbc, int natoms, t_topology *top);
+
+#endif /* _modes_h */
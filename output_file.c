@@ -0,0 +1,30 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gromacs/futil.h>
+#include <gromacs/gmx_fatal.h>
+
+#include "output_file.h"
+
+void rewind_output(FILE *out, gmx_off_t position) {
+    if (out && position >= 0) {
+        gmx_fseek(out, position, SEEK_SET);
+    }
+}
+
+void truncate_output(FILE *out) {
+    struct stat out_stat;
+    gmx_off_t size;
+    if (out) {
+        fflush(out);
+        /* Devices and pipes, like /dev/null, can not be truncated */
+        if (fstat(fileno(out), &out_stat) != 0
+                || !S_ISREG(out_stat.st_mode)) {
+            return;
+        }
+        size = gmx_ftell(out);
+        if (size >= 0 && ftruncate(fileno(out), size) != 0) {
+            gmx_warning("Can not truncate an output file");
+        }
+    }
+}
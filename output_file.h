@@ -0,0 +1,22 @@
+#ifndef _output_file_h
+#define _output_file_h
+
+#include <stdio.h>
+
+#include <gromacs/typedefs.h>
+
+/** Go back to a position of an output file, to write what follows again
+ *
+ * Nothing is done if "position" is negative, which is what gmx_ftell gives
+ * for a pipe.
+ */
+void rewind_output(FILE *out, gmx_off_t position);
+
+/** Drop what is left of a previous version of an output file after the
+ * current position, and make the new version visible to the readers
+ *
+ * Only regular files are truncated; other outputs are only flushed.
+ */
+void truncate_output(FILE *out);
+
+#endif /* _output_file_h */
@@ -0,0 +1,328 @@
+#include <pthread.h>
+#include <string.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/rmpbc.h>
+#include <gromacs/smalloc.h>
+
+#include "pipeline.h"
+#include "run_stats.h"
+#include "traj_reader.h"
+
+/* Number of frames that can wait in the queue of each worker */
+#define QUEUE_DEPTH 2
+
+typedef struct FrameSlot {
+    rvec *x;
+    matrix box;
+    int frame;
+    LeafletSet *leaflets;
+} FrameSlot;
+
+struct Pipeline;
+
+typedef struct Worker {
+    pthread_t thread;
+    struct Pipeline *pipe;
+    /* Private mode objects; the windows they close are kept until the end
+     * of the batch */
+    t_modes modes;
+    GeneralData general;
+    t_pbc *pbc;
+    gmx_rmpbc_t gpbc;
+    /* Ring of frames waiting to be analysed */
+    FrameSlot slots[QUEUE_DEPTH];
+    int head;
+    int count;
+    gmx_bool bDone;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Worker;
+
+typedef struct Pipeline {
+    t_modes modes;
+    t_topology *top;
+    int ePBC;
+    int natoms;
+    /* Frames handed to the same worker in a row; a whole number of windows
+     * of every analysis */
+    int batch;
+    /* Some analysis closes -adt windows, so the batches have to be folded
+     * in order */
+    gmx_bool bOrdered;
+    int nworkers;
+    Worker *workers;
+    /* Batches are folded in the main mode objects in trajectory order */
+    int next_batch;
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_cond;
+} Pipeline;
+
+/** Fold the windows closed by a worker in a batch into the main mode
+ * objects
+ */
+static void commit_windows(Pipeline *pipe, Worker *worker) {
+    int i;
+    for (i = 0; i < pipe->modes.ngrids; ++i) {
+        grid_commit_windows(pipe->modes.grids[i], worker->modes.grids[i]);
+    }
+    for (i = 0; i < pipe->modes.ndists; ++i) {
+        dist_commit_windows(pipe->modes.dists[i], worker->modes.dists[i]);
+    }
+}
+
+/** Fold a finished batch of a worker into the main mode objects
+ *
+ * Wait for the previous batches to be folded first so the floating point
+ * sums are done in the same order as in a serial run.
+ */
+static void commit_batch(Worker *worker, int batch) {
+    Pipeline *pipe = worker->pipe;
+    StageTimer timer;
+    pthread_mutex_lock(&pipe->commit_lock);
+    while (pipe->next_batch != batch) {
+        pthread_cond_wait(&pipe->commit_cond, &pipe->commit_lock);
+    }
+    stats_start(&timer);
+    commit_windows(pipe, worker);
+    stats_stop(STAGE_WINDOW, &timer);
+    pipe->next_batch += 1;
+    pthread_cond_broadcast(&pipe->commit_cond);
+    pthread_mutex_unlock(&pipe->commit_lock);
+}
+
+static void *worker_loop(void *arg) {
+    Worker *worker = (Worker *)arg;
+    Pipeline *pipe = worker->pipe;
+    FrameSlot *slot;
+    while (TRUE) {
+        /* Wait for a frame */
+        pthread_mutex_lock(&worker->lock);
+        while (worker->count == 0 && !worker->bDone) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        if (worker->count == 0) {
+            pthread_mutex_unlock(&worker->lock);
+            break;
+        }
+        slot = &worker->slots[worker->head];
+        pthread_mutex_unlock(&worker->lock);
+
+        do_frame(worker->modes, slot->leaflets, worker->pbc, pipe->ePBC,
+                slot->box, slot->x, worker->gpbc, pipe->natoms, pipe->top);
+        leaflet_set_release(slot->leaflets);
+        if (pipe->bOrdered && (slot->frame + 1) % pipe->batch == 0) {
+            commit_batch(worker, slot->frame / pipe->batch);
+        }
+
+        /* Give the slot back to the reader */
+        pthread_mutex_lock(&worker->lock);
+        worker->head = (worker->head + 1) % QUEUE_DEPTH;
+        worker->count -= 1;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    return NULL;
+}
+
+/** Wait for a free slot in the queue of a worker
+ */
+static FrameSlot *acquire_slot(Worker *worker) {
+    FrameSlot *slot;
+    pthread_mutex_lock(&worker->lock);
+    while (worker->count == QUEUE_DEPTH) {
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    slot = &worker->slots[(worker->head + worker->count) % QUEUE_DEPTH];
+    pthread_mutex_unlock(&worker->lock);
+    return slot;
+}
+
+/** Hand a filled slot to a worker
+ */
+static void publish_slot(Worker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->count += 1;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void init_worker(Worker *worker, Pipeline *pipe, matrix box) {
+    t_modes *modes = &(pipe->modes);
+    int i;
+    worker->pipe = pipe;
+    worker->general = *(modes->general);
+    worker->modes.general = &(worker->general);
+    worker->modes.ngrids = modes->ngrids;
+    snew(worker->modes.grids, modes->ngrids);
+    for (i = 0; i < modes->ngrids; ++i) {
+        worker->modes.grids[i] = grid_worker_copy(modes->grids[i]);
+    }
+    worker->modes.ndists = modes->ndists;
+    snew(worker->modes.dists, modes->ndists);
+    for (i = 0; i < modes->ndists; ++i) {
+        worker->modes.dists[i] = dist_worker_copy(modes->dists[i]);
+    }
+    if (pipe->ePBC != epbcNONE) {
+        snew(worker->pbc, 1);
+    }
+    else {
+        worker->pbc = NULL;
+    }
+    worker->gpbc = NULL;
+    if (worker->general.bRmPBC && !worker->general.bWhole) {
+        worker->gpbc = gmx_rmpbc_init(&pipe->top->idef, pipe->ePBC,
+                pipe->natoms, box);
+    }
+    for (i = 0; i < QUEUE_DEPTH; ++i) {
+        snew(worker->slots[i].x, pipe->natoms);
+    }
+    worker->head = 0;
+    worker->count = 0;
+    worker->bDone = FALSE;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+}
+
+static void done_worker(Worker *worker) {
+    int i;
+    for (i = 0; i < QUEUE_DEPTH; ++i) {
+        sfree(worker->slots[i].x);
+    }
+    if (worker->gpbc) {
+        gmx_rmpbc_done(worker->gpbc);
+    }
+    sfree(worker->pbc);
+    for (i = 0; i < worker->modes.ngrids; ++i) {
+        clean_grids(worker->modes.grids[i]);
+    }
+    for (i = 0; i < worker->modes.ndists; ++i) {
+        clean_dist(worker->modes.dists[i]);
+    }
+    sfree(worker->modes.grids);
+    sfree(worker->modes.dists);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->cond);
+}
+
+/** Tell whether some analysis closes windows during the run
+ */
+static gmx_bool has_windows(t_modes *modes) {
+    int i;
+    for (i = 0; i < modes->ngrids; ++i) {
+        if (modes->grids[i] && modes->grids[i]->adt > 0) {
+            return TRUE;
+        }
+    }
+    for (i = 0; i < modes->ndists; ++i) {
+        if (modes->dists[i] && modes->dists[i]->adt > 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void read_traj_threaded(t_modes modes, output_env_t oenv, t_topology *top,
+        int ePBC) {
+    Pipeline pipe;
+    Worker *worker;
+    FrameSlot *slot;
+    TrajReader *reader;
+    real time;
+    rvec *x;
+    matrix box;
+    int frame, w, i;
+    StageTimer timer;
+    gmx_bool bRead;
+
+    pipe.modes = modes;
+    pipe.top = top;
+    pipe.ePBC = ePBC;
+    pipe.next_batch = 0;
+    /* The analyses over the whole trajectory keep their window open in
+     * every worker until the end; without any -adt window, the frames are
+     * dealt one by one and nothing is folded before the end */
+    pipe.batch = modes.general->batch;
+    pipe.bOrdered = has_windows(&modes);
+    pipe.nworkers = modes.general->nthreads;
+    pthread_mutex_init(&pipe.commit_lock, NULL);
+    pthread_cond_init(&pipe.commit_cond, NULL);
+
+    /* Read the first frame to get basic informations about the system */
+    stats_start(&timer);
+    reader = open_traj_reader(modes.general, oenv, &time, &x, box);
+    stats_stop(STAGE_READ, &timer);
+    pipe.natoms = reader->natoms;
+    snew(pipe.workers, pipe.nworkers);
+    for (w = 0; w < pipe.nworkers; ++w) {
+        init_worker(&pipe.workers[w], &pipe, box);
+    }
+    for (w = 0; w < pipe.nworkers; ++w) {
+        if (pthread_create(&pipe.workers[w].thread, NULL, worker_loop,
+                    &pipe.workers[w])) {
+            gmx_fatal(FARGS, "Can not start worker thread %d\n", w);
+        }
+    }
+    fprintf(stderr, "Analysing frames on %d worker thread(s)\n",
+            pipe.nworkers);
+
+    /* Read the trajectory and dispatch the frames by batch */
+    frame = 0;
+    worker = &pipe.workers[0];
+    slot = acquire_slot(worker);
+    memcpy(slot->x, x, pipe.natoms * sizeof(rvec));
+    do {
+        copy_mat(box, slot->box);
+        slot->frame = frame;
+        /* Leaflets are detected in trajectory order */
+        slot->leaflets = frame_leaflets(modes.general, box, slot->x);
+        /* The frame count and box widths are accumulated in frame order */
+        for (i = 0; i < modes.ngrids; ++i) {
+            grid_count_frame(modes.grids[i], box);
+        }
+        for (i = 0; i < modes.ndists; ++i) {
+            dist_count_frame(modes.dists[i], box);
+        }
+        publish_slot(worker);
+        frame += 1;
+        worker = &pipe.workers[(frame / pipe.batch) % pipe.nworkers];
+        slot = acquire_slot(worker);
+        stats_start(&timer);
+        bRead = traj_reader_next(reader, &time, slot->x, box);
+        stats_stop(STAGE_READ, &timer);
+    } while (bRead);
+    close_traj_reader(reader);
+    sfree(x);
+
+    /* Wait for the workers to finish */
+    for (w = 0; w < pipe.nworkers; ++w) {
+        worker = &pipe.workers[w];
+        pthread_mutex_lock(&worker->lock);
+        worker->bDone = TRUE;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    for (w = 0; w < pipe.nworkers; ++w) {
+        pthread_join(pipe.workers[w].thread, NULL);
+    }
+
+    /* Only the worker of the last, unfinished, batch still holds closed
+     * windows; they are folded, then the unfinished windows of every worker
+     * are added to the main mode objects. The whole trajectory windows are
+     * thus summed worker by worker */
+    for (w = 0; w < pipe.nworkers; ++w) {
+        worker = &pipe.workers[w];
+        commit_windows(&pipe, worker);
+        for (i = 0; i < modes.ngrids; ++i) {
+            grid_reduce_fields(modes.grids[i], worker->modes.grids[i]);
+        }
+        for (i = 0; i < modes.ndists; ++i) {
+            dist_reduce_fields(modes.dists[i], worker->modes.dists[i]);
+        }
+        done_worker(worker);
+    }
+    sfree(pipe.workers);
+    pthread_mutex_destroy(&pipe.commit_lock);
+    pthread_cond_destroy(&pipe.commit_cond);
+}
@@ -0,0 +1,22 @@
+#ifndef _pipeline_h
+#define _pipeline_h
+
+#include <gromacs/statutil.h>
+#include <gromacs/typedefs.h>
+
+#include "modes.h"
+
+/** Read the trajectory on the calling thread and analyse the frames on
+ * modes.general->nthreads worker threads
+ *
+ * Each worker accumulates batches of whole -adt windows in private copies
+ * of the mode objects. The batches are folded into the main mode objects in
+ * trajectory order so the results are the same as the ones of read_traj.
+ * The analyses without -adt windows keep one open window per worker; these
+ * are added together at the end, so their sums may differ from the ones of
+ * read_traj by rounding.
+ */
+void read_traj_threaded(t_modes modes, output_env_t oenv, t_topology *top,
+        int ePBC);
+
+#endif /* _pipeline_h */
@@ -0,0 +1,206 @@
+#include <string.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+
+#include "replicas.h"
+#include "run_stats.h"
+#include "traj_reader.h"
+
+/** Build the name of the output of a replica: "grid.dat" gives "grid3.dat"
+ * for the replica 3
+ */
+static char *replica_name(const char *fn, int replica) {
+    const char *ext;
+    char *name;
+    char number[16];
+    size_t base;
+    if (!fn) {
+        return NULL;
+    }
+    ext = strrchr(fn, '.');
+    if (!ext || strchr(ext, '/')) {
+        ext = fn + strlen(fn);
+    }
+    base = ext - fn;
+    sprintf(number, "%d", replica);
+    snew(name, strlen(fn) + strlen(number) + 1);
+    memcpy(name, fn, base);
+    strcpy(name + base, number);
+    strcat(name, ext);
+    return name;
+}
+
+ReplicaSet *build_replicas(Thickness *th, AnalysisSpec *specs, int nspecs,
+        char **traj_fns, int nreplicas, int nthreads) {
+    ReplicaSet *set;
+    int i;
+
+    snew(set, 1);
+    set->combined = th;
+    set->specs = NULL;
+    set->nspecs = 0;
+    for (i = 0; i < nspecs; ++i) {
+        set->nspecs = add_analysis(&set->specs, set->nspecs, &specs[i]);
+    }
+    set->traj_fns = traj_fns;
+    set->nreplicas = nreplicas;
+    set->nthreads = min(max(nthreads, 1), nreplicas);
+    set->oenv = NULL;
+    set->next = 0;
+    set->next_commit = 0;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->cond, NULL);
+    return set;
+}
+
+/** Set up the analysis of a replica like the combined one, with its own
+ * output files
+ */
+static Thickness *build_replica(ReplicaSet *set, int replica) {
+    Thickness *combined = set->combined;
+    GeneralData *general = combined->modes.general;
+    Thickness *th;
+    AnalysisSpec spec;
+    DistMode *dist;
+    int ndists = 0;
+    int i;
+
+    th = thickness_create(combined->top, combined->ePBC, set->oenv);
+    thickness_set_rmpbc(th, general->bRmPBC);
+    if (general->finder) {
+        thickness_detect_leaflets(th, general->index[0], general->isize[0],
+                general->finder->normal_axis, general->finder->cutoff,
+                general->finder->refresh);
+    }
+    else {
+        thickness_set_leaflets(th, general->index, general->isize);
+    }
+    for (i = 0; i < set->nspecs; ++i) {
+        spec = set->specs[i];
+        spec.out_fn = replica_name(set->specs[i].out_fn, replica);
+        spec.sampling_fn = replica_name(set->specs[i].sampling_fn, replica);
+        spec.error_fn = replica_name(set->specs[i].error_fn, replica);
+        spec.windows_fn = replica_name(set->specs[i].windows_fn, replica);
+        if (spec.bGrid) {
+            thickness_add_analysis(th, &spec, NULL, 0);
+        }
+        else {
+            /* The reference group was selected once for all the replicas */
+            dist = combined->modes.dists[ndists++];
+            thickness_add_analysis(th, &spec, dist->ref_index,
+                    dist->ref_size);
+        }
+        sfree(spec.out_fn);
+        sfree(spec.sampling_fn);
+        sfree(spec.error_fn);
+        sfree(spec.windows_fn);
+    }
+    th->modes.general->traj_fn = set->traj_fns[replica];
+    return th;
+}
+
+/** Add the sums of a replica to the combined analysis
+ *
+ * Wait for the previous replicas to be added first so the floating point
+ * sums do not depend on which thread finished first.
+ */
+static void commit_replica(ReplicaSet *set, Thickness *th, int replica) {
+    t_modes *modes = &(set->combined->modes);
+    StageTimer timer;
+    int i;
+    pthread_mutex_lock(&set->lock);
+    while (set->next_commit != replica) {
+        pthread_cond_wait(&set->cond, &set->lock);
+    }
+    stats_start(&timer);
+    for (i = 0; i < modes->ngrids; ++i) {
+        grid_add(modes->grids[i], th->modes.grids[i]);
+    }
+    for (i = 0; i < modes->ndists; ++i) {
+        dist_add(modes->dists[i], th->modes.dists[i]);
+    }
+    stats_stop(STAGE_WINDOW, &timer);
+    set->next_commit += 1;
+    pthread_cond_broadcast(&set->cond);
+    pthread_mutex_unlock(&set->lock);
+}
+
+/** Read a replica and analyse its frames on the calling thread
+ */
+static void read_replica(ReplicaSet *set, int replica) {
+    Thickness *th;
+    TrajReader *reader;
+    real time;
+    rvec *x;
+    matrix box;
+    StageTimer timer;
+    gmx_bool bRead;
+
+    th = build_replica(set, replica);
+    stats_start(&timer);
+    reader = open_traj_reader(th->modes.general, set->oenv, &time, &x, box);
+    stats_stop(STAGE_READ, &timer);
+    do {
+        thickness_feed_frame(th, reader->natoms, x, box);
+        stats_start(&timer);
+        bRead = traj_reader_next(reader, &time, x, box);
+        stats_stop(STAGE_READ, &timer);
+    } while (bRead);
+    close_traj_reader(reader);
+    sfree(x);
+
+    /* The sums have to be added before the last window is closed */
+    commit_replica(set, th, replica);
+    stats_start(&timer);
+    thickness_end(th);
+    thickness_destroy(th);
+    stats_stop(STAGE_OUTPUT, &timer);
+    fprintf(stderr, "Replica %d done (%s)\n", replica,
+            set->traj_fns[replica]);
+}
+
+static void *replica_loop(void *arg) {
+    ReplicaSet *set = (ReplicaSet *)arg;
+    int replica;
+    while (TRUE) {
+        pthread_mutex_lock(&set->lock);
+        replica = set->next++;
+        pthread_mutex_unlock(&set->lock);
+        if (replica >= set->nreplicas) {
+            break;
+        }
+        read_replica(set, replica);
+    }
+    return NULL;
+}
+
+void read_replicas(ReplicaSet *set, output_env_t oenv) {
+    pthread_t *threads;
+    int t;
+
+    set->oenv = oenv;
+    fprintf(stderr, "Analysing %d replicas on %d thread(s)\n",
+            set->nreplicas, set->nthreads);
+    /* The calling thread reads replicas too */
+    snew(threads, set->nthreads);
+    for (t = 1; t < set->nthreads; ++t) {
+        if (pthread_create(&threads[t], NULL, replica_loop, set)) {
+            gmx_fatal(FARGS, "Can not start replica thread %d\n", t);
+        }
+    }
+    replica_loop(set);
+    for (t = 1; t < set->nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    sfree(threads);
+}
+
+void clean_replicas(ReplicaSet *set) {
+    if (set) {
+        clean_analysis_specs(set->specs, set->nspecs);
+        pthread_mutex_destroy(&set->lock);
+        pthread_cond_destroy(&set->cond);
+        sfree(set);
+    }
+}
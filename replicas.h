@@ -0,0 +1,51 @@
+#ifndef _replicas_h
+#define _replicas_h
+
+#include <pthread.h>
+
+#include <gromacs/statutil.h>
+#include <gromacs/typedefs.h>
+
+#include "analyses.h"
+#include "thickness.h"
+
+/** Replicas of the same system, analysed with the same topology, groups and
+ * analyses
+ *
+ * Each replica is analysed on its own by one of the threads, and writes its
+ * own outputs; the name of the file is numbered like with mdrun -multi:
+ * "grid.dat" gives "grid0.dat" for the first replica. Once a replica is
+ * read, its sums are added to the combined analysis, in the order of the
+ * replicas, so the combined outputs are the ones of merging the
+ * accumulator files of the replicas.
+ */
+typedef struct ReplicaSet {
+    Thickness *combined;    /* Not owned */
+    AnalysisSpec *specs;    /* Analyses of the combined outputs */
+    int nspecs;
+    char **traj_fns;        /* Not owned */
+    int nreplicas;
+    int nthreads;
+    output_env_t oenv;
+    /* Next replica to read, and next one to add to the combined analysis */
+    int next;
+    int next_commit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ReplicaSet;
+
+/** Prepare the analysis of replicas; the analyses are copied
+ *
+ * The analyses of "th" have to be added already; the replicas use the
+ * same leaflets and reference groups.
+ */
+ReplicaSet *build_replicas(Thickness *th, AnalysisSpec *specs, int nspecs,
+        char **traj_fns, int nreplicas, int nthreads);
+
+/** Analyse all the replicas and add them to the combined analysis
+ */
+void read_replicas(ReplicaSet *set, output_env_t oenv);
+
+void clean_replicas(ReplicaSet *set);
+
+#endif /* _replicas_h */
@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <gromacs/futil.h>
+#include <gromacs/smalloc.h>
+
+#include "run_stats.h"
+
+static const char *stage_names[STAGE_NR] = {
+    "read", "rmpbc", "reference", "grid", "dist", "window", "output"
+};
+
+static const char *counter_names[COUNTER_NR] = {
+    "frames", "grid_atoms", "dist_atoms", "cells_touched", "out_of_range_bins"
+};
+
+static const char *counter_labels[COUNTER_NR] = {
+    "Analysed frames", "Atoms binned on the grid", "Atoms binned by distance",
+    "Cells swept by window closes", "Atoms beyond the last distance bin"
+};
+
+typedef struct ThreadStats {
+    double wall[STAGE_NR];
+    double cpu[STAGE_NR];
+    gmx_large_int_t counters[COUNTER_NR];
+    struct ThreadStats *next;
+} ThreadStats;
+
+/* Blocks of all the threads that recorded something; they are kept after
+ * the threads exit so they can be summed at the end */
+static ThreadStats *all_stats = NULL;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadStats *thread_stats = NULL;
+static double start_wall = 0;
+
+static double read_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+static ThreadStats *get_thread_stats(void) {
+    if (!thread_stats) {
+        snew(thread_stats, 1);
+        pthread_mutex_lock(&all_stats_lock);
+        thread_stats->next = all_stats;
+        all_stats = thread_stats;
+        pthread_mutex_unlock(&all_stats_lock);
+    }
+    return thread_stats;
+}
+
+void stats_init(void) {
+    start_wall = read_clock(CLOCK_MONOTONIC);
+}
+
+void stats_start(StageTimer *timer) {
+    timer->wall = read_clock(CLOCK_MONOTONIC);
+    timer->cpu = read_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stats_stop(int stage, StageTimer *timer) {
+    ThreadStats *stats = get_thread_stats();
+    stats->wall[stage] += read_clock(CLOCK_MONOTONIC) - timer->wall;
+    stats->cpu[stage] += read_clock(CLOCK_THREAD_CPUTIME_ID) - timer->cpu;
+}
+
+void stats_count(int counter, gmx_large_int_t n) {
+    get_thread_stats()->counters[counter] += n;
+}
+
+/** Sum the blocks of all the threads
+ */
+static void sum_stats(ThreadStats *total) {
+    ThreadStats *stats;
+    int i;
+    for (i = 0; i < STAGE_NR; ++i) {
+        total->wall[i] = 0;
+        total->cpu[i] = 0;
+    }
+    for (i = 0; i < COUNTER_NR; ++i) {
+        total->counters[i] = 0;
+    }
+    pthread_mutex_lock(&all_stats_lock);
+    for (stats = all_stats; stats; stats = stats->next) {
+        for (i = 0; i < STAGE_NR; ++i) {
+            total->wall[i] += stats->wall[i];
+            total->cpu[i] += stats->cpu[i];
+        }
+        for (i = 0; i < COUNTER_NR; ++i) {
+            total->counters[i] += stats->counters[i];
+        }
+    }
+    pthread_mutex_unlock(&all_stats_lock);
+}
+
+/** Get the peak resident memory of the process in kB
+ */
+static long peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+void stats_print(FILE *out, int nthreads) {
+    ThreadStats total;
+    double wall, cpu;
+    int i;
+
+    sum_stats(&total);
+    wall = read_clock(CLOCK_MONOTONIC) - start_wall;
+    cpu = read_clock(CLOCK_PROCESS_CPUTIME_ID);
+    fprintf(out, "\nRun statistics (%d worker thread(s)):\n", nthreads);
+    fprintf(out, "  %-12s %12s %12s\n", "Stage", "Wall (s)", "CPU (s)");
+    for (i = 0; i < STAGE_NR; ++i) {
+        fprintf(out, "  %-12s %12.3f %12.3f\n", stage_names[i],
+                total.wall[i], total.cpu[i]);
+    }
+    fprintf(out, "  %-12s %12.3f %12.3f\n", "total", wall, cpu);
+    fprintf(out, "  Stage times are summed over the threads.\n");
+    for (i = 0; i < COUNTER_NR; ++i) {
+        fprintf(out, "  %-36s " gmx_large_int_pfmt "\n", counter_labels[i],
+                total.counters[i]);
+    }
+    if (wall > 0) {
+        fprintf(out, "  %-36s %.1f\n", "Frames per second",
+                total.counters[COUNTER_FRAMES] / wall);
+    }
+    fprintf(out, "  %-36s %.1f MB\n", "Peak memory", peak_rss() / 1024.0);
+}
+
+void stats_write_json(const char *fn, int nthreads) {
+    ThreadStats total;
+    FILE *out;
+    double wall, cpu;
+    int i;
+
+    sum_stats(&total);
+    wall = read_clock(CLOCK_MONOTONIC) - start_wall;
+    cpu = read_clock(CLOCK_PROCESS_CPUTIME_ID);
+    out = ffopen(fn, "w");
+    fprintf(out, "{\n");
+    fprintf(out, "  \"program\": \"g_thickness\",\n");
+    fprintf(out, "  \"threads\": %d,\n", nthreads);
+    fprintf(out, "  \"wall_time\": %.6f,\n", wall);
+    fprintf(out, "  \"cpu_time\": %.6f,\n", cpu);
+    fprintf(out, "  \"frames_per_second\": %.3f,\n",
+            (wall > 0) ? total.counters[COUNTER_FRAMES] / wall : 0.0);
+    fprintf(out, "  \"peak_rss_kb\": %ld,\n", peak_rss());
+    fprintf(out, "  \"stages\": {\n");
+    for (i = 0; i < STAGE_NR; ++i) {
+        fprintf(out, "    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}%s\n",
+                stage_names[i], total.wall[i], total.cpu[i],
+                (i < STAGE_NR - 1) ? "," : "");
+    }
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"counters\": {\n");
+    for (i = 0; i < COUNTER_NR; ++i) {
+        fprintf(out, "    \"%s\": " gmx_large_int_pfmt "%s\n",
+                counter_names[i], total.counters[i],
+                (i < COUNTER_NR - 1) ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    ffclose(out);
+}
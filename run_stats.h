@@ -0,0 +1,62 @@
+#ifndef _run_stats_h
+#define _run_stats_h
+
+#include <stdio.h>
+
+#include <gromacs/typedefs.h>
+
+/** Stages of the analysis that are timed
+ */
+enum {
+    STAGE_READ,         /* reading and decoding the frames */
+    STAGE_RMPBC,        /* making the molecules whole */
+    STAGE_REFERENCE,    /* center of mass or cell list of the reference */
+    STAGE_GRID,         /* binning the atoms on the grid */
+    STAGE_DIST,         /* binning the atoms by distance */
+    STAGE_WINDOW,       /* averaging the closed -adt windows */
+    STAGE_OUTPUT,       /* writing the results */
+    STAGE_NR
+};
+
+/** Counters of the analysis
+ */
+enum {
+    COUNTER_FRAMES,         /* analysed frames */
+    COUNTER_GRID_ATOMS,     /* atoms binned on the grid */
+    COUNTER_DIST_ATOMS,     /* atoms binned by distance */
+    COUNTER_CELLS,          /* cells and bins swept when closing windows */
+    COUNTER_OUT_OF_RANGE,   /* atoms beyond the last distance bin */
+    COUNTER_NR
+};
+
+/** Start of a timed section
+ */
+typedef struct StageTimer {
+    double wall;
+    double cpu;
+} StageTimer;
+
+/** Start the clock of the whole run
+ */
+void stats_init(void);
+
+void stats_start(StageTimer *timer);
+
+/** Add the time elapsed since stats_start to a stage
+ *
+ * Stages and counters are accumulated in a block private to the calling
+ * thread, so the calls never wait on a lock once the block is created.
+ */
+void stats_stop(int stage, StageTimer *timer);
+
+void stats_count(int counter, gmx_large_int_t n);
+
+/** Print a summary of the stages and counters of all the threads
+ */
+void stats_print(FILE *out, int nthreads);
+
+/** Write the summary as a JSON object
+ */
+void stats_write_json(const char *fn, int nthreads);
+
+#endif /* _run_stats_h */
@@ -0,0 +1,322 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <gromacs/futil.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/statutil.h>
+#include <gromacs/string2.h>
+
+#include "selection_cache.h"
+
+/* Offset of the frame count in the header */
+#define NFRAMES_OFFSET 32
+
+static int compare_atoms(const void *a, const void *b) {
+    atom_id first = *(const atom_id *)a;
+    atom_id second = *(const atom_id *)b;
+    return (first > second) - (first < second);
+}
+
+/** List, sorted and without duplicates, the atoms the analyses read
+ */
+static atom_id *needed_atoms(t_modes modes, int *nsel) {
+    GeneralData *general = modes.general;
+    atom_id *atoms = NULL;
+    int n = 0, unique = 0;
+    int g, i;
+
+    for (g = 0; g < general->ngrps; ++g) {
+        srenew(atoms, n + general->isize[g]);
+        memcpy(atoms + n, general->index[g],
+                general->isize[g] * sizeof(atom_id));
+        n += general->isize[g];
+    }
+    for (i = 0; i < modes.ndists; ++i) {
+        srenew(atoms, n + modes.dists[i]->ref_size);
+        memcpy(atoms + n, modes.dists[i]->ref_index,
+                modes.dists[i]->ref_size * sizeof(atom_id));
+        n += modes.dists[i]->ref_size;
+    }
+    if (n > 0) {
+        qsort(atoms, n, sizeof(atom_id), compare_atoms);
+    }
+    for (i = 0; i < n; ++i) {
+        if (unique == 0 || atoms[i] != atoms[unique - 1]) {
+            atoms[unique++] = atoms[i];
+        }
+    }
+    *nsel = unique;
+    return atoms;
+}
+
+/** Tell if all the atoms of "needed" are in "cached"; both are sorted
+ */
+static gmx_bool holds_atoms(atom_id *cached, int ncached, atom_id *needed,
+        int nneeded) {
+    int i, j = 0;
+    for (i = 0; i < nneeded; ++i) {
+        while (j < ncached && cached[j] < needed[i]) {
+            j += 1;
+        }
+        if (j == ncached || cached[j] != needed[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/** Read the header and the atom list of an existing cache
+ *
+ * Return FALSE if the cache was not written for the run described by
+ * "cache", or does not hold all the atoms of "needed".
+ */
+static gmx_bool read_header(SelectionCache *cache, atom_id *needed,
+        int nneeded) {
+    char header[SELECTION_CACHE_HEADER];
+    int32_t values[8];
+    int64_t stamps[2];
+    float time_values[3];
+    int32_t *atoms;
+    int i;
+
+    if (fread(header, 1, SELECTION_CACHE_HEADER, cache->file)
+            != SELECTION_CACHE_HEADER) {
+        return FALSE;
+    }
+    memcpy(values, header + 8, sizeof(values));
+    memcpy(stamps, header + 40, sizeof(stamps));
+    memcpy(time_values, header + 56, sizeof(time_values));
+    if (strncmp(header, "GTHKSELC", 8) != 0 || values[0] != 2
+            || values[1] != 0x01020304 || values[2] != sizeof(real)
+            || values[4] < 0 || values[6] < 0
+            || values[5] != cache->bWhole
+            || values[7] != cache->time_flags
+            || stamps[0] != (int64_t)cache->traj_size
+            || stamps[1] != (int64_t)cache->traj_mtime) {
+        return FALSE;
+    }
+    for (i = 0; i < 3; ++i) {
+        if ((cache->time_flags & (1 << i))
+                && time_values[i] != cache->time_values[i]) {
+            return FALSE;
+        }
+    }
+    cache->natoms = values[3];
+    cache->nsel = values[4];
+    cache->nframes = values[6];
+    snew(atoms, max(cache->nsel, 1));
+    if (fread(atoms, sizeof(int32_t), cache->nsel, cache->file)
+            != (size_t)cache->nsel) {
+        sfree(atoms);
+        return FALSE;
+    }
+    snew(cache->atoms, max(cache->nsel, 1));
+    for (i = 0; i < cache->nsel; ++i) {
+        cache->atoms[i] = atoms[i];
+    }
+    sfree(atoms);
+    return holds_atoms(cache->atoms, cache->nsel, needed, nneeded)
+        && (nneeded == 0 || needed[nneeded - 1] < cache->natoms);
+}
+
+/** Write the header and the atom list, once the size of the frames is known
+ */
+static void write_header(SelectionCache *cache) {
+    char header[SELECTION_CACHE_HEADER];
+    int32_t values[8];
+    int64_t stamps[2];
+    int32_t *atoms;
+    int i;
+
+    values[0] = 2;
+    values[1] = 0x01020304;
+    values[2] = sizeof(real);
+    values[3] = cache->natoms;
+    values[4] = cache->nsel;
+    values[5] = cache->bWhole;
+    values[6] = -1;
+    values[7] = cache->time_flags;
+    stamps[0] = cache->traj_size;
+    stamps[1] = cache->traj_mtime;
+    memset(header, 0, SELECTION_CACHE_HEADER);
+    memcpy(header, "GTHKSELC", 8);
+    memcpy(header + 8, values, sizeof(values));
+    memcpy(header + 40, stamps, sizeof(stamps));
+    memcpy(header + 56, cache->time_values, sizeof(cache->time_values));
+    snew(atoms, max(cache->nsel, 1));
+    for (i = 0; i < cache->nsel; ++i) {
+        atoms[i] = cache->atoms[i];
+    }
+    if (fwrite(header, 1, SELECTION_CACHE_HEADER, cache->file)
+                != SELECTION_CACHE_HEADER
+            || fwrite(atoms, sizeof(int32_t), cache->nsel, cache->file)
+                != (size_t)cache->nsel) {
+        gmx_fatal(FARGS, "Can not write %s\n", cache->fn);
+    }
+    sfree(atoms);
+}
+
+SelectionCache *open_selection_cache(const char *fn, const char *traj_fn,
+        t_modes modes, gmx_bool bCanWrite) {
+    SelectionCache *cache;
+    struct stat traj_stat;
+    atom_id *needed;
+    int nneeded;
+
+    if (stat(traj_fn, &traj_stat) != 0) {
+        gmx_fatal(FARGS, "Can not access %s\n", traj_fn);
+    }
+    snew(cache, 1);
+    cache->fn = gmx_strdup(fn);
+    cache->bWhole = modes.general->bRmPBC;
+    cache->traj_size = traj_stat.st_size;
+    cache->traj_mtime = traj_stat.st_mtime;
+    cache->time_flags = (bTimeSet(TBEGIN) ? 1 : 0)
+        | (bTimeSet(TEND) ? 2 : 0) | (bTimeSet(TDELTA) ? 4 : 0);
+    cache->time_values[0] = bTimeSet(TBEGIN) ? rTimeValue(TBEGIN) : 0;
+    cache->time_values[1] = bTimeSet(TEND) ? rTimeValue(TEND) : 0;
+    cache->time_values[2] = bTimeSet(TDELTA) ? rTimeValue(TDELTA) : 0;
+    cache->nframes = 0;
+    cache->next = 0;
+    needed = needed_atoms(modes, &nneeded);
+
+    cache->file = fopen(fn, "rb");
+    if (cache->file && read_header(cache, needed, nneeded)) {
+        sfree(needed);
+        cache->bWrite = FALSE;
+        snew(cache->buffer, 1 + DIM * DIM + DIM * max(cache->nsel, 1));
+        /* The molecules are already whole */
+        modes.general->bWhole = cache->bWhole;
+        fprintf(stderr, "Reading %d frames of %d atoms from the selection "
+                "cache %s\n", cache->nframes, cache->nsel, fn);
+        return cache;
+    }
+    if (cache->file) {
+        fclose(cache->file);
+    }
+    sfree(cache->atoms);
+    if (!bCanWrite) {
+        gmx_warning("The selection cache %s does not match this run; it "
+                "is only written by runs with -nt 1", fn);
+        sfree(needed);
+        sfree(cache->fn);
+        sfree(cache);
+        return NULL;
+    }
+    cache->bWrite = TRUE;
+    cache->atoms = needed;
+    cache->nsel = nneeded;
+    cache->natoms = 0;
+    snew(cache->buffer, 1 + DIM * DIM + DIM * max(cache->nsel, 1));
+    cache->file = ffopen(fn, "wb");
+    fprintf(stderr, "Writing the %d selected atoms to the selection cache "
+            "%s\n", cache->nsel, fn);
+    return cache;
+}
+
+/** Read a frame of the cache in "x"
+ */
+static gmx_bool read_frame(SelectionCache *cache, real *time, rvec *x,
+        matrix box) {
+    size_t size = 1 + DIM * DIM + DIM * cache->nsel;
+    real *buffer = cache->buffer;
+    int i, d;
+
+    if (cache->next >= cache->nframes) {
+        return FALSE;
+    }
+    if (fread(buffer, sizeof(real), size, cache->file) != size) {
+        gmx_fatal(FARGS, "Can not read frame %d of %s\n", cache->next,
+                cache->fn);
+    }
+    *time = buffer[0];
+    for (i = 0; i < DIM; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            box[i][d] = buffer[1 + i * DIM + d];
+        }
+    }
+    buffer += 1 + DIM * DIM;
+    for (i = 0; i < cache->nsel; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            x[cache->atoms[i]][d] = buffer[i * DIM + d];
+        }
+    }
+    cache->next += 1;
+    return TRUE;
+}
+
+int selection_cache_first(SelectionCache *cache, real *time, rvec **x,
+        matrix box) {
+    snew(*x, max(cache->natoms, 1));
+    if (!read_frame(cache, time, *x, box)) {
+        gmx_fatal(FARGS, "The selection cache %s does not hold any frame\n",
+                cache->fn);
+    }
+    return cache->natoms;
+}
+
+gmx_bool selection_cache_next(SelectionCache *cache, real *time, rvec *x,
+        matrix box) {
+    return read_frame(cache, time, x, box);
+}
+
+void selection_cache_add(SelectionCache *cache, real time, int natoms,
+        rvec *x, matrix box) {
+    size_t size = 1 + DIM * DIM + DIM * cache->nsel;
+    real *buffer = cache->buffer;
+    int i, d;
+
+    if (cache->nframes == 0) {
+        if (cache->nsel > 0 && cache->atoms[cache->nsel - 1] >= natoms) {
+            gmx_fatal(FARGS, "The groups hold atoms beyond the %d atoms of "
+                    "the frames\n", natoms);
+        }
+        cache->natoms = natoms;
+        write_header(cache);
+    }
+    buffer[0] = time;
+    for (i = 0; i < DIM; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            buffer[1 + i * DIM + d] = box[i][d];
+        }
+    }
+    buffer += 1 + DIM * DIM;
+    for (i = 0; i < cache->nsel; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            buffer[i * DIM + d] = x[cache->atoms[i]][d];
+        }
+    }
+    if (fwrite(cache->buffer, sizeof(real), size, cache->file) != size) {
+        gmx_fatal(FARGS, "Can not write %s\n", cache->fn);
+    }
+    cache->nframes += 1;
+}
+
+void close_selection_cache(SelectionCache *cache) {
+    int32_t nframes;
+    if (!cache) {
+        return;
+    }
+    if (cache->bWrite) {
+        /* The frame count marks the cache as complete */
+        if (cache->nframes > 0) {
+            nframes = cache->nframes;
+            if (gmx_fseek(cache->file, NFRAMES_OFFSET, SEEK_SET) != 0
+                    || fwrite(&nframes, sizeof(int32_t), 1, cache->file)
+                        != 1) {
+                gmx_fatal(FARGS, "Can not write %s\n", cache->fn);
+            }
+        }
+        ffclose(cache->file);
+    }
+    else {
+        fclose(cache->file);
+    }
+    sfree(cache->atoms);
+    sfree(cache->buffer);
+    sfree(cache->fn);
+    sfree(cache);
+}
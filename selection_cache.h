@@ -0,0 +1,93 @@
+#ifndef _selection_cache_h
+#define _selection_cache_h
+
+#include <stdio.h>
+
+#include <gromacs/typedefs.h>
+
+#include "modes.h"
+
+/** Coordinates of the selected atoms only, for the runs that analyse the
+ * same trajectory again
+ *
+ * The first run writes, for every frame it analyses, the coordinates of
+ * the atoms of the leaflet groups and of the reference groups, after the
+ * molecules are made whole. Later runs read them instead of the
+ * trajectory if the cache was written from the same trajectory, with the
+ * same -b, -e, -dt and -rmpbc, and holds all the atoms they need. The other
+ * atoms of the frames are left at the origin.
+ *
+ * The file starts with a SELECTION_CACHE_HEADER bytes long header in the
+ * native byte order:
+ *
+ *  - offset  0: magic string "GTHKSELC" (8 bytes)
+ *  - offset  8: int32, format version (2)
+ *  - offset 12: int32, byte order mark (0x01020304)
+ *  - offset 16: int32, size of a real in bytes (4 or 8)
+ *  - offset 20: int32, number of atoms of the frames
+ *  - offset 24: int32, number of cached atoms
+ *  - offset 28: int32, 1 if the molecules were made whole
+ *  - offset 32: int32, number of frames, -1 until the cache is complete
+ *  - offset 36: int32, 1 if -b was set, plus 2 if -e was set, plus 4 if
+ *    -dt was set
+ *  - offset 40: int64, size of the trajectory in bytes
+ *  - offset 48: int64, modification time of the trajectory
+ *  - offset 56: float32[3], values of -b, -e and -dt
+ *  - offset 68: 4 bytes of padding
+ *
+ * The header is followed by the int32 sorted indices of the cached atoms,
+ * then by the frames: the real time, the real[3][3] box and the
+ * real[3] coordinates of each cached atom.
+ */
+typedef struct SelectionCache {
+    FILE *file;
+    char *fn;
+    gmx_bool bWrite;    /* Written by this run, else read */
+    gmx_bool bWhole;
+    int natoms;
+    atom_id *atoms;
+    int nsel;
+    int nframes;
+    int next;           /* Next frame to read */
+    real *buffer;       /* One frame as stored in the file */
+    /* Trajectory and time selection the cache is written for */
+    gmx_off_t traj_size;
+    gmx_large_int_t traj_mtime;
+    int time_flags;
+    float time_values[3];
+} SelectionCache;
+
+#define SELECTION_CACHE_HEADER 72
+
+/** Open the cache to read it if it matches the run, else to write it
+ *
+ * The atoms needed are the leaflet groups of "modes.general" and the
+ * reference groups of the distance analyses. If the cache has to be
+ * written but "bCanWrite" is false, NULL is returned. When the cache holds
+ * whole molecules, modes.general->bWhole is set.
+ */
+SelectionCache *open_selection_cache(const char *fn, const char *traj_fn,
+        t_modes modes, gmx_bool bCanWrite);
+
+/** Read the first frame of the cache; "x" is allocated
+ *
+ * Return the number of atoms of the frames.
+ */
+int selection_cache_first(SelectionCache *cache, real *time, rvec **x,
+        matrix box);
+
+/** Read the next frame; return FALSE after the last one
+ */
+gmx_bool selection_cache_next(SelectionCache *cache, real *time, rvec *x,
+        matrix box);
+
+/** Add a frame to a cache being written
+ */
+void selection_cache_add(SelectionCache *cache, real time, int natoms,
+        rvec *x, matrix box);
+
+/** Close the cache; a written cache is only valid once closed
+ */
+void close_selection_cache(SelectionCache *cache);
+
+#endif /* _selection_cache_h */
@@ -0,0 +1,111 @@
+#include <math.h>
+#include <string.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/macros.h>
+#include <gromacs/smalloc.h>
+
+#include "smoothing.h"
+
+GridSmoother *build_smoother(int shape[2], real sigma) {
+    GridSmoother *smoother;
+    int i;
+
+    snew(smoother, 1);
+    smoother->shape[0] = shape[0];
+    smoother->shape[1] = shape[1];
+    smoother->stride = 2 * (shape[1] / 2 + 1);
+    smoother->sigma = sigma;
+    if (gmx_fft_init_2d_real(&smoother->fft, shape[0], shape[1],
+                GMX_FFT_FLAG_NONE) != 0) {
+        gmx_fatal(FARGS, "Can not set up the FFT of a %d x %d grid\n",
+                shape[0], shape[1]);
+    }
+    for (i = 0; i < SMOOTHED_FIELDS; ++i) {
+        snew(smoother->fields[i], shape[0] * smoother->stride);
+    }
+    snew(smoother->kernel, shape[0] * (smoother->stride / 2));
+    smoother->kernel_width[0] = 0;
+    smoother->kernel_width[1] = 0;
+    smoother->kernel_shear = 0;
+    return smoother;
+}
+
+void clean_smoother(GridSmoother *smoother) {
+    int i;
+    if (smoother) {
+        gmx_fft_destroy(smoother->fft);
+        for (i = 0; i < SMOOTHED_FIELDS; ++i) {
+            sfree(smoother->fields[i]);
+        }
+        sfree(smoother->kernel);
+        sfree(smoother);
+    }
+}
+
+void smoother_clear(GridSmoother *smoother) {
+    int i;
+    for (i = 0; i < SMOOTHED_FIELDS; ++i) {
+        memset(smoother->fields[i], 0,
+                smoother->shape[0] * smoother->stride * sizeof(real));
+    }
+}
+
+/** Compute the transform of the periodic Gaussian for a box
+ *
+ * The transform of a Gaussian of unit integral is exp(-2 pi^2 sigma^2 f^2)
+ * at the frequency f; the normalisation of the backward transform is
+ * folded in. The cells follow the box vectors, so the coefficient (k0, k1)
+ * is the frequency k0 a* + k1 b*, with a* and b* the reciprocal vectors of
+ * the in-plane box vectors a = (w0, 0) and b = (shear, w1).
+ */
+static void compute_kernel(GridSmoother *smoother, real box_width[2],
+        real shear) {
+    int ncols = smoother->stride / 2;
+    double scale = 1.0 / ((double)smoother->shape[0] * smoother->shape[1]);
+    double factor = -2 * M_PI * M_PI * smoother->sigma * smoother->sigma;
+    double f0, f1;
+    int k0, k1, signed_k0;
+
+    for (k0 = 0; k0 < smoother->shape[0]; ++k0) {
+        /* The upper half of the rows holds the negative frequencies */
+        signed_k0 = (k0 <= smoother->shape[0] / 2)
+            ? k0 : k0 - smoother->shape[0];
+        f0 = signed_k0 / box_width[0];
+        for (k1 = 0; k1 < ncols; ++k1) {
+            f1 = (k1 - f0 * shear) / box_width[1];
+            smoother->kernel[k0 * ncols + k1] =
+                scale * exp(factor * (f0 * f0 + f1 * f1));
+        }
+    }
+    smoother->kernel_width[0] = box_width[0];
+    smoother->kernel_width[1] = box_width[1];
+    smoother->kernel_shear = shear;
+}
+
+void smoother_apply(GridSmoother *smoother, real box_width[2], real shear) {
+    int ncoefs = smoother->shape[0] * (smoother->stride / 2);
+    t_complex *coefs;
+    int i, k;
+
+    if (box_width[0] != smoother->kernel_width[0]
+            || box_width[1] != smoother->kernel_width[1]
+            || shear != smoother->kernel_shear) {
+        compute_kernel(smoother, box_width, shear);
+    }
+    for (i = 0; i < SMOOTHED_FIELDS; ++i) {
+        coefs = (t_complex *)smoother->fields[i];
+        if (gmx_fft_2d_real(smoother->fft, GMX_FFT_REAL_TO_COMPLEX,
+                    smoother->fields[i], coefs) != 0) {
+            gmx_fatal(FARGS, "Forward FFT of the landscape failed\n");
+        }
+        for (k = 0; k < ncoefs; ++k) {
+            coefs[k].re *= smoother->kernel[k];
+            coefs[k].im *= smoother->kernel[k];
+        }
+        if (gmx_fft_2d_real(smoother->fft, GMX_FFT_COMPLEX_TO_REAL,
+                    coefs, smoother->fields[i]) != 0) {
+            gmx_fatal(FARGS, "Backward FFT of the landscape failed\n");
+        }
+    }
+}
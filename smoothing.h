@@ -0,0 +1,56 @@
+#ifndef _smoothing_h
+#define _smoothing_h
+
+#include <gromacs/gmx_fft.h>
+#include <gromacs/typedefs.h>
+
+/* Fields smoothed at once: the sums of the heights and the samplings of
+ * both leaflets */
+#define SMOOTHED_FIELDS 4
+
+/** Gaussian smoothing of the fields of a grid over the periodic membrane
+ * plane
+ *
+ * The fields are convolved with a Gaussian of width "sigma" by FFT, so the
+ * cost grows as ncells log(ncells) whatever the width. The kernel is
+ * periodic with the box; its transform is computed from the mean in-plane
+ * box vectors of the window, and only again when they change, so it stays
+ * isotropic in a triclinic box. Each field holds the
+ * cells in row-major order, with the rows padded to "stride" reals for the
+ * in-place real transforms; smoother_offset gives where a cell is.
+ */
+typedef struct GridSmoother {
+    int shape[2];
+    int stride;             /* Reals per row of a field */
+    real sigma;             /* Width of the Gaussian, in nm */
+    gmx_fft_t fft;
+    real *fields[SMOOTHED_FIELDS];
+    real *kernel;           /* Transform of the kernel, per coefficient */
+    real kernel_width[2];   /* Box widths the kernel was computed for */
+    real kernel_shear;      /* Box shear the kernel was computed for */
+} GridSmoother;
+
+GridSmoother *build_smoother(int shape[2], real sigma);
+
+void clean_smoother(GridSmoother *smoother);
+
+/** Offset in the fields of a cell given by its row-major index
+ */
+static inline int smoother_offset(GridSmoother *smoother, int cell) {
+    return (cell / smoother->shape[1]) * smoother->stride
+        + cell % smoother->shape[1];
+}
+
+/** Set all the fields to 0
+ */
+void smoother_clear(GridSmoother *smoother);
+
+/** Convolve the fields with the Gaussian
+ *
+ * "box_width" holds the mean box widths along the two grid dimensions, and
+ * "shear" the mean component along the first grid dimension of the box
+ * vector of the second one, which is 0 in a rectangular box.
+ */
+void smoother_apply(GridSmoother *smoother, real box_width[2], real shear);
+
+#endif /* _smoothing_h */
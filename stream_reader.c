@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+
+#include "frame_index.h"
+#include "stream_reader.h"
+
+StreamReader *open_stream_reader(const char *fn, int format) {
+    StreamReader *stream;
+
+    snew(stream, 1);
+    stream->format = format;
+    stream->natoms = 0;
+    stream->buffer = NULL;
+    stream->nframes = 0;
+    stream->bStdin = (strcmp(fn, "-") == 0);
+    /* ffopen would open a named pipe to check it exists, and closing it
+     * would end the stream of the writer */
+    if (stream->bStdin) {
+        stream->in = stdin;
+    }
+    else {
+        stream->in = fopen(fn, "rb");
+        if (!stream->in) {
+            gmx_fatal(FARGS, "Can not open the stream %s\n", fn);
+        }
+    }
+    if (format == STREAM_XTC) {
+        xdrstdio_create(&(stream->xdr), stream->in, XDR_DECODE);
+    }
+    return stream;
+}
+
+/** Read a block of a raw frame
+ *
+ * Return FALSE if the stream ends before the block; it is only allowed
+ * before the first block of a frame.
+ */
+static gmx_bool read_raw(StreamReader *stream, void *block, size_t size,
+        gmx_bool bFirst) {
+    size_t nread = fread(block, 1, size, stream->in);
+    if (nread == size) {
+        return TRUE;
+    }
+    if (!bFirst || nread > 0) {
+        gmx_warning("Frame %d of the stream is incomplete; it is ignored",
+                stream->nframes);
+    }
+    return FALSE;
+}
+
+/** Read the number of atoms and the box of a frame, then its coordinates
+ * in the buffer
+ *
+ * Return FALSE at the end of the stream.
+ */
+static gmx_bool read_frame(StreamReader *stream, real *time, matrix box) {
+    int32_t natoms = 0;
+    int step, magic, i, j;
+    float fbox[DIM * DIM], ftime, precision;
+
+    if (stream->format == STREAM_XTC) {
+        if (!xdr_int(&(stream->xdr), &magic)) {
+            return FALSE;
+        }
+        if (magic != XTC_MAGIC) {
+            gmx_fatal(FARGS, "Frame %d of the stream is not an XTC frame\n",
+                    stream->nframes);
+        }
+        if (!xdr_int(&(stream->xdr), &natoms)
+                || !xdr_int(&(stream->xdr), &step)
+                || !xdr_float(&(stream->xdr), &ftime)) {
+            natoms = -1;
+        }
+        for (i = 0; i < DIM * DIM && natoms >= 0; ++i) {
+            if (!xdr_float(&(stream->xdr), &fbox[i])) {
+                natoms = -1;
+            }
+        }
+    }
+    else {
+        if (!read_raw(stream, &natoms, sizeof(natoms), TRUE)) {
+            return FALSE;
+        }
+        if (!read_raw(stream, fbox, sizeof(fbox), FALSE)) {
+            return FALSE;
+        }
+        ftime = stream->nframes;
+    }
+    if (natoms < 0) {
+        gmx_warning("Frame %d of the stream is incomplete; it is ignored",
+                stream->nframes);
+        return FALSE;
+    }
+    if (stream->natoms == 0) {
+        stream->natoms = natoms;
+        snew(stream->buffer, DIM * max(natoms, 1));
+    }
+    else if (natoms != stream->natoms) {
+        gmx_fatal(FARGS, "Frame %d of the stream has %d atoms instead of "
+                "%d\n", stream->nframes, natoms, stream->natoms);
+    }
+    if (stream->format == STREAM_XTC) {
+        if (!xdr3dfcoord(&(stream->xdr), stream->buffer, &natoms,
+                    &precision)) {
+            gmx_warning("Frame %d of the stream is incomplete; it is "
+                    "ignored", stream->nframes);
+            return FALSE;
+        }
+    }
+    else if (!read_raw(stream, stream->buffer,
+                DIM * natoms * sizeof(float), FALSE)) {
+        return FALSE;
+    }
+    for (i = 0; i < DIM; ++i) {
+        for (j = 0; j < DIM; ++j) {
+            box[i][j] = fbox[i * DIM + j];
+        }
+    }
+    *time = ftime;
+    stream->nframes += 1;
+    return TRUE;
+}
+
+/** Copy the coordinates of the buffer
+ */
+static void copy_coordinates(StreamReader *stream, rvec *x) {
+    int i, d;
+    for (i = 0; i < stream->natoms; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            x[i][d] = stream->buffer[i * DIM + d];
+        }
+    }
+}
+
+int stream_reader_first(StreamReader *stream, real *time, rvec **x,
+        matrix box) {
+    if (!read_frame(stream, time, box)) {
+        gmx_fatal(FARGS, "The stream does not hold any frame\n");
+    }
+    snew(*x, max(stream->natoms, 1));
+    copy_coordinates(stream, *x);
+    return stream->natoms;
+}
+
+gmx_bool stream_reader_next(StreamReader *stream, real *time, rvec *x,
+        matrix box) {
+    if (!read_frame(stream, time, box)) {
+        return FALSE;
+    }
+    copy_coordinates(stream, x);
+    return TRUE;
+}
+
+void close_stream_reader(StreamReader *stream) {
+    if (stream) {
+        if (stream->format == STREAM_XTC) {
+            xdr_destroy(&(stream->xdr));
+        }
+        if (!stream->bStdin) {
+            fclose(stream->in);
+        }
+        sfree(stream->buffer);
+        sfree(stream);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef _stream_reader_h
+#define _stream_reader_h
+
+#include <stdio.h>
+
+#include <gromacs/typedefs.h>
+#include <gromacs/xdrf.h>
+
+/* Formats of the frames of a stream, in the order of the -sfmt values */
+enum {
+    STREAM_XTC,
+    STREAM_RAW
+};
+
+/** Frames read one after the other from a pipe or from the standard input
+ *
+ * The stream is never seeked, so the frames can come straight from the
+ * program that produces them or from a decompressor. A raw frame is, in
+ * the native byte order of the machine:
+ *
+ *  - int32, number of atoms
+ *  - float32[3][3], box vectors (nm)
+ *  - float32[natoms][3], coordinates (nm)
+ *
+ * Raw frames have no time; their number is used instead. XTC frames are
+ * decoded with the XDR routines of GROMACS. A frame cut by the end of the
+ * stream is ignored.
+ */
+typedef struct StreamReader {
+    FILE *in;
+    gmx_bool bStdin;
+    int format;
+    XDR xdr;
+    int natoms;
+    float *buffer;      /* Coordinates as stored in the stream */
+    int nframes;
+} StreamReader;
+
+/** Open a stream; "fn" is a path, or - for the standard input
+ */
+StreamReader *open_stream_reader(const char *fn, int format);
+
+/** Read the first frame of a stream; "x" is allocated
+ *
+ * Return the number of atoms.
+ */
+int stream_reader_first(StreamReader *stream, real *time, rvec **x,
+        matrix box);
+
+/** Read the next frame; return FALSE at the end of the stream
+ */
+gmx_bool stream_reader_next(StreamReader *stream, real *time, rvec *x,
+        matrix box);
+
+void close_stream_reader(StreamReader *stream);
+
+#endif /* _stream_reader_h */
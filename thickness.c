@@ -0,0 +1,395 @@
+#include <limits.h>
+#include <string.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+
+#include "run_stats.h"
+#include "thickness.h"
+
+Thickness *thickness_create(t_topology *top, int ePBC, output_env_t oenv) {
+    Thickness *th;
+    GeneralData *general;
+
+    snew(th, 1);
+    th->top = top;
+    th->ePBC = ePBC;
+    th->oenv = oenv;
+    th->natoms = 0;
+    th->pbc = NULL;
+    th->gpbc = NULL;
+    th->bEnded = FALSE;
+
+    /* snew clears the settings that only matter to g_thickness */
+    snew(general, 1);
+    general->ngrps = 0;
+    general->index = NULL;
+    general->isize = NULL;
+    general->batch = 1;
+    general->bWholeTraj = FALSE;
+    general->nthreads = 1;
+    general->bRmPBC = FALSE;
+    general->chunk = 0;
+    general->nchunks = 1;
+    general->leaflets = NULL;
+    general->finder = NULL;
+    th->modes.general = general;
+    th->modes.grids = NULL;
+    th->modes.ngrids = 0;
+    th->modes.dists = NULL;
+    th->modes.ndists = 0;
+    return th;
+}
+
+void thickness_set_rmpbc(Thickness *th, gmx_bool bRmPBC) {
+    if (bRmPBC && !th->top) {
+        gmx_fatal(FARGS, "Molecules can not be made whole without a "
+                "topology\n");
+    }
+    th->modes.general->bRmPBC = bRmPBC;
+}
+
+/** Keep a copy of the groups that give the leaflets
+ */
+static void copy_groups(GeneralData *general, atom_id **index, int *isize,
+        int ngrps) {
+    int group;
+    if (general->leaflets || general->finder) {
+        gmx_fatal(FARGS, "The leaflets are already set\n");
+    }
+    general->ngrps = ngrps;
+    snew(general->index, ngrps);
+    snew(general->isize, ngrps);
+    for (group = 0; group < ngrps; ++group) {
+        general->isize[group] = isize[group];
+        snew(general->index[group], max(isize[group], 1));
+        memcpy(general->index[group], index[group],
+                isize[group] * sizeof(atom_id));
+    }
+}
+
+void thickness_set_leaflets(Thickness *th, atom_id **index, int *isize) {
+    GeneralData *general = th->modes.general;
+    copy_groups(general, index, isize, 2);
+    general->leaflets = build_static_leaflets(general->index,
+            general->isize);
+}
+
+void thickness_detect_leaflets(Thickness *th, atom_id *heads, int nheads,
+        int normal_axis, real cutoff, int refresh) {
+    GeneralData *general = th->modes.general;
+    copy_groups(general, &heads, &nheads, 1);
+    general->finder = build_leaflet_finder(general->index[0],
+            general->isize[0], normal_axis, th->ePBC, cutoff, refresh);
+}
+
+static int gcd(int a, int b) {
+    int rest;
+    while (b != 0) {
+        rest = a % b;
+        a = b;
+        b = rest;
+    }
+    return a;
+}
+
+/** Add the -adt of an analysis to the batch size
+ */
+static void add_to_batch(GeneralData *general, int adt) {
+    gmx_large_int_t batch;
+    if (adt <= 0) {
+        general->bWholeTraj = TRUE;
+        return;
+    }
+    batch = (gmx_large_int_t)(general->batch / gcd(general->batch, adt))
+        * adt;
+    if (batch > INT_MAX) {
+        gmx_fatal(FARGS, "The -adt of the analyses have no common multiple "
+                "small enough to split the trajectory\n");
+    }
+    general->batch = (int)batch;
+}
+
+int thickness_add_analysis(Thickness *th, AnalysisSpec *spec,
+        atom_id *ref_index, int ref_size) {
+    t_modes *modes = &(th->modes);
+    GridHeight *grid;
+    DistMode *dist;
+    atom_id *ref_copy;
+    gmx_bool bTiled;
+    int natoms = 0;
+    int rank, i;
+
+    if (th->natoms > 0) {
+        gmx_fatal(FARGS, "Analyses can not be added once frames were fed\n");
+    }
+    if (spec->bGrid) {
+        /* The size of the leaflets tells how much of a grid is hit; it is
+         * not known when merging */
+        for (i = 0; i < modes->general->ngrps; ++i) {
+            natoms += modes->general->isize[i];
+        }
+        /* A smoothed grid needs all its cells */
+        if (spec->sigma > 0 && spec->storage == GRID_STORAGE_TILED) {
+            gmx_fatal(FARGS, "A smoothed landscape can not be tiled\n");
+        }
+        bTiled = spec->sigma <= 0 && grid_use_tiles(spec->storage,
+                (int [2]){spec->sl, spec->sl2}, natoms);
+        grid = build_grids((int [2]){spec->sl, spec->sl2}, spec->axis,
+                spec->adt, spec->out_fn, spec->sampling_fn,
+                spec->error_fn, spec->bBinary, bTiled);
+        if (spec->windows_fn) {
+            grid_stream_windows(grid, spec->windows_fn);
+        }
+        grid_smooth(grid, spec->sigma);
+        srenew(modes->grids, modes->ngrids + 1);
+        rank = modes->ngrids;
+        modes->grids[modes->ngrids++] = grid;
+    }
+    else {
+        if (spec->bRefMols && !spec->bCOM) {
+            gmx_fatal(FARGS, "The distance to the nearest reference molecule "
+                    "needs the center of mass (-com)\n");
+        }
+        if (!th->top) {
+            dist = build_dist_group(spec->sl, spec->axis, spec->adt,
+                    spec->out_fn, spec->sampling_fn, spec->error_fn,
+                    th->oenv, NULL, 0, NULL, spec->bCOM, FALSE);
+        }
+        else {
+            if (ref_size <= 0) {
+                gmx_fatal(FARGS, "A distance analysis needs a reference "
+                        "group\n");
+            }
+            snew(ref_copy, ref_size);
+            memcpy(ref_copy, ref_index, ref_size * sizeof(atom_id));
+            dist = build_dist_group(spec->sl, spec->axis, spec->adt,
+                    spec->out_fn, spec->sampling_fn, spec->error_fn,
+                    th->oenv, ref_copy, ref_size, th->top, spec->bCOM,
+                    !modes->general->bRmPBC);
+        }
+        if (spec->bRefMols) {
+            dist_nearest_molecule(dist, th->top);
+        }
+        srenew(modes->dists, modes->ndists + 1);
+        rank = modes->ndists;
+        modes->dists[modes->ndists++] = dist;
+    }
+    add_to_batch(modes->general, spec->adt);
+    return rank;
+}
+
+/** Get the leaflets to use for a new frame
+ *
+ * Frames have to be given in trajectory order. The caller has to release
+ * the set once the frame is analysed.
+ */
+LeafletSet *frame_leaflets(GeneralData *general, matrix box, rvec *x) {
+    if (general->finder) {
+        return leaflet_finder_update(general->finder, box, x);
+    }
+    return leaflet_set_retain(general->leaflets);
+}
+
+void do_frame(t_modes modes, LeafletSet *leaflets, t_pbc *pbc, int ePBC,
+        matrix box, rvec *x, gmx_rmpbc_t gpbc, int natoms, t_topology *top) {
+    int leaflet = 0;
+    int atom = 0;
+    int i = 0;
+    StageTimer timer;
+    if (pbc) {
+        set_pbc(pbc,ePBC,box);
+        /* make molecules whole again */
+        if (gpbc) {
+            stats_start(&timer);
+            gmx_rmpbc(gpbc,natoms,box,x);
+            stats_stop(STAGE_RMPBC, &timer);
+        }
+    }
+    for (i = 0; i < modes.ngrids; ++i) {
+        grid_start_frame(modes.grids[i], box);
+    }
+    stats_start(&timer);
+    for (i = 0; i < modes.ndists; ++i) {
+        dist_start_frame(modes.dists[i], box, top, x, pbc);
+    }
+    stats_stop(STAGE_REFERENCE, &timer);
+    for (leaflet = 0; leaflet < 2; ++leaflet) {
+        for (i = 0; i < modes.ngrids; ++i) {
+            stats_start(&timer);
+            grid_store_batch(modes.grids[i], leaflet, x,
+                    leaflets->index[leaflet], leaflets->isize[leaflet]);
+            stats_stop(STAGE_GRID, &timer);
+            stats_count(COUNTER_GRID_ATOMS, leaflets->isize[leaflet]);
+        }
+        for (i = 0; i < modes.ndists; ++i) {
+            stats_start(&timer);
+            for (atom = 0; atom < leaflets->isize[leaflet]; ++atom) {
+                dist_store(modes.dists[i], leaflet,
+                        leaflets->index[leaflet][atom], x, pbc);
+            }
+            stats_stop(STAGE_DIST, &timer);
+            stats_count(COUNTER_DIST_ATOMS, leaflets->isize[leaflet]);
+        }
+    }
+    stats_count(COUNTER_FRAMES, 1);
+    stats_start(&timer);
+    for (i = 0; i < modes.ngrids; ++i) {
+        grid_end_frame(modes.grids[i]);
+    }
+    for (i = 0; i < modes.ndists; ++i) {
+        dist_end_frame(modes.dists[i]);
+    }
+    stats_stop(STAGE_WINDOW, &timer);
+}
+
+void thickness_feed_frame(Thickness *th, int natoms, rvec *x, matrix box) {
+    GeneralData *general = th->modes.general;
+    LeafletSet *leaflets;
+
+    if (th->bEnded) {
+        gmx_fatal(FARGS, "No frame can be analysed after thickness_end\n");
+    }
+    if (!general->leaflets && !general->finder) {
+        gmx_fatal(FARGS, "The leaflets have to be set before the frames "
+                "are analysed\n");
+    }
+    /* The PBC handling is set up with the first frame */
+    if (th->natoms == 0) {
+        th->natoms = natoms;
+        if (th->ePBC != epbcNONE) {
+            snew(th->pbc, 1);
+        }
+        if (general->bRmPBC && !general->bWhole) {
+            th->gpbc = gmx_rmpbc_init(&th->top->idef, th->ePBC, natoms, box);
+        }
+    }
+    else if (natoms != th->natoms) {
+        gmx_fatal(FARGS, "Frame with %d atoms instead of %d\n", natoms,
+                th->natoms);
+    }
+    leaflets = frame_leaflets(general, box, x);
+    do_frame(th->modes, leaflets, th->pbc, th->ePBC, box, x, th->gpbc,
+            natoms, th->top);
+    leaflet_set_release(leaflets);
+}
+
+GridSnapshot *thickness_grid_snapshot(Thickness *th, int grid) {
+    GridHeight *grid_store;
+    GridSnapshot *snap;
+    int i;
+
+    if (grid < 0 || grid >= th->modes.ngrids || th->bEnded) {
+        gmx_fatal(FARGS, "No grid analysis %d to read\n", grid);
+    }
+    grid_store = th->modes.grids[grid];
+    if (grid_store->nframes == 0) {
+        return NULL;
+    }
+    snew(snap, 1);
+    snap->nframes = grid_store->nframes;
+    for (i = 0; i < 2; ++i) {
+        snap->shape[i] = grid_store->shape[i];
+        snap->box_width[i] = grid_store->box_width[i] / grid_store->nframes;
+    }
+    snew(snap->thickness, grid_store->ncells);
+    snew(snap->sampling, grid_store->ncells);
+    snew(snap->error, grid_store->ncells);
+    grid_snapshot(grid_store, snap->thickness, snap->sampling, snap->error);
+    return snap;
+}
+
+DistSnapshot *thickness_dist_snapshot(Thickness *th, int dist) {
+    DistMode *dist_store;
+    DistSnapshot *snap;
+
+    if (dist < 0 || dist >= th->modes.ndists || th->bEnded) {
+        gmx_fatal(FARGS, "No distance analysis %d to read\n", dist);
+    }
+    dist_store = th->modes.dists[dist];
+    if (dist_store->nframes == 0) {
+        return NULL;
+    }
+    snew(snap, 1);
+    snap->length = dist_store->length;
+    snap->nframes = dist_store->nframes;
+    snew(snap->thickness, dist_store->length);
+    snew(snap->sampling, dist_store->length);
+    snew(snap->error, dist_store->length);
+    dist_snapshot(dist_store, &snap->bin_size, snap->thickness,
+            snap->sampling, snap->error);
+    return snap;
+}
+
+void clean_grid_snapshot(GridSnapshot *snap) {
+    if (snap) {
+        sfree(snap->thickness);
+        sfree(snap->sampling);
+        sfree(snap->error);
+        sfree(snap);
+    }
+}
+
+void clean_dist_snapshot(DistSnapshot *snap) {
+    if (snap) {
+        sfree(snap->thickness);
+        sfree(snap->sampling);
+        sfree(snap->error);
+        sfree(snap);
+    }
+}
+
+void thickness_flush(Thickness *th) {
+    int i;
+    if (th->bEnded || th->natoms == 0) {
+        return;
+    }
+    for (i = 0; i < th->modes.ngrids; ++i) {
+        grid_flush(th->modes.grids[i]);
+    }
+    for (i = 0; i < th->modes.ndists; ++i) {
+        dist_flush(th->modes.dists[i]);
+    }
+}
+
+void thickness_end(Thickness *th) {
+    int i;
+    for (i = 0; i < th->modes.ngrids; ++i) {
+        grid_end(th->modes.grids[i]);
+    }
+    for (i = 0; i < th->modes.ndists; ++i) {
+        dist_end(th->modes.dists[i]);
+    }
+    th->bEnded = TRUE;
+}
+
+void thickness_destroy(Thickness *th) {
+    GeneralData *general;
+    int i;
+    if (!th) {
+        return;
+    }
+    general = th->modes.general;
+    /* This closes the output files */
+    for (i = 0; i < th->modes.ngrids; ++i) {
+        clean_grids(th->modes.grids[i]);
+    }
+    for (i = 0; i < th->modes.ndists; ++i) {
+        clean_dist(th->modes.dists[i]);
+    }
+    sfree(th->modes.grids);
+    sfree(th->modes.dists);
+    leaflet_set_release(general->leaflets);
+    clean_leaflet_finder(general->finder);
+    for (i = 0; i < general->ngrps; ++i) {
+        sfree(general->index[i]);
+    }
+    sfree(general->index);
+    sfree(general->isize);
+    sfree(general);
+    if (th->gpbc) {
+        gmx_rmpbc_done(th->gpbc);
+    }
+    sfree(th->pbc);
+    sfree(th);
+}
@@ -0,0 +1,164 @@
+#ifndef _thickness_h
+#define _thickness_h
+
+#include <gromacs/pbc.h>
+#include <gromacs/rmpbc.h>
+#include <gromacs/statutil.h>
+#include <gromacs/typedefs.h>
+
+#include "modes.h"
+
+/** Settings of one grid or distance analysis
+ *
+ * The file names and the group name are owned by the structure. Without
+ * "out_fn", the analysis writes no file; its results are read with the
+ * snapshot calls.
+ */
+typedef struct AnalysisSpec {
+    gmx_bool bGrid;         /* Thickness landscape, else distance profile */
+    int sl;
+    int sl2;
+    int axis;
+    int adt;                /* Frames per window, negative for one */
+    gmx_bool bCOM;
+    gmx_bool bRefMols;      /* Distance to the nearest reference molecule */
+    gmx_bool bBinary;
+    int storage;            /* One of the GRID_STORAGE values */
+    real sigma;             /* Width of the smoothing of a grid, 0 for none */
+    char *out_fn;
+    char *sampling_fn;
+    char *error_fn;         /* Standard error of the thickness, or NULL */
+    char *windows_fn;       /* Stream of the -adt windows, or NULL */
+    char *group;            /* Reference group, or NULL to ask for it */
+} AnalysisSpec;
+
+/** Incremental thickness analysis, for the programs that produce the frames
+ * themselves
+ *
+ * The analyses are configured once, then the frames are fed one at a time
+ * in trajectory order; the results can be read at any time and the
+ * analysis goes on. Nothing is read from a file and no command line is
+ * parsed. A run goes as follows:
+ *
+ *  - thickness_create, then thickness_set_rmpbc if needed;
+ *  - thickness_set_leaflets or thickness_detect_leaflets;
+ *  - thickness_add_analysis for each grid or distance analysis;
+ *  - thickness_feed_frame for each frame;
+ *  - thickness_grid_snapshot and thickness_dist_snapshot when needed, or
+ *    thickness_flush to update the output files;
+ *  - thickness_end to write the output files of the analyses, if any;
+ *  - thickness_destroy.
+ *
+ * The mode objects are in "modes" for the callers that drive them
+ * directly, like the threaded pipeline of g_thickness.
+ */
+typedef struct Thickness {
+    t_modes modes;
+    t_topology *top;        /* Not owned; NULL when merging accumulators */
+    int ePBC;
+    output_env_t oenv;      /* Only needed to write distance profiles */
+    int natoms;             /* Atoms of the frames, 0 before the first one */
+    t_pbc *pbc;
+    gmx_rmpbc_t gpbc;
+    gmx_bool bEnded;
+} Thickness;
+
+/** Results of a grid analysis; the arrays are row-major
+ */
+typedef struct GridSnapshot {
+    int shape[2];
+    int nframes;
+    real box_width[2];      /* Mean box widths along the grid axes (nm) */
+    real *thickness;        /* NAN where both leaflets were never sampled */
+    int *sampling;
+    real *error;            /* NAN with less than two windows */
+} GridSnapshot;
+
+/** Results of a distance analysis, one value per bin
+ */
+typedef struct DistSnapshot {
+    int length;
+    int nframes;
+    real bin_size;          /* Width of a distance bin (nm) */
+    real *thickness;
+    int *sampling;
+    real *error;
+} DistSnapshot;
+
+/** Create an analysis without leaflets and without analyses
+ *
+ * "top" gives the masses of the reference groups and the molecules to make
+ * whole; it is kept, not copied. "oenv" is only used to open the distance
+ * profile outputs and can be NULL without them.
+ */
+Thickness *thickness_create(t_topology *top, int ePBC, output_env_t oenv);
+
+/** Make the molecules of the whole system whole at each frame
+ *
+ * This is off by default; the centers of mass of the reference groups are
+ * then computed on whole groups. It has to be set before the analyses are
+ * added.
+ */
+void thickness_set_rmpbc(Thickness *th, gmx_bool bRmPBC);
+
+/** Use two fixed groups of atoms as the leaflets; the arrays are copied
+ */
+void thickness_set_leaflets(Thickness *th, atom_id **index, int *isize);
+
+/** Detect the leaflets from headgroup atoms, see LeafletFinder; the array
+ * is copied
+ */
+void thickness_detect_leaflets(Thickness *th, atom_id *heads, int nheads,
+        int normal_axis, real cutoff, int refresh);
+
+/** Add a grid or a distance analysis
+ *
+ * A distance analysis needs a reference group, which is copied; it is
+ * ignored for a grid, and when there is no topology. The leaflets have to
+ * be set first, their size tells how a large grid is stored. An "adt" of
+ * 0 is a fatal error. Return the rank of the analysis among the ones of its
+ * kind.
+ */
+int thickness_add_analysis(Thickness *th, AnalysisSpec *spec,
+        atom_id *ref_index, int ref_size);
+
+/** Analyse a frame
+ *
+ * The frames have to be given in trajectory order, with the same number of
+ * atoms. "x" is modified in place when the molecules are made whole.
+ */
+void thickness_feed_frame(Thickness *th, int natoms, rvec *x, matrix box);
+
+/** Get the results of the frames fed so far, as the output files would
+ * hold them if the run stopped now
+ *
+ * The snapshot is owned by the caller and freed with clean_grid_snapshot
+ * or clean_dist_snapshot. The analysis is not modified. Before the first
+ * frame there is nothing to average, and NULL is returned.
+ */
+GridSnapshot *thickness_grid_snapshot(Thickness *th, int grid);
+
+DistSnapshot *thickness_dist_snapshot(Thickness *th, int dist);
+
+void clean_grid_snapshot(GridSnapshot *snap);
+
+void clean_dist_snapshot(DistSnapshot *snap);
+
+/** Rewrite the output files of the analyses with the results of the frames
+ * fed so far
+ *
+ * The files hold what a run stopped now would write, and are overwritten
+ * by the next flush or by thickness_end. Nothing is done before the first
+ * frame.
+ */
+void thickness_flush(Thickness *th);
+
+/** Close the last windows and write the output files of the analyses
+ *
+ * No frame can be fed and no snapshot taken afterwards.
+ */
+void thickness_end(Thickness *th);
+
+void thickness_destroy(Thickness *th);
+
+#endif /* _thickness_h */
@@ -0,0 +1,187 @@
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/gmxfio.h>
+#include <gromacs/smalloc.h>
+
+#include "traj_reader.h"
+
+/** Get the range [start, stop) of the selected frames in a chunk of the
+ * trajectory
+ *
+ * The "nselected" frames kept with -b, -e and -dt are split in "nchunks"
+ * chunks of whole batches, so the -adt windows of all the analyses are the
+ * same as in a single run over the whole trajectory.
+ */
+static void chunk_range(int nselected, int chunk, int nchunks, int batch,
+        int *start, int *stop) {
+    int window, nwindows;
+
+    window = (batch > 0) ? batch : 1;
+    nwindows = (nselected + window - 1) / window;
+    *start = (int)((gmx_large_int_t)chunk * nwindows / nchunks) * window;
+    *stop = (int)((gmx_large_int_t)(chunk + 1) * nwindows / nchunks)
+        * window;
+    *stop = min(*stop, nselected);
+}
+
+/** Tell if a frame of a stream is after -e
+ */
+static gmx_bool stream_after_end(real time) {
+    return bTimeSet(TEND) && time > rTimeValue(TEND);
+}
+
+/** Open a stream and read its first frame at or after -b
+ */
+static void open_stream(TrajReader *reader, GeneralData *general,
+        real *time, rvec **x, matrix box) {
+    reader->stream = open_stream_reader(general->stream_fn,
+            general->stream_format);
+    reader->natoms = stream_reader_first(reader->stream, time, x, box);
+    while (bTimeSet(TBEGIN) && *time < rTimeValue(TBEGIN)) {
+        if (!stream_reader_next(reader->stream, time, *x, box)) {
+            gmx_fatal(FARGS, "The stream ends before the time given by "
+                    "-b\n");
+        }
+    }
+    if (stream_after_end(*time)) {
+        gmx_fatal(FARGS, "The stream does not hold any frame between -b "
+                "and -e\n");
+    }
+}
+
+/** Decode the frames of the chunk, or the ones kept with -b, -e and -dt,
+ * on several threads
+ */
+static void open_decoder(TrajReader *reader, GeneralData *general,
+        real *time, rvec **x, matrix box) {
+    int *frames, nselected, start, stop;
+
+    if (fn2ftp(general->traj_fn) != efXTC) {
+        gmx_fatal(FARGS, "Only XTC trajectories can be decoded on several "
+                "threads\n");
+    }
+    reader->index = build_frame_index(general->traj_fn);
+    nselected = frame_index_select(reader->index, &frames);
+    chunk_range(nselected, general->chunk, general->nchunks,
+            general->batch, &start, &stop);
+    if (start >= stop) {
+        gmx_fatal(FARGS, "No frame of %s to analyse\n", general->traj_fn);
+    }
+    if (general->nchunks > 1) {
+        fprintf(stderr, "Reading frames %d to %d (chunk %d of %d)\n",
+                frames[start], frames[stop - 1], general->chunk,
+                general->nchunks);
+    }
+    reader->natoms = reader->index->natoms;
+    reader->decoder = open_xtc_decoder(general->traj_fn, reader->index,
+            frames + start, stop - start, general->ndecoders);
+    sfree(frames);
+    snew(*x, max(reader->natoms, 1));
+    xtc_decoder_next(reader->decoder, time, *x, box);
+}
+
+TrajReader *open_traj_reader(GeneralData *general, output_env_t oenv,
+        real *time, rvec **x, matrix box) {
+    TrajReader *reader;
+    int *frames, nselected, start, stop, current;
+
+    snew(reader, 1);
+    reader->oenv = oenv;
+    reader->index = NULL;
+    reader->stream = NULL;
+    reader->decoder = NULL;
+    reader->cache = NULL;
+    if (general->cache && !general->cache->bWrite) {
+        reader->cache = general->cache;
+        reader->natoms = selection_cache_first(reader->cache, time, x, box);
+        return reader;
+    }
+    reader->bStop = FALSE;
+    reader->tstop = 0;
+    if (general->stream_fn) {
+        if (general->nchunks > 1) {
+            gmx_fatal(FARGS, "A stream can not be split in chunks\n");
+        }
+        open_stream(reader, general, time, x, box);
+        return reader;
+    }
+    if (general->ndecoders > 1) {
+        open_decoder(reader, general, time, x, box);
+        return reader;
+    }
+    reader->natoms = read_first_x(oenv, &(reader->status), general->traj_fn,
+            time, x, box);
+    if (general->nchunks <= 1) {
+        return reader;
+    }
+
+    reader->index = build_frame_index(general->traj_fn);
+    if (reader->index->natoms != reader->natoms) {
+        gmx_fatal(FARGS, "The frame index has %d atoms, but the trajectory "
+                "has %d\n", reader->index->natoms, reader->natoms);
+    }
+    nselected = frame_index_select(reader->index, &frames);
+    chunk_range(nselected, general->chunk, general->nchunks,
+            general->batch, &start, &stop);
+    if (start >= stop) {
+        gmx_fatal(FARGS, "Chunk %d of %d does not hold any frame\n",
+                general->chunk, general->nchunks);
+    }
+    fprintf(stderr, "Reading frames %d to %d (chunk %d of %d)\n",
+            frames[start], frames[stop - 1], general->chunk,
+            general->nchunks);
+    /* read_first_x already handled -b, it may be on the right frame. The
+     * reader keeps skipping the frames -dt drops after the seek, since the
+     * first frame it read is still the one at -b */
+    current = frame_index_find_time(reader->index, *time);
+    if (current != frames[start]) {
+        if (gmx_fio_seek(trx_get_fileio(reader->status),
+                    reader->index->offsets[frames[start]]) != 0
+                || !read_next_x(oenv, reader->status, time, reader->natoms,
+                    *x, box)) {
+            gmx_fatal(FARGS, "Can not read frame %d of %s\n",
+                    frames[start], general->traj_fn);
+        }
+    }
+    if (stop < nselected) {
+        reader->bStop = TRUE;
+        reader->tstop = reader->index->times[frames[stop]];
+    }
+    sfree(frames);
+    return reader;
+}
+
+gmx_bool traj_reader_next(TrajReader *reader, real *time, rvec *x,
+        matrix box) {
+    if (reader->stream) {
+        return stream_reader_next(reader->stream, time, x, box)
+            && !stream_after_end(*time);
+    }
+    if (reader->cache) {
+        return selection_cache_next(reader->cache, time, x, box);
+    }
+    if (reader->decoder) {
+        return xtc_decoder_next(reader->decoder, time, x, box);
+    }
+    if (!read_next_x(reader->oenv, reader->status, time, reader->natoms, x,
+                box)) {
+        return FALSE;
+    }
+    return !(reader->bStop && *time >= reader->tstop);
+}
+
+void close_traj_reader(TrajReader *reader) {
+    if (reader) {
+        /* The selection cache is closed by its owner */
+        if (reader->stream) {
+            close_stream_reader(reader->stream);
+        }
+        else if (reader->decoder) {
+            close_xtc_decoder(reader->decoder);
+        }
+        else if (!reader->cache) {
+            close_trj(reader->status);
+        }
+        clean_frame_index(reader->index);
+        sfree(reader);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef _traj_reader_h
+#define _traj_reader_h
+
+#include <gromacs/statutil.h>
+#include <gromacs/typedefs.h>
+
+#include "frame_index.h"
+#include "modes.h"
+#include "selection_cache.h"
+#include "stream_reader.h"
+#include "xtc_decoder.h"
+
+/** Read the frames of the trajectory selected by the user
+ *
+ * Without chunking, this is read_first_x and read_next_x. When the
+ * trajectory is split in chunks, the reader uses the frame index to seek to
+ * the first frame of the chunk and stops at its last frame. With -stream,
+ * the frames come from a pipe or the standard input instead. With -ndec,
+ * the frames selected with the frame index are decoded by an XtcDecoder.
+ * When a selection cache is read, the frames come from it.
+ */
+typedef struct TrajReader {
+    output_env_t oenv;
+    t_trxstatus *status;
+    int natoms;
+    FrameIndex *index;
+    StreamReader *stream;   /* NULL when reading a trajectory file */
+    XtcDecoder *decoder;    /* NULL when the frames are decoded here */
+    SelectionCache *cache;  /* Not owned; NULL if not read */
+    /* Stop before the first frame with a time of at least tstop */
+    gmx_bool bStop;
+    real tstop;
+} TrajReader;
+
+/** Open the trajectory and read the first frame to analyse
+ *
+ * Parameters:
+ *  - general: the trajectory name and the chunk to read
+ *  - oenv: the GROMACS output environment
+ *  - time, x, box: the time, coordinates and box of the first frame; x is
+ *    allocated like with read_first_x
+ */
+TrajReader *open_traj_reader(GeneralData *general, output_env_t oenv,
+        real *time, rvec **x, matrix box);
+
+/** Read the next frame; return FALSE at the end of the selection
+ */
+gmx_bool traj_reader_next(TrajReader *reader, real *time, rvec *x,
+        matrix box);
+
+void close_traj_reader(TrajReader *reader);
+
+#endif /* _traj_reader_h */
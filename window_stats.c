@@ -0,0 +1,69 @@
+#include <math.h>
+
+#include <gromacs/smalloc.h>
+
+#include "window_stats.h"
+
+void init_window_stats(WindowStats *stats, int n) {
+    stats->n = n;
+    snew(stats->mean, n);
+    snew(stats->m2, n);
+    snew(stats->w2, n);
+}
+
+void clean_window_stats(WindowStats *stats) {
+    sfree(stats->mean);
+    sfree(stats->m2);
+    sfree(stats->w2);
+    stats->n = 0;
+}
+
+void window_stats_resize(WindowStats *stats, int n) {
+    int cell;
+    srenew(stats->mean, n);
+    srenew(stats->m2, n);
+    srenew(stats->w2, n);
+    for (cell = stats->n; cell < n; ++cell) {
+        stats->mean[cell] = 0;
+        stats->m2[cell] = 0;
+        stats->w2[cell] = 0;
+    }
+    stats->n = n;
+}
+
+void window_stats_add(WindowStats *stats, int cell, int weight_sum,
+        real thickness, int weight) {
+    double total = (double)weight_sum + weight;
+    double delta = thickness - stats->mean[cell];
+    stats->mean[cell] += delta * weight / total;
+    stats->m2[cell] += weight * delta * (thickness - stats->mean[cell]);
+    stats->w2[cell] += (double)weight * weight;
+}
+
+void window_stats_merge(WindowStats *stats, int cell, int weight_sum,
+        double mean, double m2, double w2, int other_weight_sum) {
+    double total = (double)weight_sum + other_weight_sum;
+    double delta = mean - stats->mean[cell];
+    if (other_weight_sum == 0) {
+        return;
+    }
+    stats->mean[cell] += delta * other_weight_sum / total;
+    stats->m2[cell] += m2
+        + delta * delta * weight_sum * (double)other_weight_sum / total;
+    stats->w2[cell] += w2;
+}
+
+/* With n_eff = W^2 / sum(w^2) effective windows, the variance of the
+ * weighted mean is the variance of a window divided by n_eff; the variance
+ * of a window is estimated by m2 / W * n_eff / (n_eff - 1). */
+real window_stats_error(WindowStats *stats, int cell, int weight_sum) {
+    double neff;
+    if (weight_sum <= 0 || stats->w2[cell] <= 0) {
+        return NAN;
+    }
+    neff = (double)weight_sum * weight_sum / stats->w2[cell];
+    if (neff <= 1.0 + 1e-9) {
+        return NAN;
+    }
+    return sqrt(stats->m2[cell] / (weight_sum * (neff - 1.0)));
+}
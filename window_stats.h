@@ -0,0 +1,54 @@
+#ifndef _window_stats_h
+#define _window_stats_h
+
+#include <gromacs/typedefs.h>
+
+/** Weighted statistics of the window thickness of each cell or bin
+ *
+ * Each -adt window is a block: its thickness is added with the sampling of
+ * the window as weight. The sum of the weights is the thickness sampling of
+ * the mode object, so only three values per cell are stored. The standard
+ * error is only meaningful if the windows are longer than the correlation
+ * time of the thickness.
+ */
+typedef struct WindowStats {
+    int n;
+    double *mean;       /* Weighted mean of the window thickness */
+    double *m2;         /* Sum of w * (thickness - mean)^2 */
+    double *w2;         /* Sum of the squared weights */
+} WindowStats;
+
+void init_window_stats(WindowStats *stats, int n);
+
+void clean_window_stats(WindowStats *stats);
+
+/** Change the number of cells; the new cells are empty
+ */
+void window_stats_resize(WindowStats *stats, int n);
+
+/** Add a window to a cell with West's weighted update of Welford's
+ * algorithm
+ *
+ * Parameters:
+ *  - cell: the cell or bin
+ *  - weight_sum: the sum of the weights of the cell before this window
+ *  - thickness, weight: the thickness and sampling of the window
+ */
+void window_stats_add(WindowStats *stats, int cell, int weight_sum,
+        real thickness, int weight);
+
+/** Combine the statistics of the same cell over other windows, following
+ * Chan et al.
+ *
+ * "weight_sum" and "other_weight_sum" are the sums of the weights of both
+ * sides, before they are added.
+ */
+void window_stats_merge(WindowStats *stats, int cell, int weight_sum,
+        double mean, double m2, double w2, int other_weight_sum);
+
+/** Standard error of the weighted mean thickness of a cell, or NAN with
+ * less than two effective windows
+ */
+real window_stats_error(WindowStats *stats, int cell, int weight_sum);
+
+#endif /* _window_stats_h */
@@ -0,0 +1,173 @@
+#include <math.h>
+#include <string.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+
+#include "window_writer.h"
+
+/* Size in bytes of the header of the stream */
+#define WINDOW_STREAM_HEADER 64
+
+static void write_or_die(WindowWriter *writer, const void *buffer,
+        unsigned int size) {
+    if (size > 0 && gzwrite(writer->out, buffer, size) != (int)size) {
+        gmx_fatal(FARGS, "Error while writing the window stream\n");
+    }
+}
+
+static void *writer_loop(void *arg) {
+    WindowWriter *writer = (WindowWriter *)arg;
+    WindowRecord *record;
+    while (TRUE) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->count == 0 && !writer->bDone) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if (writer->count == 0) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        record = &writer->records[writer->head];
+        pthread_mutex_unlock(&writer->lock);
+
+        write_or_die(writer, &record->index, sizeof(int32_t));
+        write_or_die(writer, &record->nframes, sizeof(int32_t));
+        write_or_die(writer, record->box_width, 2 * sizeof(double));
+        write_or_die(writer, record->thickness, writer->ncells * sizeof(real));
+        write_or_die(writer, record->sampling,
+                writer->ncells * sizeof(int32_t));
+
+        pthread_mutex_lock(&writer->lock);
+        writer->head = (writer->head + 1) % WINDOW_QUEUE_DEPTH;
+        writer->count -= 1;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+/** Open a window stream and start its writer thread
+ *
+ * The stream is gzip compressed. Once uncompressed, it starts with a
+ * WINDOW_STREAM_HEADER bytes long header in the native byte order:
+ *
+ *  - offset  0: magic string "GTHKWIND" (8 bytes)
+ *  - offset  8: int32, format version (1)
+ *  - offset 12: int32, byte order mark (0x01020304)
+ *  - offset 16: int32, size of a thickness value in bytes (4 or 8)
+ *  - offset 20: int32[2], shape of the grid
+ *  - offset 28: int32[3], normal axis then the axes of the grid dimensions
+ *
+ * Each window then comes as an int32 window index, an int32 number of
+ * frames, the float64[2] mean box widths over the window, the thickness
+ * grid (NaN where a leaflet was not sampled) and the int32 sampling grid.
+ */
+WindowWriter *build_window_writer(const char *fn, int shape[2], int axis[3]) {
+    WindowWriter *writer;
+    char header[WINDOW_STREAM_HEADER];
+    int32_t version = 1;
+    int32_t bom = 0x01020304;
+    int32_t real_size = sizeof(real);
+    int32_t values[5];
+    int i, j;
+
+    snew(writer, 1);
+    writer->out = gzopen(fn, "wb1");
+    if (writer->out == NULL) {
+        gmx_fatal(FARGS, "Error oppenning %s for the window stream\n", fn);
+    }
+    writer->ncells = shape[0] * shape[1];
+    /* The records start empty: no cell is sampled */
+    for (i = 0; i < WINDOW_QUEUE_DEPTH; ++i) {
+        snew(writer->records[i].thickness, writer->ncells);
+        snew(writer->records[i].sampling, writer->ncells);
+        snew(writer->records[i].filled, writer->ncells);
+        writer->records[i].nfilled = 0;
+        for (j = 0; j < writer->ncells; ++j) {
+            writer->records[i].thickness[j] = NAN;
+        }
+    }
+    writer->head = 0;
+    writer->count = 0;
+    writer->nwindows = 0;
+    writer->bDone = FALSE;
+
+    values[0] = shape[0];
+    values[1] = shape[1];
+    values[2] = axis[0];
+    values[3] = axis[1];
+    values[4] = axis[2];
+    memset(header, 0, sizeof(header));
+    memcpy(header, "GTHKWIND", 8);
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &bom, 4);
+    memcpy(header + 16, &real_size, 4);
+    memcpy(header + 20, values, sizeof(values));
+    write_or_die(writer, header, sizeof(header));
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_loop, writer)) {
+        gmx_fatal(FARGS, "Can not start the window writer thread\n");
+    }
+    return writer;
+}
+
+/** Get the next free record, waiting for the writer if needed
+ *
+ * The index of the record is set and its cells are empty, with a NaN
+ * thickness and no sampling; the caller fills the rest, and lists the
+ * cells it sets in "filled".
+ */
+WindowRecord *window_writer_acquire(WindowWriter *writer) {
+    WindowRecord *record;
+    int i;
+    pthread_mutex_lock(&writer->lock);
+    while (writer->count == WINDOW_QUEUE_DEPTH) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    record = &writer->records[(writer->head + writer->count)
+        % WINDOW_QUEUE_DEPTH];
+    pthread_mutex_unlock(&writer->lock);
+    record->index = writer->nwindows;
+    for (i = 0; i < record->nfilled; ++i) {
+        record->thickness[record->filled[i]] = NAN;
+        record->sampling[record->filled[i]] = 0;
+    }
+    record->nfilled = 0;
+    return record;
+}
+
+/** Hand the record returned by the last window_writer_acquire to the
+ * writer thread
+ */
+void window_writer_publish(WindowWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->count += 1;
+    writer->nwindows += 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void clean_window_writer(WindowWriter *writer) {
+    int i;
+    if (writer) {
+        pthread_mutex_lock(&writer->lock);
+        writer->bDone = TRUE;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+        if (gzclose(writer->out) != Z_OK) {
+            gmx_fatal(FARGS, "Error while closing the window stream\n");
+        }
+        for (i = 0; i < WINDOW_QUEUE_DEPTH; ++i) {
+            sfree(writer->records[i].thickness);
+            sfree(writer->records[i].sampling);
+            sfree(writer->records[i].filled);
+        }
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->cond);
+        sfree(writer);
+    }
+}
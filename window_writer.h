@@ -0,0 +1,57 @@
+#ifndef _window_writer_h
+#define _window_writer_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#include <gromacs/typedefs.h>
+
+/* Number of windows that can wait to be written */
+#define WINDOW_QUEUE_DEPTH 4
+
+/** One window waiting to be written
+ */
+typedef struct WindowRecord {
+    int32_t index;
+    int32_t nframes;
+    double box_width[2];
+    real *thickness;
+    int32_t *sampling;
+    /* Cells set by the analysis, emptied when the record is acquired again */
+    int *filled;
+    int nfilled;
+} WindowRecord;
+
+/** Write thickness landscapes of individual -adt windows to a gzip
+ * compressed stream on a background thread
+ *
+ * The analysis fills the record returned by window_writer_acquire and hands
+ * it over with window_writer_publish; it only waits when the writer thread
+ * is WINDOW_QUEUE_DEPTH windows late.
+ */
+typedef struct WindowWriter {
+    gzFile out;
+    int ncells;
+    WindowRecord records[WINDOW_QUEUE_DEPTH];
+    int head;
+    int count;
+    int nwindows;
+    gmx_bool bDone;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} WindowWriter;
+
+WindowWriter *build_window_writer(const char *fn, int shape[2], int axis[3]);
+
+WindowRecord *window_writer_acquire(WindowWriter *writer);
+
+void window_writer_publish(WindowWriter *writer);
+
+/** Flush the pending windows, stop the writer thread and close the file
+ */
+void clean_window_writer(WindowWriter *writer);
+
+#endif /* _window_writer_h */
@@ -0,0 +1,214 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/vec.h>
+
+#include "run_stats.h"
+#include "xtc_decoder.h"
+
+/* Frames decoded ahead of the reader, per thread */
+#define SLOTS_PER_THREAD 2
+
+/** Decode a frame of the index in a slot
+ *
+ * The header is read from the map like the frame index reads it; only the
+ * coordinates go through XDR. Return FALSE if the frame is not the one the
+ * index describes.
+ */
+static gmx_bool decode_frame(DecoderThread *thread, int frame,
+        DecodedFrame *slot) {
+    XtcDecoder *decoder = thread->decoder;
+    gmx_off_t offset = decoder->index->offsets[frame];
+    XtcFrameHeader header;
+    int size, i, d;
+    float precision;
+
+    if (offset < 0 || (size_t)offset + XTC_HEADER > decoder->size
+            || !xtc_decode_header((unsigned char *)decoder->map + offset,
+                &header)
+            || header.natoms != decoder->natoms) {
+        return FALSE;
+    }
+    if (fseeko(thread->in, offset + XTC_COORDS_OFFSET, SEEK_SET) != 0) {
+        return FALSE;
+    }
+    size = header.natoms;
+    if (!xdr3dfcoord(&(thread->xdr), thread->buffer, &size, &precision)) {
+        return FALSE;
+    }
+    for (i = 0; i < header.natoms; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            slot->x[i][d] = thread->buffer[i * DIM + d];
+        }
+    }
+    for (i = 0; i < DIM; ++i) {
+        for (d = 0; d < DIM; ++d) {
+            slot->box[i][d] = header.box[i * DIM + d];
+        }
+    }
+    slot->time = header.time;
+    return TRUE;
+}
+
+static void *decoder_loop(void *arg) {
+    DecoderThread *thread = (DecoderThread *)arg;
+    XtcDecoder *decoder = thread->decoder;
+    DecodedFrame *slot;
+    StageTimer timer;
+    gmx_bool bValid;
+    int position;
+
+    while (TRUE) {
+        /* Take the next frame once its slot was read */
+        pthread_mutex_lock(&decoder->lock);
+        while (!decoder->bClosing
+                && decoder->next_decode < decoder->nframes
+                && decoder->next_decode - decoder->next_read
+                    >= decoder->nslots) {
+            pthread_cond_wait(&decoder->cond, &decoder->lock);
+        }
+        if (decoder->bClosing || decoder->next_decode >= decoder->nframes) {
+            pthread_mutex_unlock(&decoder->lock);
+            break;
+        }
+        position = decoder->next_decode++;
+        pthread_mutex_unlock(&decoder->lock);
+
+        slot = &decoder->slots[position % decoder->nslots];
+        stats_start(&timer);
+        bValid = decode_frame(thread, decoder->frames[position], slot);
+        stats_stop(STAGE_READ, &timer);
+
+        pthread_mutex_lock(&decoder->lock);
+        slot->bValid = bValid;
+        slot->position = position;
+        pthread_cond_broadcast(&decoder->cond);
+        pthread_mutex_unlock(&decoder->lock);
+    }
+    return NULL;
+}
+
+XtcDecoder *open_xtc_decoder(const char *traj_fn, FrameIndex *index,
+        int *frames, int nframes, int nthreads) {
+    XtcDecoder *decoder;
+    DecoderThread *thread;
+    struct stat traj_stat;
+    int fd, i;
+
+    snew(decoder, 1);
+    fd = open(traj_fn, O_RDONLY);
+    if (fd < 0 || fstat(fd, &traj_stat) != 0 || traj_stat.st_size == 0) {
+        gmx_fatal(FARGS, "Can not map %s\n", traj_fn);
+    }
+    decoder->size = traj_stat.st_size;
+    decoder->map = mmap(NULL, decoder->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (decoder->map == MAP_FAILED) {
+        gmx_fatal(FARGS, "Can not map %s\n", traj_fn);
+    }
+    madvise(decoder->map, decoder->size, MADV_SEQUENTIAL);
+
+    decoder->index = index;
+    decoder->natoms = index->natoms;
+    snew(decoder->frames, max(nframes, 1));
+    memcpy(decoder->frames, frames, nframes * sizeof(int));
+    decoder->nframes = nframes;
+    decoder->next_decode = 0;
+    decoder->next_read = 0;
+    decoder->bClosing = FALSE;
+    decoder->nthreads = max(nthreads, 1);
+    decoder->nslots = SLOTS_PER_THREAD * decoder->nthreads;
+    snew(decoder->slots, decoder->nslots);
+    for (i = 0; i < decoder->nslots; ++i) {
+        snew(decoder->slots[i].x, max(decoder->natoms, 1));
+        decoder->slots[i].position = -1;
+        decoder->slots[i].bValid = FALSE;
+    }
+    pthread_mutex_init(&decoder->lock, NULL);
+    pthread_cond_init(&decoder->cond, NULL);
+
+    snew(decoder->threads, decoder->nthreads);
+    for (i = 0; i < decoder->nthreads; ++i) {
+        thread = &decoder->threads[i];
+        thread->decoder = decoder;
+        thread->in = fmemopen(decoder->map, decoder->size, "rb");
+        if (!thread->in) {
+            gmx_fatal(FARGS, "Can not open a stream over %s\n", traj_fn);
+        }
+        xdrstdio_create(&(thread->xdr), thread->in, XDR_DECODE);
+        snew(thread->buffer, DIM * max(decoder->natoms, 1));
+    }
+    for (i = 0; i < decoder->nthreads; ++i) {
+        if (pthread_create(&decoder->threads[i].thread, NULL, decoder_loop,
+                    &decoder->threads[i])) {
+            gmx_fatal(FARGS, "Can not start decoding thread %d\n", i);
+        }
+    }
+    fprintf(stderr, "Decoding frames on %d thread(s)\n", decoder->nthreads);
+    return decoder;
+}
+
+gmx_bool xtc_decoder_next(XtcDecoder *decoder, real *time, rvec *x,
+        matrix box) {
+    DecodedFrame *slot;
+    int position = decoder->next_read;
+
+    if (position >= decoder->nframes) {
+        return FALSE;
+    }
+    slot = &decoder->slots[position % decoder->nslots];
+    pthread_mutex_lock(&decoder->lock);
+    while (slot->position != position) {
+        pthread_cond_wait(&decoder->cond, &decoder->lock);
+    }
+    pthread_mutex_unlock(&decoder->lock);
+    if (!slot->bValid) {
+        gmx_fatal(FARGS, "Can not decode frame %d of the trajectory\n",
+                decoder->frames[position]);
+    }
+    /* The slot is not reused before next_read moves on */
+    memcpy(x, slot->x, decoder->natoms * sizeof(rvec));
+    copy_mat(slot->box, box);
+    *time = slot->time;
+
+    pthread_mutex_lock(&decoder->lock);
+    slot->position = -1;
+    decoder->next_read += 1;
+    pthread_cond_broadcast(&decoder->cond);
+    pthread_mutex_unlock(&decoder->lock);
+    return TRUE;
+}
+
+void close_xtc_decoder(XtcDecoder *decoder) {
+    int i;
+    if (!decoder) {
+        return;
+    }
+    pthread_mutex_lock(&decoder->lock);
+    decoder->bClosing = TRUE;
+    pthread_cond_broadcast(&decoder->cond);
+    pthread_mutex_unlock(&decoder->lock);
+    for (i = 0; i < decoder->nthreads; ++i) {
+        pthread_join(decoder->threads[i].thread, NULL);
+    }
+    for (i = 0; i < decoder->nthreads; ++i) {
+        xdr_destroy(&(decoder->threads[i].xdr));
+        fclose(decoder->threads[i].in);
+        sfree(decoder->threads[i].buffer);
+    }
+    sfree(decoder->threads);
+    for (i = 0; i < decoder->nslots; ++i) {
+        sfree(decoder->slots[i].x);
+    }
+    sfree(decoder->slots);
+    sfree(decoder->frames);
+    pthread_mutex_destroy(&decoder->lock);
+    pthread_cond_destroy(&decoder->cond);
+    munmap(decoder->map, decoder->size);
+    sfree(decoder);
+}
@@ -0,0 +1,81 @@
+#ifndef _xtc_decoder_h
+#define _xtc_decoder_h
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <gromacs/typedefs.h>
+#include <gromacs/xdrf.h>
+
+#include "frame_index.h"
+
+/** A frame decoded ahead of the reader
+ */
+typedef struct DecodedFrame {
+    rvec *x;
+    matrix box;
+    real time;
+    int position;       /* Position in the frame list of the frame held
+                         * by the slot, or -1 */
+    gmx_bool bValid;    /* FALSE if the frame could not be decoded */
+} DecodedFrame;
+
+struct XtcDecoder;
+
+/** Private stream of a decoding thread over the mapped trajectory
+ */
+typedef struct DecoderThread {
+    pthread_t thread;
+    struct XtcDecoder *decoder;
+    FILE *in;
+    XDR xdr;
+    float *buffer;      /* Coordinates as stored in the frame */
+} DecoderThread;
+
+/** Decode the frames of an XTC trajectory on several threads
+ *
+ * The trajectory is mapped in memory and each thread reads it through its
+ * own stream, jumping to the frames with the frame index, so only the frames
+ * of the list are decoded. The threads take the frames in order and decode
+ * them in a ring of preallocated slots; the reader gets them back in
+ * trajectory order. At most "nslots" frames are
+ * decoded ahead of the reader, and nothing is allocated once the decoder
+ * is open.
+ */
+typedef struct XtcDecoder {
+    char *map;
+    size_t size;
+    FrameIndex *index;      /* Not owned */
+    int natoms;
+    /* Frames of the index to decode, in trajectory order */
+    int *frames;
+    int nframes;
+    DecoderThread *threads;
+    int nthreads;
+    DecodedFrame *slots;
+    int nslots;
+    /* Position in the frame list of the next frame to hand to a thread,
+     * and to the reader */
+    int next_decode;
+    int next_read;
+    gmx_bool bClosing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} XtcDecoder;
+
+/** Map a trajectory and start decoding the "nframes" frames of its index
+ * listed in "frames" on "nthreads" threads
+ *
+ * The list is copied.
+ */
+XtcDecoder *open_xtc_decoder(const char *traj_fn, FrameIndex *index,
+        int *frames, int nframes, int nthreads);
+
+/** Copy the next frame; return FALSE after the last one
+ */
+gmx_bool xtc_decoder_next(XtcDecoder *decoder, real *time, rvec *x,
+        matrix box);
+
+void close_xtc_decoder(XtcDecoder *decoder);
+
+#endif /* _xtc_decoder_h */